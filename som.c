@@ -14,8 +14,12 @@ make PLATFORM=PLATFORM_DESKTOP
 sudo make install
 
 2) Compile and run the application:
-gcc -std=c99 -Wno-unused-result -O3 som.c -o som -lm -lraylib -pthread -ldl
-./som
+gcc -std=c99 -Wno-unused-result -O3 som.c som_engine.c som_simd.c som_threads.c som_batch.c som_warm_search.c som_kdtree.c som_map_file.c som_csv.c som_dataset_cache.c som_stream.c som_telemetry.c som_snapshot.c som_config.c som_quantized.c som_convergence.c -o som -lm -lraylib -pthread -ldl
+./som [-c config] [-D key=value] [-P telemetry.jsonl] [-p] [-F frames.jsonl] [trained-map.som]
+
+3) Or compile and run the headless version (no Raylib needed, see som_cli.c):
+gcc -std=c99 -Wno-unused-result -O3 som_cli.c som_engine.c som_simd.c som_threads.c som_batch.c som_warm_search.c som_kdtree.c som_map_file.c som_csv.c som_dataset_cache.c som_stream.c som_telemetry.c som_snapshot.c som_config.c som_quantized.c som_convergence.c -o som-cli -lm -pthread
+./som-cli -o inference-results.csv
 
 Notes: This is just a POC implementation that needs some refactoring. This software is intended to be used for
        educational purposes. Please, feel free to use or improve this code.
@@ -31,482 +35,414 @@ Notes: This is just a POC implementation that needs some refactoring. This softw
 #include <float.h>
 #include <stdbool.h>
 #include <string.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <raylib.h>
+#include "som.h"
 
 // Window size
 #define SCREEN_WIDTH 1200
 #define SCREEN_HEIGHT 1200
 
-// Neural Network size
-#define MAP_WIDTH 300
-#define MAP_HEIGHT 300
-
 // Neural Network canvas size
 #define MAP_LAYOUT_WIDTH 900
 #define MAP_LAYOUT_HEIGHT 900
 
-// Training algorithm parameters
-#define INITIAL_TRAINING_ITERATIONS_PER_EPOCH 300
-#define TOTAL_EPOCHS 8
-#define INITIAL_RADIUS 200.0L
-#define INITIAL_LEARNING_RULE 0.9L
+// Smallest map side the viewer can draw, with the color scale and its labels at the bottom
+#define VIEWER_MIN_MAP_SIDE 32
 
-// Basic math macros
-#define pow2(x) ((x) * (x))
-#define max(a, b) (((a) > (b)) ? (a) : (b))
-#define min(X, Y) (((X) < (Y)) ? (X) : (Y))
+// Frames per second of the viewer while the map is trained on a thread of its own
+#define VIEWER_TARGET_FPS 60
 
 // Total colors paintbrush palette
 #define MAX_COLORS_COUNT 18
+#define PALETTE_HEIGHT 90
 
-typedef struct Neuron
-{
-  double *weights;
-} Neuron;
+// 3D view of the map. The mesh has at most HEIGHTMAP_RESOLUTION x HEIGHTMAP_RESOLUTION vertices, so it can be
+// indexed with 16-bit indices.
+#define HEIGHTMAP_RESOLUTION 128
+#define HEIGHTMAP_SIDE 16.0f
+#define HEIGHTMAP_HEIGHT (8.0f / 3.0f) // Height of the neurons with a weight of 1
 
-typedef struct BMU
+// CPU copy of a texture, uploaded with a single call when its pixels change
+typedef struct PixelLayer
 {
-  int x_coord;
-  int y_coord;
-} BMU;
-
-typedef struct Coordinate
+  Texture2D texture;
+  Color *pixels;
+  int width;
+  int height;
+} PixelLayer;
+
+// Render texture composited by every frame and redrawn only after being invalidated
+typedef struct CachedLayer
 {
-  double x;
-  double y;
-} Coordinate;
+  RenderTexture2D target;
+  bool stale;
+} CachedLayer;
 
-typedef struct Sample
+// Trains the map on a thread of its own, publishing snapshots of the codebook for the viewer
+typedef struct TrainingWorker
 {
-  double *components;
-  double value;
-  BMU bmu;
-} Sample;
-
-typedef struct ComponentInfo
-{
-  char *name;
-  double max_value;
-  char *max_value_str;
-  double min_value;
-  char *min_value_str;
-} ComponentInfo;
-
-typedef struct DatasetInfo
-{
-  ComponentInfo *components;
-  Sample *samples;
-  int total_components;
-  int total_dataset_samples;
-} DatasetInfo;
-
-Neuron **map;
+  Trainer *trainer;
+  CodebookSnapshots *snapshots;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t resumed;
+  bool paused;   // Set under the mutex, read atomically by the worker
+  bool stopping; // Atomic
+  bool finished; // Atomic, set once the last snapshot is published
+} TrainingWorker;
+
+SOMMap map;
+SOMMap *shown_map = &map; // The map drawn: the newest snapshot during the training, the map itself afterwards
+PixelLayer map_layer; // Heatmap of the selected component, one pixel per neuron
+PixelLayer samples_layer; // BMUs of the inferenced samples
+int map_layer_component = -1;
+bool map_layer_stale = true;
+
+// Layers of the viewer, composited by draw_viewer_frame. The map view and the indicator have the size of the map
+// and are scaled to the map layout.
+CachedLayer map_view;        // Heatmap with the labels of its component, or the BMUs of the inferenced samples
+CachedLayer indicator_layer; // Weight and value of the neuron pointed by the mouse cursor
+CachedLayer marker_layer;    // Marker strokes, added as they are drawn
+CachedLayer text_layer;      // Components and keys
+CachedLayer palette_layer;   // Marker colors
+
+// Heightmap mesh, created once. Its vertex heights follow the weights of the selected component.
+Model heightmap_model;
+int heightmap_columns;
+int heightmap_rows;
+int heightmap_component = -1;
+bool heightmap_stale = true;
+bool heightmap_loaded = false;
 DatasetInfo info = {
     .components = NULL,
     .samples = NULL,
     .total_components = 0,
     .total_dataset_samples = 0};
 
-char dataset_csv_file[] = "winequality-white-normalized.csv";
-int epoch = 0;
-int iteration = 0;
-int iterations_per_epoch = INITIAL_TRAINING_ITERATIONS_PER_EPOCH;
+SOMConfig config; // Dataset, map size and training schedule, set with -c and -D
 
-int get_total_ocurrences_of_char(const char *s, char c)
+void free_allocated_memory()
 {
-  int i, count = 0;
-  for (i = 0; s[i]; i++)
-    if (s[i] == c)
-      count++;
-  return count;
+  free_dataset(&info);
+  free_som_map(&map);
 }
 
-int get_csv_total_rows_from_file(char *filename)
+void *training_worker(void *arg)
 {
-  int count = 0;
-  FILE *fp = fopen(filename, "r");
-
-  if (fp == NULL)
-  {
-    printf("Could not open file %s", filename);
-    return 0;
-  }
+  TrainingWorker *worker = (TrainingWorker *)arg;
+  Trainer *trainer = worker->trainer;
 
-  for (char c = getc(fp); c != EOF; c = getc(fp))
-    if (c == '\n')
-      count++;
-
-  fclose(fp);
+  while (!__atomic_load_n(&worker->stopping, __ATOMIC_RELAXED) && begin_next_epoch(trainer))
+    while (!__atomic_load_n(&worker->stopping, __ATOMIC_RELAXED) && train_next_iteration(trainer))
+    {
+      publish_codebook_snapshot(worker->snapshots, trainer, false);
 
-  if (count >= 3)
-    count -= 3; // Discount the header row, min values row, max values row
+      if (__atomic_load_n(&worker->paused, __ATOMIC_RELAXED))
+      {
+        pthread_mutex_lock(&worker->mutex);
+        while (worker->paused && !worker->stopping)
+          pthread_cond_wait(&worker->resumed, &worker->mutex);
+        pthread_mutex_unlock(&worker->mutex);
+      }
+    }
 
-  return count;
+  publish_codebook_snapshot(worker->snapshots, trainer, true);
+  __atomic_store_n(&worker->finished, true, __ATOMIC_RELEASE);
+  return NULL;
 }
 
-void load_dataset_info(char *filename)
+bool start_training_worker(TrainingWorker *worker, Trainer *trainer, CodebookSnapshots *snapshots)
 {
-  FILE *fp = fopen(filename, "r");
-  char buffer[512];
-  char *ptr;
-
-  if (fp == NULL)
-  {
-    printf("Could not open file %s", filename);
-    return;
-  }
-
-  // Read the first line and get the fields names
-  fgets(buffer, sizeof(buffer), fp);
-
-  info.total_components = get_total_ocurrences_of_char(buffer, ';') + 1;
-  printf("Total fields: %d\n", info.total_components);
-  info.components = malloc(info.total_components * sizeof(ComponentInfo));
-
-  char *token = strtok(buffer, ";");
-  int i = 0;
-  while (token != NULL)
-  {
-    info.components[i].name = malloc((strlen(token) + 1) * sizeof(char));
-    printf(" field %d: %s\n", i, token);
-    strcpy(info.components[i++].name, token);
-    token = strtok(NULL, ";");
-  }
-
-  // Read the second line and get the min value of each component
-  fgets(buffer, sizeof(buffer), fp);
-  token = strtok(buffer, ";");
-  i = 0;
-  while (token != NULL)
-  {
-    info.components[i].min_value_str = malloc((strlen(token) + 1) * sizeof(char));
-    info.components[i].min_value = strtod(token, &ptr);
-    strcpy(info.components[i++].min_value_str, token);
-    token = strtok(NULL, ";");
-  }
-
-  /// Read the third line and get the max value of each component
-  fgets(buffer, sizeof(buffer), fp);
-  fclose(fp);
-
-  token = strtok(buffer, ";");
-  i = 0;
-  while (token != NULL)
-  {
-    info.components[i].max_value_str = malloc((strlen(token) + 1) * sizeof(char));
-    info.components[i].max_value = strtod(token, &ptr);
-    strcpy(info.components[i++].max_value_str, token);
-    token = strtok(NULL, ";");
-  }
-
-  info.total_dataset_samples = get_csv_total_rows_from_file(filename);
-  printf("\n\nTotal samples: %d\n\n", info.total_dataset_samples);
+  worker->trainer = trainer;
+  worker->snapshots = snapshots;
+  worker->paused = false;
+  worker->stopping = false;
+  worker->finished = false;
+  pthread_mutex_init(&worker->mutex, NULL);
+  pthread_cond_init(&worker->resumed, NULL);
+  if (pthread_create(&worker->thread, NULL, training_worker, worker) != 0)
+  {
+    printf("Could not start the training thread\n");
+    pthread_mutex_destroy(&worker->mutex);
+    pthread_cond_destroy(&worker->resumed);
+    return false;
+  }
+  return true;
 }
 
-void load_dataset_samples(char *filename)
+void set_training_paused(TrainingWorker *worker, bool paused)
 {
-  // 'samples' is the data structure used to store the sample points for Kohonen algorithm process
-  info.samples = (Sample *)malloc(sizeof(Sample) * info.total_dataset_samples);
-
-  for (int i = 0; i < info.total_dataset_samples; i++)
-  {
-    info.samples[i].components = (double *)malloc(sizeof(double) * (info.total_components - 1));
-    info.samples[i].bmu.x_coord = 0;
-    info.samples[i].bmu.y_coord = 0;
-  }
-
-  FILE *fp = fopen(filename, "r");
-  char buffer[512];
-  int i, line_count = 0;
-  char *end_ptr;
-
-  if (fp == NULL)
-  {
-    printf("Could not open file %s", filename);
-    return;
-  }
-
-  // ignore the first 3 lines
-  for (int e = 0; e < 3; e++)
-    fgets(buffer, sizeof(buffer), fp);
-
-  while (fgets(buffer, sizeof(buffer), fp) && (line_count < info.total_dataset_samples))
-  {
-    char *token = strtok(buffer, ";");
-    i = 0;
-    while (token != NULL)
-    {
-      if (i == info.total_components - 1)
-        info.samples[line_count].value = strtod(token, &end_ptr);
-      else
-        info.samples[line_count].components[i] = strtod(token, &end_ptr);
-      token = strtok(NULL, ";");
-      i++;
-    }
-    line_count++;
-  }
-
-  fclose(fp);
+  pthread_mutex_lock(&worker->mutex);
+  __atomic_store_n(&worker->paused, paused, __ATOMIC_RELAXED);
+  pthread_cond_signal(&worker->resumed);
+  pthread_mutex_unlock(&worker->mutex);
 }
 
-void load_dataset(char *filename)
+// Stops the training after the current iteration, even if it is paused, and waits for the thread
+void stop_training_worker(TrainingWorker *worker)
 {
-  // Load dataset attributes names, total attributes and total samples
-  load_dataset_info(filename);
-
-  // Load dataset samples
-  load_dataset_samples(filename);
+  pthread_mutex_lock(&worker->mutex);
+  __atomic_store_n(&worker->stopping, true, __ATOMIC_RELAXED);
+  pthread_cond_signal(&worker->resumed);
+  pthread_mutex_unlock(&worker->mutex);
+
+  pthread_join(worker->thread, NULL);
+  pthread_mutex_destroy(&worker->mutex);
+  pthread_cond_destroy(&worker->resumed);
 }
 
-void initialize_som_map()
+bool load_pixel_layer(PixelLayer *layer, int width, int height)
 {
-  map = (Neuron **)malloc(sizeof(Neuron *) * MAP_WIDTH);
-
-  for (int x = 0; x < MAP_WIDTH; x++)
-    map[x] = (Neuron *)malloc(sizeof(Neuron) * MAP_HEIGHT);
+  Image image = GenImageColor(width, height, BLACK);
+  layer->texture = LoadTextureFromImage(image);
+  UnloadImage(image);
+  layer->width = width;
+  layer->height = height;
+  layer->pixels = (Color *)malloc(sizeof(Color) * width * height);
+  return layer->pixels != NULL;
+}
 
-  for (int x = 0; x < MAP_WIDTH; x++)
-    for (int y = 0; y < MAP_HEIGHT; y++)
-    {
-      map[x][y].weights = (double *)malloc(sizeof(double) * (info.total_components - 1));
-      for (int i = 0; i < info.total_components - 1; i++)
-        map[x][y].weights[i] = (double)rand() / (double)RAND_MAX; // a random double value between 0 and 1
-    }
+void unload_pixel_layer(PixelLayer *layer)
+{
+  UnloadTexture(layer->texture);
+  free(layer->pixels);
+  layer->pixels = NULL;
 }
 
-Sample *pick_random_sample()
+// The weights changed, the heatmap, the heightmap and the layers showing weights have to be redrawn
+void invalidate_map_layer()
 {
-  int i = rand() % info.total_dataset_samples;
-  return &info.samples[i];
+  map_layer_stale = true;
+  heightmap_stale = true;
+  map_view.stale = true;
+  indicator_layer.stale = true;
 }
 
-double distance_between_sample_and_neuron(Sample *sample, Neuron *neuron, int total_components)
+// Paints the weights of a component into the heatmap, with the color scale at the bottom, and uploads it. Nothing
+// is done while the weights and the component are the ones of the last upload.
+void refresh_map_layer(int component_index)
 {
-  double euclidean_distance = 0.0f;
-  double component_diff;
+  if (!map_layer_stale && (map_layer_component == component_index))
+    return;
 
-  for (int i = 0; i < total_components - 1; i++)
-  {
-    component_diff = sample->components[i] - neuron->weights[i];
-    euclidean_distance += pow2(component_diff);
-  }
+  for (int n = 0; n < shown_map->total_neurons; n++)
+    map_layer.pixels[n] = (Color){(unsigned char)(*get_neuron_weight(shown_map, n, component_index) * 255), 0, 0, 255};
+
+  for (int y = config.map_height - 12; y < config.map_height - 3; y++)
+    for (int x = 0; x < config.map_width; x++)
+      map_layer.pixels[y * config.map_width + x] = (Color){(unsigned char)((x * 255) / config.map_width), 0, 0, 255};
 
-  //return the Euclidean_distance;
-  return sqrt(euclidean_distance);
+  UpdateTexture(map_layer.texture, map_layer.pixels);
+  map_layer_component = component_index;
+  map_layer_stale = false;
 }
 
-void search_bmu(Sample *sample, BMU *bmu, int total_components)
+// Grid of vertices over the map, two triangles per cell, textured with the heatmap layer
+void load_heightmap_model()
 {
-  double dist, min_dist = DBL_MAX;
-  for (int x = 0; x < MAP_WIDTH; x++)
-    for (int y = 0; y < MAP_HEIGHT; y++)
+  Mesh mesh = {0};
+  int columns = min(config.map_width, HEIGHTMAP_RESOLUTION);
+  int rows = min(config.map_height, HEIGHTMAP_RESOLUTION);
+
+  mesh.vertexCount = columns * rows;
+  mesh.triangleCount = (columns - 1) * (rows - 1) * 2;
+  mesh.vertices = (float *)MemAlloc(sizeof(float) * 3 * mesh.vertexCount);
+  mesh.normals = (float *)MemAlloc(sizeof(float) * 3 * mesh.vertexCount);
+  mesh.texcoords = (float *)MemAlloc(sizeof(float) * 2 * mesh.vertexCount);
+  mesh.indices = (unsigned short *)MemAlloc(sizeof(unsigned short) * 3 * mesh.triangleCount);
+
+  for (int z = 0; z < rows; z++)
+    for (int x = 0; x < columns; x++)
     {
-      dist = distance_between_sample_and_neuron(sample, &map[x][y], total_components);
-      if (dist < min_dist)
-      {
-        bmu->x_coord = x;
-        bmu->y_coord = y;
-        min_dist = dist;
-      }
+      int v = z * columns + x;
+      mesh.vertices[3 * v] = (HEIGHTMAP_SIDE * x) / (columns - 1);
+      mesh.vertices[3 * v + 1] = 0.0f;
+      mesh.vertices[3 * v + 2] = (HEIGHTMAP_SIDE * z) / (rows - 1);
+      mesh.normals[3 * v] = 0.0f;
+      mesh.normals[3 * v + 1] = 1.0f;
+      mesh.normals[3 * v + 2] = 0.0f;
+      mesh.texcoords[2 * v] = (float)x / (columns - 1);
+      mesh.texcoords[2 * v + 1] = (float)z / (rows - 1);
     }
-}
 
-double get_coordinate_distance(Coordinate *p1, Coordinate *p2)
-{
-  double x_sub = (p1->x) - (p2->x);
-  double y_sub = (p1->y) - (p2->y);
-  return sqrt(x_sub * x_sub + y_sub * y_sub);
-}
-
-void scale_neuron_at_position(int x, int y, Sample *sample, double scale, int total_components)
-{
-  double neuron_prescaled, neuron_scaled;
-  Neuron *neuron = &map[x][y];
+  int i = 0;
+  for (int z = 0; z < rows - 1; z++)
+    for (int x = 0; x < columns - 1; x++)
+    {
+      unsigned short v = z * columns + x;
+      unsigned short cell[6] = {v, v + columns, v + 1, v + 1, v + columns, v + columns + 1};
+      memcpy(&mesh.indices[i], cell, sizeof(cell));
+      i += 6;
+    }
 
-  for (int i = 0; i < total_components - 1; i++)
-  {
-    neuron_prescaled = neuron->weights[i] * (1.0f - scale);
-    neuron_scaled = (sample->components[i] * scale) + neuron_prescaled;
-    neuron->weights[i] = (double)neuron_scaled;
-  }
+  // Dynamic, the heights are rewritten in place
+  UploadMesh(&mesh, true);
+  heightmap_model = LoadModelFromMesh(mesh);
+  heightmap_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = map_layer.texture;
+  heightmap_columns = columns;
+  heightmap_rows = rows;
+  heightmap_loaded = true;
 }
 
-void scale_neighbors(BMU *bmu, Sample *sample, double iteration_radius, double learning_rule, int total_components)
+void unload_heightmap_model()
 {
-  static Coordinate center = {
-          .x = 0.0L,
-          .y = 0.0L
-  };
-
-  static Coordinate outer;
-  outer.x = outer.y = iteration_radius;
-
-  double distance, scale;
-  int y_coord, x_coord, x_offset, y_offset, int_iteration_radius = (int)iteration_radius;
+  if (!heightmap_loaded)
+    return;
 
-  for (int y = -int_iteration_radius; y < int_iteration_radius; y++)
-    for (int x = -int_iteration_radius; x < int_iteration_radius; x++)
-      {
-        outer.x = x;
-        outer.y = y;
-        distance = get_coordinate_distance(&outer, &center);
-        if (distance < iteration_radius)
-        {
-          scale = learning_rule * exp(-10.0f * (distance * distance) / (iteration_radius * iteration_radius));
-          x_offset = x + bmu->x_coord;
-          y_offset = y + bmu->y_coord;
-          x_coord = x_offset < 0 ? MAP_WIDTH + x_offset : (x_offset >= MAP_WIDTH ? x_offset - MAP_WIDTH: x_offset);
-          y_coord = y_offset < 0 ? MAP_HEIGHT + y_offset : (y_offset >= MAP_HEIGHT ? y_offset - MAP_HEIGHT : y_offset);
-          scale_neuron_at_position(x_coord, y_coord, sample, scale, total_components);
-        }
-      }
+  // The texture is the heatmap layer, unloaded with it
+  heightmap_model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = (Texture2D){0};
+  UnloadModel(heightmap_model);
+  heightmap_loaded = false;
 }
 
-void free_allocated_memory()
+// Moves the vertices to the weights of a component and uploads their positions. Nothing is done while the weights
+// and the component are the ones of the last upload.
+void refresh_heightmap_model(int component_index)
 {
-  for (int i = 0; i < info.total_components; i++)
-  {
-    free(info.components[i].name);
-    free(info.components[i].max_value_str);
-    free(info.components[i].min_value_str);
-  }
-  free(info.components);
+  Mesh *mesh = &heightmap_model.meshes[0];
 
-  for (int i = 0; i < info.total_dataset_samples; i++)
-    free(info.samples[i].components);
-  free(info.samples);
+  if (!heightmap_stale && (heightmap_component == component_index))
+    return;
 
-  for (int x = 0; x < MAP_WIDTH; x++)
+  for (int z = 0; z < heightmap_rows; z++)
   {
-    for (int y = 0; y < MAP_HEIGHT; y++)
-      free(map[x][y].weights);
-    free(map[x]);
+    int y = (z * (config.map_height - 1)) / (heightmap_rows - 1);
+    for (int x = 0; x < heightmap_columns; x++)
+    {
+      int neuron = y * shown_map->width + (x * (config.map_width - 1)) / (heightmap_columns - 1);
+      mesh->vertices[3 * (z * heightmap_columns + x) + 1] = (float)*get_neuron_weight(shown_map, neuron, component_index) * HEIGHTMAP_HEIGHT;
+    }
   }
-  free(map);
-}
 
-unsigned long createRGBA(int r, int g, int b, int a)
-{
-  return ((r & 0xff) << 24) + ((g & 0xff) << 16) + ((b & 0xff) << 8) + (a & 0xff);
+  UpdateMeshBuffer(*mesh, 0, mesh->vertices, sizeof(float) * 3 * mesh->vertexCount, 0);
+  heightmap_component = component_index;
+  heightmap_stale = false;
 }
 
-void clear_texture(RenderTexture2D *texture, Color color)
-{
-  BeginDrawing();
-  BeginTextureMode(*texture);
-  ClearBackground(color);
-  EndTextureMode();
-  EndDrawing();
-}
-
-void update_heightmap_3d(RenderTexture2D *render_texture, int component_index)
+// 3D view of the map, with the heatmap at the top right corner. Drawn inside the frame of draw_viewer_frame.
+void draw_heightmap_3d()
 {
   static const Camera camera = {{18.0f, 18.0f, 18.0f}, {0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, 45.0f, 0};
   static const Vector3 mapPosition = {-8.0f, 0.0f, -8.0f};
-  Image image = LoadImageFromTexture(render_texture->texture);
-  Mesh mesh = GenMeshHeightmap(image, (Vector3){16, 8, 16});
-  UnloadImage(image);
-  Model model = LoadModelFromMesh(mesh);
-  model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = render_texture->texture;
-
-  BeginDrawing();
 
   BeginMode3D(camera);
   ClearBackground(GREEN);
-  DrawModel(model, mapPosition, 1.0f, RED);
+  DrawModel(heightmap_model, mapPosition, 1.0f, RED);
   EndMode3D();
 
-  BeginTextureMode(*render_texture);
+  DrawTexturePro(map_layer.texture, (Rectangle){0, 0, (float)map_layer.width, (float)map_layer.height}, (Rectangle){SCREEN_WIDTH - 210, 10, 200, 200}, (Vector2){0.0f, 0.0f}, 0, WHITE);
+}
 
-  for (int y = 0; y < MAP_HEIGHT; y++)
-    for (int x = 0; x < MAP_WIDTH; x++)
-      DrawPixel(x, y, GetColor(createRGBA((int)(map[x][y].weights[component_index] * 255), 0, 0, 255)));
+void load_cached_layer(CachedLayer *layer, int width, int height)
+{
+  layer->target = LoadRenderTexture(width, height);
+  layer->stale = true;
+}
 
+void clear_cached_layer(CachedLayer *layer, Color color)
+{
+  BeginTextureMode(layer->target);
+  ClearBackground(color);
   EndTextureMode();
-  DrawTexturePro(render_texture->texture, (Rectangle){0, 0, (float)render_texture->texture.width, (float)-render_texture->texture.height}, (Rectangle){SCREEN_WIDTH - 210, 10, 200, 200}, (Vector2){0.0f, 0.0f}, 0, WHITE);
+}
 
-  EndDrawing();
+// Render textures are stored upside down, hence the negative height of the source
+void draw_cached_layer(CachedLayer *layer, Rectangle destination)
+{
+  Texture2D texture = layer->target.texture;
+  DrawTexturePro(texture, (Rectangle){0, 0, (float)texture.width, (float)-texture.height}, destination, (Vector2){0.0f, 0.0f}, 0, WHITE);
 }
 
-void draw_text(RenderTexture2D *render_texture, char *text)
+// Shows a message instead of the map until the map view is invalidated
+void draw_message(char *text)
 {
-  BeginDrawing();
-  BeginTextureMode(*render_texture);
+  BeginTextureMode(map_view.target);
+  ClearBackground(BLACK);
   DrawText(text, 10, 10, 20, RAYWHITE);
   EndTextureMode();
-  DrawTexturePro(render_texture->texture, (Rectangle){0, 0, (float)render_texture->texture.width, (float)-render_texture->texture.height}, (Rectangle){0, 0, MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT}, (Vector2){0.0f, 0.0f}, 0, WHITE);
-  EndDrawing();
+  map_view.stale = false;
 }
 
-void update_texture(RenderTexture2D *render_texture, int component_index, Neuron *neuron_at_mouse_position)
+void refresh_map_view(int component_index, bool show_samples_in_map)
 {
-  BeginDrawing();
-  BeginTextureMode(*render_texture);
+  if (!map_view.stale)
+    return;
 
-  for (int y = 0; y < MAP_HEIGHT; y++)
-    for (int x = 0; x < MAP_WIDTH; x++)
-      DrawPixel(x, y, GetColor(createRGBA((int)(map[x][y].weights[component_index] * 255), 0, 0, 255)));
+  if (!show_samples_in_map)
+    refresh_map_layer(component_index);
 
-  DrawText(info.components[component_index].name, 10, 10, 20, RAYWHITE);
+  BeginTextureMode(map_view.target);
+  if (show_samples_in_map)
+    DrawTexture(samples_layer.texture, 0, 0, WHITE);
+  else
+  {
+    DrawTexture(map_layer.texture, 0, 0, WHITE);
+    DrawText(info.components[component_index].name, 10, 10, 20, RAYWHITE);
+    DrawText(info.components[component_index].min_value_str, 2, config.map_height - 12, 1, RAYWHITE);
+    DrawText(info.components[component_index].max_value_str, config.map_width - 30, config.map_height - 12, 1, RAYWHITE);
+  }
+  EndTextureMode();
+  map_view.stale = false;
+}
 
-  for (int x = 0; x < MAP_WIDTH; x++)
-    DrawLineEx((Vector2){x, MAP_HEIGHT - 12}, (Vector2){x, MAP_HEIGHT - 3}, 1.0f, GetColor(createRGBA((int)((x * 255) / MAP_WIDTH), 0, 0, 255)));
+void refresh_indicator_layer(int component_index, int neuron_at_mouse_position)
+{
+  if (!indicator_layer.stale)
+    return;
 
-  if (neuron_at_mouse_position != NULL)
-  {
-    // Draw the green indicator according to the weight of the neuron being pointed by the mouse cursor
-    int indicator_x = (int)(neuron_at_mouse_position->weights[component_index] * MAP_WIDTH);
-    DrawLineEx((Vector2){indicator_x, MAP_HEIGHT - 12}, (Vector2){indicator_x, MAP_HEIGHT - 3}, 1.0f, GREEN);
+  BeginTextureMode(indicator_layer.target);
+  ClearBackground(BLANK);
 
-    // Calculate and draw the value that corresponds to the neuron being pointed by the mouse cursor
-    static char value_str[50];
-    double value = ((info.components[component_index].max_value - info.components[component_index].min_value) * neuron_at_mouse_position->weights[component_index]) + info.components[component_index].min_value;
-    snprintf(value_str, 50, "%f", value);
-    DrawText(value_str, (MAP_WIDTH/2)-10, MAP_HEIGHT - 25, 1, RAYWHITE);
-  }
+  // Draw the green indicator according to the weight of the neuron being pointed by the mouse cursor
+  int indicator_x = (int)(*get_neuron_weight(shown_map, neuron_at_mouse_position, component_index) * config.map_width);
+  DrawLineEx((Vector2){indicator_x, config.map_height - 12}, (Vector2){indicator_x, config.map_height - 3}, 1.0f, GREEN);
 
-  DrawText(info.components[component_index].min_value_str, 2, MAP_HEIGHT - 12, 1, RAYWHITE);
-  DrawText(info.components[component_index].max_value_str, MAP_WIDTH - 30, MAP_HEIGHT - 12, 1, RAYWHITE);
+  // Calculate and draw the value that corresponds to the neuron being pointed by the mouse cursor
+  static char value_str[50];
+  double value = ((info.components[component_index].max_value - info.components[component_index].min_value) * *get_neuron_weight(shown_map, neuron_at_mouse_position, component_index)) + info.components[component_index].min_value;
+  snprintf(value_str, 50, "%f", value);
+  DrawText(value_str, (config.map_width/2)-10, config.map_height - 25, 1, RAYWHITE);
 
   EndTextureMode();
-  DrawTexturePro(render_texture->texture, (Rectangle){0, 0, (float)render_texture->texture.width, (float)-render_texture->texture.height}, (Rectangle){0, 0, MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT}, (Vector2){0.0f, 0.0f}, 0, WHITE);
-  EndDrawing();
+  indicator_layer.stale = false;
 }
 
-void update_samples_texture(RenderTexture2D *render_texture)
+void refresh_samples_layer()
 {
-  BeginDrawing();
-  BeginTextureMode(*render_texture);
-  ClearBackground(WHITE);
+  for (int n = 0; n < samples_layer.width * samples_layer.height; n++)
+    samples_layer.pixels[n] = WHITE;
 
   for (int i = 0; i < info.total_dataset_samples; i++)
   {
-    if (info.samples[i].value >= 8)
+    Color *pixel = &samples_layer.pixels[info.samples[i].bmu.y_coord * samples_layer.width + info.samples[i].bmu.x_coord];
+    if (info.targets[i] >= 8)
     {
       // Red pixels represents high quality wine samples
-      DrawPixel(info.samples[i].bmu.x_coord, info.samples[i].bmu.y_coord, GetColor(createRGBA(255, 0, 0, 255)));
+      *pixel = (Color){255, 0, 0, 255};
     }
-    else if (info.samples[i].value >= 6)
+    else if (info.targets[i] >= 6)
     {
       // Green pixels represents average quality wine samples
-      DrawPixel(info.samples[i].bmu.x_coord, info.samples[i].bmu.y_coord, GetColor(createRGBA(0, 255, 0, 255)));
+      *pixel = (Color){0, 255, 0, 255};
     }
-    else if (info.samples[i].value >= 0)
+    else if (info.targets[i] >= 0)
     {
       // Blue pixels represents poor quality wine samples
-      DrawPixel(info.samples[i].bmu.x_coord, info.samples[i].bmu.y_coord, GetColor(createRGBA(0, 0, 255, 255)));
+      *pixel = (Color){0, 0, 255, 255};
     }
   }
-
-  EndTextureMode();
-  DrawTexturePro(render_texture->texture, (Rectangle){0, 0, (float)render_texture->texture.width, (float)-render_texture->texture.height}, (Rectangle){0, 0, MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT}, (Vector2){0.0f, 0.0f}, 0, WHITE);
-  EndDrawing();
+  UpdateTexture(samples_layer.texture, samples_layer.pixels);
+  map_view.stale = true;
 }
 
-void update_text_texture(RenderTexture2D *texture, int selected_component_index, bool training_finished)
+void refresh_text_layer(bool training_finished)
 {
-  BeginDrawing();
-  BeginTextureMode(*texture);
+  if (!text_layer.stale)
+    return;
+
+  BeginTextureMode(text_layer.target);
   ClearBackground(BLACK);
 
   DrawText("Components:", 10, 10, 40, RAYWHITE);
@@ -525,6 +461,7 @@ void update_text_texture(RenderTexture2D *texture, int selected_component_index,
   {
     DrawText("Press ENTER key to stop", 10, 70 + (44 * info.total_components) + 180, 28, YELLOW);
     DrawText("training and run inference.", 10, 70 + (44 * info.total_components) + 210, 28, YELLOW);
+    DrawText("Press P key to pause it.", 10, 70 + (44 * info.total_components) + 240, 28, YELLOW);
   }
   else
   {
@@ -538,27 +475,69 @@ void update_text_texture(RenderTexture2D *texture, int selected_component_index,
   DrawText("marker marks.", 10, 70 + (44 * info.total_components) + 380, 28, RAYWHITE);
 
   EndTextureMode();
-  DrawTexturePro(texture->texture, (Rectangle){0, 0, 400, -1200}, (Rectangle){MAP_LAYOUT_WIDTH, 0, 300, 900}, (Vector2){0.0f, 0.0f}, 0, WHITE);
-
-  EndDrawing();
+  text_layer.stale = false;
 }
 
-void update_colorpicker_texture(RenderTexture2D *paint_render, int color_selected, Color *colors, Rectangle *color_rectangles)
+// The palette is drawn at the bottom of the text panel, the color rectangles are in screen coordinates
+void refresh_palette_layer(int color_selected, Color *colors, Rectangle *color_rectangles)
 {
-  BeginDrawing();
-  DrawTextureRec(paint_render->texture, (Rectangle){0, 0, (float)paint_render->texture.width, (float)-paint_render->texture.height}, (Vector2){0, 0}, WHITE);
-  // Draw top panel
-  DrawRectangle(MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT - 90, SCREEN_WIDTH, 90, RAYWHITE);
+  if (!palette_layer.stale)
+    return;
+
+  BeginTextureMode(palette_layer.target);
+  ClearBackground(RAYWHITE);
 
   // Draw color selection rectangles
   for (int i = 0; i < MAX_COLORS_COUNT; i++)
-    DrawRectangleRec(color_rectangles[i], colors[i]);
+    DrawRectangleRec((Rectangle){color_rectangles[i].x - MAP_LAYOUT_WIDTH, color_rectangles[i].y - (MAP_LAYOUT_HEIGHT - PALETTE_HEIGHT), color_rectangles[i].width, color_rectangles[i].height}, colors[i]);
+
+  Rectangle selected = color_rectangles[color_selected];
+  DrawRectangleLinesEx((Rectangle){selected.x - MAP_LAYOUT_WIDTH - 2, selected.y - (MAP_LAYOUT_HEIGHT - PALETTE_HEIGHT) - 2, selected.width + 4, selected.height + 4}, 2, BLACK);
 
-  DrawRectangleLinesEx((Rectangle){color_rectangles[color_selected].x - 2, color_rectangles[color_selected].y - 2, color_rectangles[color_selected].width + 4, color_rectangles[color_selected].height + 4}, 2, BLACK);
+  EndTextureMode();
+  palette_layer.stale = false;
+}
+
+// Redraws the layers invalidated since the last frame and composites all of them. Without invalidations a frame
+// only draws five textures.
+void draw_viewer_frame(int selected_component_index, int neuron_at_mouse_position, bool training_finished, bool show_samples_in_map, bool show_3d_surface_plot, int color_selected, Color *colors, Rectangle *color_rectangles)
+{
+  static const Rectangle map_layout = {0, 0, MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT};
+  bool show_indicator = (neuron_at_mouse_position >= 0) && !show_samples_in_map;
+
+  if (show_3d_surface_plot)
+  {
+    if (!heightmap_loaded)
+      load_heightmap_model();
+    refresh_map_layer(selected_component_index);
+    refresh_heightmap_model(selected_component_index);
+  }
+  else
+  {
+    refresh_map_view(selected_component_index, show_samples_in_map);
+    if (show_indicator)
+      refresh_indicator_layer(selected_component_index, neuron_at_mouse_position);
+    refresh_text_layer(training_finished);
+    refresh_palette_layer(color_selected, colors, color_rectangles);
+  }
+
+  BeginDrawing();
+  ClearBackground(BLACK);
+  if (show_3d_surface_plot)
+    draw_heightmap_3d();
+  else
+  {
+    draw_cached_layer(&map_view, map_layout);
+    if (show_indicator)
+      draw_cached_layer(&indicator_layer, map_layout);
+    draw_cached_layer(&marker_layer, map_layout);
+    draw_cached_layer(&text_layer, (Rectangle){MAP_LAYOUT_WIDTH, 0, SCREEN_WIDTH - MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT});
+    draw_cached_layer(&palette_layer, (Rectangle){MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT - PALETTE_HEIGHT, SCREEN_WIDTH - MAP_LAYOUT_WIDTH, PALETTE_HEIGHT});
+  }
   EndDrawing();
 }
 
-void process_key_pressed(int *selected_component_index, Neuron *neuron_at_mouse_position, bool *training_finished, int *color_selected, bool *show_3d_surface_plot, bool *show_samples_in_map, RenderTexture2D *render_texture, RenderTexture2D *texture, RenderTexture2D *marker_texture)
+void process_key_pressed(int *selected_component_index, bool *training_finished, bool *training_paused, int *color_selected, bool *show_3d_surface_plot, bool *show_samples_in_map)
 {
   int key_pressed = GetKeyPressed();
   bool text_need_update = false;
@@ -585,10 +564,15 @@ void process_key_pressed(int *selected_component_index, Neuron *neuron_at_mouse_
     *training_finished = true;
     text_need_update = true;
   }
+  else if ((key_pressed == 80) && !*training_finished) // P key
+  {
+    // Pause/resume training
+    *training_paused = !*training_paused;
+  }
   else if (key_pressed == 32) // SPACE key
   {
     // Clean marker marks
-    clear_texture(marker_texture, BLANK);
+    clear_cached_layer(&marker_layer, BLANK);
   }
   else if (key_pressed == 86) // V key
   {
@@ -612,7 +596,7 @@ void process_key_pressed(int *selected_component_index, Neuron *neuron_at_mouse_
   {
     // Show inferenced results
     *show_samples_in_map = true;
-    update_samples_texture(render_texture);
+    map_view.stale = true;
   }
 
   if (color_changed)
@@ -621,30 +605,26 @@ void process_key_pressed(int *selected_component_index, Neuron *neuron_at_mouse_
       *color_selected = MAX_COLORS_COUNT - 1;
     else if (*color_selected < 0)
       *color_selected = 0;
+    palette_layer.stale = true;
   }
 
   if (text_need_update)
   {
     *show_samples_in_map = false;
-
-    if (*show_3d_surface_plot)
-    {
-      update_heightmap_3d(render_texture, *selected_component_index);
-    }
-    else
-    {
-      update_texture(render_texture, *selected_component_index, neuron_at_mouse_position);
-      update_text_texture(texture, *selected_component_index, *training_finished);
-    }
+    map_view.stale = true;
+    indicator_layer.stale = true;
+    text_layer.stale = true;
   }
 }
 
-void process_mouse_events(Vector2 *prev_mouse_position, Vector2 *prev_mouse_click_position, bool *mouse_button_is_pressed, Neuron **neuron_at_mouse_position, bool show_samples_in_map, bool training_finished, int selected_component_index, int color_selected, Color *colors, RenderTexture2D *paint_render, RenderTexture2D *render_texture)
+// Marker strokes are added to the marker layer as they are drawn. The indicator layer is only invalidated when the
+// mouse cursor points to another neuron.
+void process_mouse_events(Vector2 *prev_mouse_click_position, bool *mouse_button_is_pressed, int *neuron_at_mouse_position, bool training_finished, int color_selected, Color *colors)
 {
   Vector2 current_mouse_position = GetMousePosition();
   if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) || (GetGestureDetected() == GESTURE_DRAG))
   {
-    BeginTextureMode(*paint_render);
+    BeginTextureMode(marker_layer.target);
     if (*mouse_button_is_pressed)
       DrawLineEx(*prev_mouse_click_position, current_mouse_position, 5.0f, colors[color_selected]);
     *prev_mouse_click_position = current_mouse_position;
@@ -656,26 +636,46 @@ void process_mouse_events(Vector2 *prev_mouse_position, Vector2 *prev_mouse_clic
     *mouse_button_is_pressed = false;
   }
 
-  bool indicator_updated = false;
   if (training_finished)
   {
+    int neuron = -1;
     bool mouse_is_out_of_map_layout = (current_mouse_position.x > MAP_LAYOUT_WIDTH) || (current_mouse_position.y > MAP_LAYOUT_HEIGHT);
-    if (((current_mouse_position.x != prev_mouse_position->x) || (current_mouse_position.y != prev_mouse_position->y)) && !mouse_is_out_of_map_layout)
+    if (!mouse_is_out_of_map_layout)
     {
-      int x = min((current_mouse_position.x * MAP_WIDTH) / MAP_LAYOUT_WIDTH, MAP_WIDTH - 1);
-      int y = min((current_mouse_position.y * MAP_HEIGHT) / MAP_LAYOUT_HEIGHT, MAP_HEIGHT - 1);
-      *neuron_at_mouse_position = &map[x][y];
-      *prev_mouse_position = current_mouse_position;
-      indicator_updated = true;
+      int x = min((current_mouse_position.x * config.map_width) / MAP_LAYOUT_WIDTH, config.map_width - 1);
+      int y = min((current_mouse_position.y * config.map_height) / MAP_LAYOUT_HEIGHT, config.map_height - 1);
+      neuron = y * shown_map->width + x;
     }
-    else if (mouse_is_out_of_map_layout)
+
+    if (neuron != *neuron_at_mouse_position)
     {
-      *neuron_at_mouse_position = NULL;
+      *neuron_at_mouse_position = neuron;
+      indicator_layer.stale = true;
     }
   }
+}
+
+// The map view, the indicator and the pixel layers have one pixel per neuron of the map
+bool load_viewer_layers()
+{
+  load_cached_layer(&map_view, config.map_width, config.map_height);
+  load_cached_layer(&indicator_layer, config.map_width, config.map_height);
+  load_cached_layer(&marker_layer, MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT);
+  load_cached_layer(&text_layer, 400, 1200);
+  load_cached_layer(&palette_layer, SCREEN_WIDTH - MAP_LAYOUT_WIDTH, PALETTE_HEIGHT);
+  clear_cached_layer(&marker_layer, BLANK);
+  return load_pixel_layer(&map_layer, config.map_width, config.map_height) && load_pixel_layer(&samples_layer, config.map_width, config.map_height);
+}
 
-  if (!show_samples_in_map && (*mouse_button_is_pressed || indicator_updated))
-    update_texture(render_texture, selected_component_index, *neuron_at_mouse_position);
+void unload_viewer_layers()
+{
+  unload_pixel_layer(&map_layer);
+  unload_pixel_layer(&samples_layer);
+  UnloadRenderTexture(map_view.target);
+  UnloadRenderTexture(indicator_layer.target);
+  UnloadRenderTexture(marker_layer.target);
+  UnloadRenderTexture(text_layer.target);
+  UnloadRenderTexture(palette_layer.target);
 }
 
 void initialize_color_rectangles(Rectangle *color_rectangles)
@@ -691,27 +691,77 @@ void initialize_color_rectangles(Rectangle *color_rectangles)
 
 int main(int argc, char *argv[])
 {
+  const char *load_map_file = NULL;
+  const char *telemetry_file = NULL;
+  const char *frames_telemetry_file = NULL;
+  bool telemetry_iterations = false;
+
+  // -c reads a configuration file and -D sets a single value (see som_config.c), in the order given. -P writes the
+  // training telemetry (see som_telemetry.c) and -p adds a record per iteration. -F writes the rendering and event
+  // times of the viewer, a record per frame.
+  default_som_config(&config);
+  int option;
+  while ((option = getopt(argc, argv, "c:D:pP:F:")) != -1)
+  {
+    if (option == 'c')
+    {
+      if (!load_som_config(&config, optarg))
+        return 1;
+    }
+    else if (option == 'D')
+    {
+      if (!set_som_config_assignment(&config, optarg))
+        return 1;
+    }
+    else if (option == 'P')
+      telemetry_file = optarg;
+    else if (option == 'p')
+      telemetry_iterations = true;
+    else if (option == 'F')
+      frames_telemetry_file = optarg;
+    else
+    {
+      printf("Usage: %s [-c config] [-D key=value] [-P telemetry.jsonl] [-p] [-F frames.jsonl] [trained-map.som]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc)
+    load_map_file = argv[optind];
+  if ((load_map_file == NULL) && ((config.map_width < VIEWER_MIN_MAP_SIDE) || (config.map_height < VIEWER_MIN_MAP_SIDE)))
+  {
+    printf("The viewer needs a map of at least %dx%d neurons\n", VIEWER_MIN_MAP_SIDE, VIEWER_MIN_MAP_SIDE);
+    return 1;
+  }
+
   char title[100] = "SOM";
   InitWindow(SCREEN_WIDTH, min(SCREEN_HEIGHT, MAP_LAYOUT_HEIGHT), title);
-  RenderTexture2D render_texture = LoadRenderTexture(MAP_WIDTH, MAP_HEIGHT);
-  RenderTexture2D text_texture = LoadRenderTexture(400, 1200);
-  RenderTexture2D paint_render = LoadRenderTexture(MAP_LAYOUT_WIDTH, MAP_LAYOUT_HEIGHT);
 
   // Load and initialize info and samples from the dataset
-  load_dataset(dataset_csv_file);
-
-  BMU bmu;
-  Sample *sample;
-  double learning_rule = INITIAL_LEARNING_RULE;
-  double radius = INITIAL_RADIUS;
-  int key_pressed, selected_component_index = 0;
+  if (!load_dataset(&info, config.dataset_file, true))
+  {
+    CloseWindow();
+    return 1;
+  }
+
+  Trainer trainer;
+  ThreadPool pool;
+  TrainingParams params = config.params;
+  Telemetry telemetry = {0};
+  Telemetry frames_telemetry = {0};
+  Telemetry *viewer_telemetry = NULL;
+  CodebookSnapshots snapshots = {0};
+  TrainingWorker worker;
+  ConvergenceMonitor monitor;
+  int selected_component_index = 0;
   bool training_finished = false;
+  bool training_paused = false;
+  bool training_started = false;
   bool application_finished = false;
   bool show_3d_surface_plot = false;
   bool show_samples_in_map = false;
 
-  Vector2 prev_mouse_position, prev_mouse_click_position;
-  Neuron *neuron_at_mouse_position = NULL;
+  Vector2 prev_mouse_click_position;
+  int neuron_at_mouse_position = -1;
   bool mouse_button_is_pressed = false;
   Color colors[MAX_COLORS_COUNT] = {RAYWHITE, YELLOW, GOLD, ORANGE, PINK, RED, MAROON, GREEN, LIME, DARKGREEN, SKYBLUE, BLUE, DARKBLUE, PURPLE, VIOLET, DARKPURPLE, BEIGE, BROWN};
   int color_selected = 0;
@@ -723,82 +773,177 @@ int main(int argc, char *argv[])
   // Random seed
   srand(time(NULL));
 
-  // Initialize the Neural Network (Self-Organizing Map)
-  initialize_som_map();
-
-  update_text_texture(&text_texture, selected_component_index, training_finished);
-
-  epoch = 0;
-  while ((epoch < TOTAL_EPOCHS) && !training_finished && !application_finished)
+  // Initialize the Neural Network (Self-Organizing Map), or show a trained one saved by som-cli
+  if (load_map_file != NULL)
   {
-    radius = max(1.0L, (epoch == 0) ? INITIAL_RADIUS : (radius - (radius / 3.0L)));
-    learning_rule = max(0.015L, INITIAL_LEARNING_RULE * exp(-10.0L * (epoch * epoch) / (TOTAL_EPOCHS * TOTAL_EPOCHS)));
-    iterations_per_epoch = (epoch == 0) ? INITIAL_TRAINING_ITERATIONS_PER_EPOCH : (iterations_per_epoch * 2);
-    epoch++;
+    DatasetInfo map_info = {0};
+    bool loaded = load_som_map(&map, &map_info, load_map_file);
+    bool compatible = loaded && som_map_matches_dataset(&map_info, &info) && (map.width >= VIEWER_MIN_MAP_SIDE) && (map.height >= VIEWER_MIN_MAP_SIDE);
 
-    iteration = 0;
-    while ((iteration < iterations_per_epoch) && !training_finished && !application_finished)
+    if (loaded && !compatible)
+      printf("The map must be at least %dx%d and trained with %s\n", VIEWER_MIN_MAP_SIDE, VIEWER_MIN_MAP_SIDE, config.dataset_file);
+    free_dataset(&map_info);
+    if (!compatible)
     {
-      sample = pick_random_sample();
-      search_bmu(sample, &bmu, info.total_components); // search for the Best Match Unit
-      scale_neighbors(&bmu, sample, radius, learning_rule, info.total_components);
-
-      iteration++;
-      if (show_3d_surface_plot)
-        update_heightmap_3d(&render_texture, selected_component_index);
-      else
-        update_texture(&render_texture, selected_component_index, neuron_at_mouse_position);
-
-      process_key_pressed(&selected_component_index, neuron_at_mouse_position, &training_finished, &color_selected, &show_3d_surface_plot, &show_samples_in_map, &render_texture, &text_texture, &paint_render);
-      process_mouse_events(&prev_mouse_position, &prev_mouse_click_position, &mouse_button_is_pressed, &neuron_at_mouse_position, show_samples_in_map, training_finished, selected_component_index, color_selected, colors, &paint_render, &render_texture);
+      if (loaded)
+        free_som_map(&map);
+      free_dataset(&info);
+      CloseWindow();
+      return 1;
+    }
+    training_finished = true;
+    config.map_width = map.width;
+    config.map_height = map.height;
+  }
+  else if (!initialize_som_map(&map, config.map_width, config.map_height, info.total_components - 1, DEFAULT_CODEBOOK_LAYOUT))
+  {
+    free_dataset(&info);
+    CloseWindow();
+    return 1;
+  }
 
-      if (!show_3d_surface_plot)
-        update_colorpicker_texture(&paint_render, color_selected, colors, color_rectangles);
+  if (!load_viewer_layers())
+  {
+    printf("Could not allocate the map layers\n");
+    free_allocated_memory();
+    CloseWindow();
+    return 1;
+  }
 
-      sprintf(title, "EPOCH %d/%d | ITERATION: %d/%d | RADIUS: %.2f | LEARNING RULE: %.4f", epoch, TOTAL_EPOCHS, iteration, iterations_per_epoch, radius, learning_rule);
-      SetWindowTitle(title);
+  if (!create_thread_pool(&pool, get_total_cpu_cores()))
+  {
+    printf("Could not create a pool of %d threads, running on a single thread\n", get_total_cpu_cores());
+    create_thread_pool(&pool, 1);
+  }
+  initialize_trainer(&trainer, &map, &info, &params);
+  trainer.pool = &pool;
+  if ((telemetry_file != NULL) && !training_finished && open_telemetry(&telemetry, telemetry_file, telemetry_iterations))
+    trainer.telemetry = &telemetry;
 
-      if (WindowShouldClose())
-        application_finished = true;
+  if (!training_finished)
+  {
+    bool monitored = (params.convergence_threshold <= 0.0) || start_convergence_monitor(&monitor, &trainer);
+    if (trainer.monitor != NULL)
+      printf("Convergence monitor: %d of %d samples held out of the training\n", monitor.holdout.total_dataset_samples, info.total_dataset_samples);
+    if (!monitored || !allocate_codebook_snapshots(&snapshots, &map) || !start_training_worker(&worker, &trainer, &snapshots))
+    {
+      printf("Could not start the training\n");
+      if (trainer.monitor != NULL)
+        stop_convergence_monitor(&monitor);
+      free_codebook_snapshots(&snapshots);
+      free_trainer(&trainer);
+      destroy_thread_pool(&pool);
+      free_allocated_memory();
+      CloseWindow();
+      return 1;
+    }
+    if ((frames_telemetry_file != NULL) && open_telemetry(&frames_telemetry, frames_telemetry_file, true))
+    {
+      frames_telemetry.iteration_record = "frame";
+      viewer_telemetry = &frames_telemetry;
+    }
+    training_started = true;
+    SetTargetFPS(VIEWER_TARGET_FPS);
+  }
+
+  // The training runs on the worker thread, every frame draws the newest snapshot of the codebook
+  int frame = 0;
+  while (!training_finished && !application_finished)
+  {
+    bool fresh;
+    CodebookSnapshot *snapshot = acquire_codebook_snapshot(&snapshots, &fresh);
+    shown_map = &snapshot->map;
+    if (fresh)
+      invalidate_map_layer();
+
+    begin_telemetry_iteration(viewer_telemetry, ++frame);
+    begin_telemetry_phase(viewer_telemetry);
+    draw_viewer_frame(selected_component_index, neuron_at_mouse_position, training_finished, show_samples_in_map, show_3d_surface_plot, color_selected, colors, color_rectangles);
+    sprintf(title, "EPOCH %d/%d | ITERATION: %d/%d | RADIUS: %.2f | LEARNING RULE: %.4f%s", snapshot->epoch, params.total_epochs, snapshot->iteration, snapshot->iterations_per_epoch, snapshot->radius, snapshot->learning_rule, training_paused ? " | PAUSED" : "");
+    SetWindowTitle(title);
+    end_telemetry_phase(viewer_telemetry, PHASE_RENDER);
+
+    // Key and mouse events, invalidating the layers they change. Neurons can be inspected while the training is paused.
+    begin_telemetry_phase(viewer_telemetry);
+    bool was_paused = training_paused;
+    process_key_pressed(&selected_component_index, &training_finished, &training_paused, &color_selected, &show_3d_surface_plot, &show_samples_in_map);
+    if (training_paused != was_paused)
+      set_training_paused(&worker, training_paused);
+    process_mouse_events(&prev_mouse_click_position, &mouse_button_is_pressed, &neuron_at_mouse_position, training_paused, color_selected, colors);
+    if (WindowShouldClose())
+      application_finished = true;
+    if (__atomic_load_n(&worker.finished, __ATOMIC_ACQUIRE))
+      training_finished = true;
+    end_telemetry_phase(viewer_telemetry, PHASE_EVENTS);
+  }
+
+  if (training_started)
+  {
+    stop_training_worker(&worker);
+    free_codebook_snapshots(&snapshots);
+    if (trainer.monitor != NULL)
+    {
+      stop_convergence_monitor(&monitor);
+      print_convergence_summary(&monitor);
     }
+    shown_map = &map;
+    invalidate_map_layer();
+  }
+  if (viewer_telemetry != NULL)
+  {
+    close_telemetry(viewer_telemetry);
+    print_telemetry_summary(viewer_telemetry);
   }
 
   training_finished = true;
   show_samples_in_map = true;
+  text_layer.stale = true;
+  if (trainer.telemetry != NULL)
+  {
+    close_telemetry(&telemetry);
+    print_telemetry_summary(&telemetry);
+  }
 
   if (!application_finished)
   {
-    clear_texture(&render_texture, BLACK);
-    draw_text(&render_texture, "Inferencing samples...");
+    draw_message("Inferencing samples...");
+    draw_viewer_frame(selected_component_index, -1, training_finished, show_samples_in_map, false, color_selected, colors, color_rectangles);
     SetWindowTitle("Please wait while running inference...");
 
-    // Calculate inference for each sample of the dataset
-    for (int i = 0; !WindowShouldClose() && (i < info.total_dataset_samples); i++)
+    // Calculate inference for each sample of the dataset. The map does not change anymore, so it is indexed first.
+    KDTree tree;
+    if (build_kdtree(&tree, &map))
     {
-      search_bmu(&(info.samples[i]), &bmu, info.total_components);
-      info.samples[i].bmu.x_coord = bmu.x_coord;
-      info.samples[i].bmu.y_coord = bmu.y_coord;
+      kdtree_infer_samples(&tree, &info, &pool);
+      free_kdtree(&tree);
     }
+    else
+      infer_samples(&map, &info, &pool);
 
     // Render dataset samples in map
-    update_samples_texture(&render_texture);
+    refresh_samples_layer();
 
+    // The map does not change anymore: the viewer sleeps until there is an input event, and a mouse move over
+    // the map only redraws the indicator layer when it points to another neuron
     SetWindowTitle("Inferenced results");
     SetTargetFPS(30);
+    EnableEventWaiting();
     while (!WindowShouldClose() && !application_finished)
     {
-      process_key_pressed(&selected_component_index, neuron_at_mouse_position, &training_finished, &color_selected, &show_3d_surface_plot, &show_samples_in_map, &render_texture, &text_texture, &paint_render);
-      process_mouse_events(&prev_mouse_position, &prev_mouse_click_position, &mouse_button_is_pressed, &neuron_at_mouse_position, show_samples_in_map, training_finished, selected_component_index, color_selected, colors, &paint_render, &render_texture);
-      update_colorpicker_texture(&paint_render, color_selected, colors, color_rectangles);
+      draw_viewer_frame(selected_component_index, neuron_at_mouse_position, training_finished, show_samples_in_map, show_3d_surface_plot, color_selected, colors, color_rectangles);
+      process_key_pressed(&selected_component_index, &training_finished, &training_paused, &color_selected, &show_3d_surface_plot, &show_samples_in_map);
+      process_mouse_events(&prev_mouse_click_position, &mouse_button_is_pressed, &neuron_at_mouse_position, training_finished, color_selected, colors);
 
       if (WindowShouldClose())
         application_finished = true;
     }
   }
 
+  free_trainer(&trainer);
+  destroy_thread_pool(&pool);
   free_allocated_memory();
-  UnloadRenderTexture(render_texture);
-  UnloadRenderTexture(paint_render);
+  unload_heightmap_model();
+  unload_viewer_layers();
   CloseWindow();
 
   return 0;
@@ -0,0 +1,714 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Self-Organizing Map (SOM algorithm) training engine. This is the display-less core shared by the
+             Raylib viewer (som.c) and the headless command line tool (som_cli.c).
+
+*****************************************************************/
+
+#ifndef SOM_H
+#define SOM_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <float.h>
+#include <time.h>
+#include <pthread.h>
+
+// Defaults of the runtime configuration (see som_config.c)
+#define DEFAULT_DATASET_FILE "winequality-white.csv"
+
+// Neural Network size
+#define MAP_WIDTH 300
+#define MAP_HEIGHT 300
+#define MAX_MAP_SIDE 16384 // Largest width or height of a configured map
+
+// Training algorithm parameters
+#define INITIAL_TRAINING_ITERATIONS_PER_EPOCH 300
+#define TOTAL_EPOCHS 8
+#define INITIAL_RADIUS 200.0L
+#define INITIAL_LEARNING_RULE 0.9L
+#define FINAL_LEARNING_RULE 0.015L // Floor of the learning rule, reached by the fine-tuning epochs
+#define NEIGHBORHOOD_EPSILON 1e-3 // Neighborhood updates with a smaller scale are skipped
+#define BATCH_PASSES_PER_EPOCH 1
+#define BATCH_MIN_NEIGHBORHOOD_WEIGHT 1e-9 // Neurons with less sample weight around them are left untouched
+
+// Convergence monitor, only run when the convergence threshold is set
+#define CONVERGENCE_THRESHOLD 0.0            // Relative error improvement under which an epoch has settled, 0 trains the whole schedule
+#define CONVERGENCE_HOLDOUT_SAMPLES 512      // Samples held out of the training to estimate the errors
+#define CONVERGENCE_MAX_HOLDOUT_FRACTION 0.1 // Larger holdouts are cut to this fraction of the dataset
+#define CONVERGENCE_CHECKS_PER_EPOCH 4       // Codebook checkpoints evaluated during every fine-tuning epoch
+
+// Dataset loading
+#define CSV_PARALLEL_MIN_BYTES (4 << 20) // Smaller files are parsed by a single thread
+#define CSV_MAX_REPORTED_ERRORS 10       // Malformed rows reported one by one, the rest are only counted
+#define DATASET_CACHE_SUFFIX ".cache"    // Appended to the name of a CSV file to name its binary cache
+#define DATASET_ROW_PADDING 4            // Sample rows are a multiple of this number of values
+#define ARENA_BLOCK_SIZE 4096            // Smallest block of the dataset metadata arena
+#define DATASET_COLUMN_PADDING 8         // Columns of the dataset cache are a multiple of this number of values
+
+// Runtime configuration
+#define CONFIG_LINE_SIZE 1024 // Longest line of a configuration file, and longest dataset path
+
+// Out-of-core training
+#define STREAM_CHUNK_SAMPLES 65536 // Samples read from the dataset cache at a time
+#define STREAM_PREFETCH_CHUNKS 4   // Chunks held in memory: the one being trained and the ones read ahead
+
+// Codebook memory layout
+#define CODEBOOK_ALIGNMENT 64      // Byte alignment of the weights block (one cache line)
+#define CODEBOOK_AOS_PADDING 4     // AoS neuron stride is a multiple of this number of weights
+#define CODEBOOK_SOA_PADDING 16    // SoA component planes are a multiple of this number of neurons
+
+// Parallelism
+#define PARALLEL_SEARCH_MIN_NEURONS 8192 // Smaller maps are searched by a single thread
+#define INFERENCE_SAMPLES_PER_TASK 64
+#define PARALLEL_UPDATE_MIN_NEURONS 4096 // Smaller neighborhoods are updated by a single thread
+
+// Warm-started BMU search
+#define BMU_TILE_SIZE 16 // Side of the square tiles of neurons bounded by the warm-started search
+#define WARM_SEARCH_MAX_TILES_FRACTION 0.25 // A search that cannot discard more tiles scans the whole map
+
+// Nearest neighbour index of a trained map
+#define KDTREE_LEAF_SIZE 16 // Nodes with more neurons are split in two
+
+// Quantized inference of a trained map
+#define QUANTIZED_BLOCK_NEURONS 8    // Neurons whose distances the integer kernels compute at a time
+#define MAX_RERANK_CANDIDATES 16
+#define DEFAULT_RERANK_CANDIDATES 8  // Best quantized neurons whose exact distances decide the BMU
+
+// Numbers of weights whose BMU search and update kernels are specialized at compile time, with their component
+// loops unrolled. Maps with other numbers of weights, or builds with -DSOM_SPECIALIZED_KERNELS=0, use the generic
+// kernels.
+#define SPECIALIZED_WEIGHTS(X) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16)
+#define MAX_SPECIALIZED_WEIGHTS 16
+#ifndef SOM_SPECIALIZED_KERNELS
+#define SOM_SPECIALIZED_KERNELS 1
+#endif
+
+// Storage of the codebook and the sample components. Build with -DSOM_FLOAT32=1 to store them in single precision,
+// which halves their memory and bandwidth and doubles the lanes of the BMU search kernels. The search kernels
+// accumulate distances in the precision of the weights, every other value stays in double precision.
+#ifndef SOM_FLOAT32
+#define SOM_FLOAT32 0
+#endif
+
+// Training telemetry. Build with -DSOM_TELEMETRY=0 to compile the instrumentation out.
+#ifndef SOM_TELEMETRY
+#define SOM_TELEMETRY 1
+#endif
+
+#if SOM_FLOAT32
+typedef float som_real;
+#define SOM_REAL_NAME "float"
+#define SOM_REAL_EPSILON FLT_EPSILON
+#else
+typedef double som_real;
+#define SOM_REAL_NAME "double"
+#define SOM_REAL_EPSILON DBL_EPSILON
+#endif
+
+// Relative error of a squared distance of 'n' components accumulated in som_real, above the rounding of the
+// subtractions, the squares and the sum. The search trees shrink their exact lower bounds by it before pruning.
+#define DISTANCE_ROUNDING_SLACK(n) (((n) + 2) * SOM_REAL_EPSILON)
+
+// Basic math macros
+#define pow2(x) ((x) * (x))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+typedef struct BMU
+{
+  int x_coord;
+  int y_coord;
+} BMU;
+
+typedef struct Coordinate
+{
+  double x;
+  double y;
+} Coordinate;
+
+typedef struct Sample
+{
+  som_real *components; // Row of the sample in the dataset matrix
+  BMU bmu; // Last BMU found, where the warm-started search begins
+} Sample;
+
+typedef struct ComponentInfo
+{
+  char *name;
+  double max_value;
+  char *max_value_str;
+  double min_value;
+  char *min_value_str;
+} ComponentInfo;
+
+// Bump allocator for many small allocations released all at once
+typedef struct ArenaBlock
+{
+  struct ArenaBlock *next;
+  size_t size;
+  size_t used;
+} ArenaBlock;
+
+typedef struct Arena
+{
+  ArenaBlock *blocks; // The block being filled first
+} Arena;
+
+typedef struct DatasetInfo
+{
+  ComponentInfo *components;
+  Sample *samples;
+  som_real *values; // Aligned matrix of sample_stride values per sample, the sample components point to its rows
+  double *targets; // Target column of every sample
+  size_t sample_stride; // Components of a sample, padded with zeros to a multiple of DATASET_ROW_PADDING
+  int total_components; // Includes the target column (the last one)
+  int total_dataset_samples;
+  Arena arena; // The components and their strings
+} DatasetInfo;
+
+// Where the columns of a dataset cache are
+typedef struct DatasetCacheLayout
+{
+  int total_samples;
+  uint64_t column_stride; // Values per column
+  uint64_t columns_offset; // File offset of the first column
+} DatasetCacheLayout;
+
+typedef struct DatasetCacheWriter
+{
+  int fd;
+  DatasetCacheLayout layout;
+  char *filename;
+  char *temporary_filename; // Renamed to filename once complete
+} DatasetCacheWriter;
+
+// A chunk of samples read by a DatasetStream
+typedef struct StreamBuffer
+{
+  DatasetInfo info; // Samples of the chunk, sharing the components of the stream
+  int first_sample; // Index of the first sample in the dataset, when the stream is not shuffled
+  bool last_of_pass; // Last chunk of a pass over the whole dataset
+} StreamBuffer;
+
+// Reads a dataset cache a chunk of samples at a time on a background thread, a few chunks ahead of the consumer.
+// Shuffled streams read the chunks in a random order and shuffle the samples of every chunk.
+typedef struct DatasetStream
+{
+  DatasetInfo *info; // Components of the dataset, not owned by the stream
+  DatasetCacheLayout layout;
+  int fd;
+  bool shuffle;
+  unsigned int seed; // Random state of the reader thread
+  int total_chunks;
+  int *chunk_order;
+  int next_chunk; // Position in chunk_order of the next chunk to read
+  double *columns; // Values of the chunk being read, STREAM_CHUNK_SAMPLES per component
+  int *rows; // Order of the samples of the chunk being read
+  StreamBuffer buffers[STREAM_PREFETCH_CHUNKS];
+  int head; // Buffer being consumed
+  int total_filled; // Buffers read and not released yet, the head one included
+  bool consuming; // The head buffer is in use
+  int next_sample; // Next sample of the head buffer
+  bool stopping;
+  bool failed;
+  pthread_t reader;
+  pthread_mutex_t mutex;
+  pthread_cond_t filled;
+  pthread_cond_t released;
+  struct timespec start;
+  long samples_consumed;
+  long chunks_read;
+  double bytes_read;
+  double read_seconds; // Spent by the reader thread reading
+  double wait_seconds; // Spent by the consumer waiting for the reader
+} DatasetStream;
+
+typedef enum CodebookLayout
+{
+  CODEBOOK_AOS, // Row-major array of neurons, each one with its weights next to each other
+  CODEBOOK_SOA  // Component-major planes, each one with the same weight of all the neurons
+} CodebookLayout;
+
+#define DEFAULT_CODEBOOK_LAYOUT CODEBOOK_SOA
+
+// Instruction set used by the BMU search kernels of a map (detected at runtime by default)
+typedef enum SIMDLevel
+{
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_AVX2,
+  SIMD_AVX512
+} SIMDLevel;
+
+// The codebook is a single aligned block. The weight 'i' of the neuron 'n' (n = y * width + x) is stored at
+// weights[n * neuron_stride + i * component_stride], whatever the layout.
+typedef struct SOMMap
+{
+  som_real *weights;
+  CodebookLayout layout;
+  int width;
+  int height;
+  int total_weights;
+  int total_neurons;
+  size_t neuron_stride;
+  size_t component_stride;
+  SIMDLevel simd_level;
+  void *mapping; // Map file holding the weights when the map was loaded with load_som_map, NULL otherwise
+  size_t mapping_size;
+} SOMMap;
+
+// Copy of the codebook taken during the training, with the point of the schedule it was taken at
+typedef struct CodebookSnapshot
+{
+  SOMMap map; // Same size and layout as the trained map, with a weights block of its own
+  int epoch;
+  int iteration;
+  int iterations_per_epoch;
+  double radius;
+  double learning_rule;
+} CodebookSnapshot;
+
+#define SNAPSHOT_FRESH 4 // Flag of CodebookSnapshots.middle, set while the middle snapshot has not been read
+
+// Triple buffer of snapshots shared by the training thread and a reader (see som_snapshot.c). The writer fills the
+// back snapshot and exchanges it with the middle one, the reader exchanges its front snapshot with the middle one
+// when that is newer. Neither side ever waits for the other, and a snapshot is never written while it is read.
+typedef struct CodebookSnapshots
+{
+  CodebookSnapshot snapshots[3];
+  int back;   // Only used by the writer
+  int front;  // Only used by the reader
+  int middle; // Exchanged atomically, with SNAPSHOT_FRESH
+  long published;
+} CodebookSnapshots;
+
+typedef struct BMUCandidate
+{
+  double distance; // Squared Euclidean distance
+  int neuron;
+} BMUCandidate;
+
+typedef void (*ParallelTask)(void *context, int task, int total_tasks);
+
+typedef struct ThreadPool
+{
+  pthread_t *threads;
+  int total_threads; // Includes the thread that calls run_parallel
+  pthread_mutex_t mutex;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  unsigned long generation;
+  int busy_workers;
+  bool shutdown;
+  ParallelTask task;
+  void *context;
+  int total_tasks;
+  int next_task;
+} ThreadPool;
+
+// Scales of the neighborhood offsets for the radius and learning rule of an epoch. Row 'y + int_radius' holds
+// the offsets [first_x, last_x) of the 'y' offset, and their scales start at scales[row_start[row]].
+typedef struct NeighborhoodKernel
+{
+  double radius;
+  double learning_rule;
+  double epsilon;
+  int int_radius;
+  int first_y; // Offsets [first_y, last_y) have at least one cell
+  int last_y;
+  int *first_x;
+  int *last_x;
+  int *row_start;
+  double *scales;
+  int total_cells;
+} NeighborhoodKernel;
+
+typedef struct TileCandidate
+{
+  double lower_bound;
+  int tile;
+} TileCandidate;
+
+// Bounding box of the weights of every BMU_TILE_SIZE x BMU_TILE_SIZE tile of neurons (see som_warm_search.c)
+typedef struct TileBounds
+{
+  int tile_size;
+  int tiles_x;
+  int tiles_y;
+  int total_tiles;
+  int total_weights;
+  int total_searchers;
+  double *lower; // total_tiles x total_weights, tile-major
+  double *upper;
+  TileCandidate *candidates; // total_searchers x total_tiles, the tiles left to scan by every search
+} TileBounds;
+
+typedef struct BMUSearchStats
+{
+  long searches;
+  long warm_hits;  // Searches whose BMU is still in the tile of the cached one
+  long full_scans; // Searches that fell back to a full scan of the map
+  long neurons_evaluated;
+} BMUSearchStats;
+
+typedef struct KDTreeNode
+{
+  int first; // Neurons [first, last) of the tree order
+  int last;
+  int left; // Children, -1 on the leaves
+  int right;
+} KDTreeNode;
+
+// Exact nearest neighbour index over the weights of a map (see som_kdtree.c). Node 0 is the root.
+typedef struct KDTree
+{
+  int total_weights;
+  int width;
+  int total_points;
+  int total_nodes;
+  KDTreeNode *nodes;
+  double *lower; // Bounding box of every node, total_nodes x total_weights
+  double *upper;
+  som_real *points; // Weights of the neurons in tree order, total_points x total_weights
+  int *neurons;   // Neuron index of every point
+} KDTree;
+
+typedef enum QuantizedPrecision
+{
+  QUANTIZED_INT8,  // 8 bit unsigned weights
+  QUANTIZED_INT16  // 16 bit signed weights
+} QuantizedPrecision;
+
+// Integer copy of the weights of a trained map (see som_quantized.c). Normalized values [0, 1] are stored as
+// integers [0, scale]. The neurons are grouped in blocks of QUANTIZED_BLOCK_NEURONS and the components in pairs:
+// weights[((block * total_pairs + pair) * QUANTIZED_BLOCK_NEURONS + neuron) * 2 + component].
+typedef struct QuantizedMap
+{
+  SOMMap *map; // Exact weights, to re-rank the candidates
+  QuantizedPrecision precision;
+  int scale;
+  int total_weights;
+  int total_pairs; // The last pair is padded with a zero when the number of weights is odd
+  int total_blocks;
+  int rerank_candidates; // 0 keeps the BMU of the quantized distances
+  SIMDLevel simd_level;
+  void *weights; // uint8_t or int16_t
+} QuantizedMap;
+
+// Where the time of a training iteration goes. Phases do not nest: the time of a phase started inside another one
+// is counted twice.
+typedef enum TelemetryPhase
+{
+  PHASE_BMU_SEARCH,
+  PHASE_NEIGHBORHOOD_UPDATE,
+  PHASE_RENDER, // Only measured by the viewer
+  PHASE_EVENTS,
+  TOTAL_TELEMETRY_PHASES
+} TelemetryPhase;
+
+typedef enum TelemetryFormat
+{
+  TELEMETRY_JSONL, // One JSON object per line
+  TELEMETRY_CSV
+} TelemetryFormat;
+
+typedef struct TelemetryCounters
+{
+  int epoch;
+  int iteration;
+  double radius;
+  double learning_rule;
+  long iterations;
+  long neurons_touched; // Neuron updates, a neuron updated twice by a wrapping neighborhood counts twice
+  double seconds[TOTAL_TELEMETRY_PHASES];
+  struct timespec start;
+} TelemetryCounters;
+
+// Phase timings of the training, written to a log a record per epoch (and per iteration if requested). An iteration
+// record also holds the rendering and the events handled after the iteration, until the next one starts.
+typedef struct Telemetry
+{
+  FILE *log;
+  TelemetryFormat format;
+  bool log_iterations;
+  const char *iteration_record; // Type of the records of the iterations, "iteration" unless changed
+  struct timespec phase_start;
+  TelemetryCounters iteration; // Pending until the next iteration begins
+  TelemetryCounters epoch;
+  TelemetryCounters total;
+  double total_wall_seconds;
+} Telemetry;
+
+typedef enum TrainingMode
+{
+  TRAINING_ONLINE, // The map is updated after every random sample
+  TRAINING_BATCH   // The map is updated once per pass over all the samples (see som_batch.c)
+} TrainingMode;
+
+typedef struct BatchState
+{
+  double *sums;     // total_weights + 1 planes of total_neurons: sums of the components, then the sample counts
+  double *smoothed; // Same planes after the neighborhood pass along the rows
+  double *profile;  // 1-D neighborhood weights of the offsets [-profile_radius, profile_radius]
+  int profile_radius;
+  bool *non_empty_rows; // Rows with at least one BMU in the current pass
+} BatchState;
+
+typedef struct TrainingParams
+{
+  TrainingMode mode;
+  int total_epochs;
+  int initial_iterations_per_epoch;
+  double initial_radius;
+  double initial_learning_rule;
+  double neighborhood_epsilon;
+  bool warm_search; // Search the BMUs starting from the ones cached in the samples
+  double convergence_threshold; // 0 trains the whole schedule, see som_convergence.c
+  int holdout_samples;
+} TrainingParams;
+
+// Settings of a front-end that used to need a recompile (see som_config.c)
+typedef struct SOMConfig
+{
+  char dataset_file[CONFIG_LINE_SIZE];
+  int map_width;
+  int map_height;
+  TrainingParams params;
+} SOMConfig;
+
+// Estimates of the quality of the map, taken on held-out samples by a thread running next to the training (see
+// som_convergence.c). The trainer publishes a checkpoint of the codebook CONVERGENCE_CHECKS_PER_EPOCH times per
+// fine-tuning epoch and the monitor tells it when the epoch has settled or the training has converged.
+typedef struct ConvergenceMonitor
+{
+  struct Trainer *trainer;
+  DatasetInfo *dataset;   // Dataset of the trainer before the split
+  DatasetInfo training;   // The samples the trainer picks from, the dataset without the holdout
+  DatasetInfo holdout;
+  CodebookSnapshots checkpoints;
+  TileBounds bounds; // Of the checkpoints, for the warm-started search of the held-out samples
+  double threshold;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t published;
+  bool quit;
+  int settled_epoch; // Written by the monitor, read by the trainer
+  bool converged;
+  int shortened_epochs; // Only used by the trainer
+  // Only used by the monitor thread until it is stopped
+  long evaluations;
+  int evaluated_epoch;
+  int evaluated_iteration;
+  double quantization_error;
+  double topographic_error;
+  double previous_epoch_error; // Quantization error of the last checkpoint of the previous epoch evaluated
+} ConvergenceMonitor;
+
+typedef struct Trainer
+{
+  SOMMap *map;
+  DatasetInfo *info;
+  ThreadPool *pool; // NULL trains on the calling thread only
+  DatasetStream *stream; // NULL trains with the samples of info
+  TrainingParams params;
+  int epoch;
+  int iteration;
+  int iterations_per_epoch;
+  double radius;
+  double learning_rule;
+  NeighborhoodKernel kernel;
+  BatchState batch;
+  TileBounds bounds; // Only allocated for the warm-started search
+  BMUSearchStats search_stats;
+  Telemetry *telemetry; // NULL records nothing
+  ConvergenceMonitor *monitor; // NULL trains the whole schedule
+  unsigned int *random_state; // NULL picks the samples with rand()
+} Trainer;
+
+// Dataset
+bool load_dataset(DatasetInfo *info, const char *filename, bool use_cache);
+bool parse_csv_number(const char *begin, const char *end, double *value);
+bool allocate_dataset_samples(DatasetInfo *info, int total_samples);
+void free_dataset(DatasetInfo *info);
+Sample *pick_random_sample(DatasetInfo *info, unsigned int *random_state);
+
+// Arena
+void *arena_allocate(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *s, size_t length);
+void free_arena(Arena *arena);
+
+// Out-of-core datasets
+bool open_dataset_stream(DatasetStream *stream, const char *filename, DatasetInfo *info, const DatasetCacheLayout *layout, bool shuffle, unsigned int seed);
+void close_dataset_stream(DatasetStream *stream);
+StreamBuffer *next_stream_chunk(DatasetStream *stream);
+Sample *next_stream_sample(DatasetStream *stream);
+void print_dataset_stream_stats(DatasetStream *stream);
+
+// Map
+static inline som_real *get_neuron_weight(SOMMap *map, int neuron, int i)
+{
+  return &map->weights[(size_t)neuron * map->neuron_stride + (size_t)i * map->component_stride];
+}
+
+size_t round_up(size_t value, size_t multiple);
+void set_codebook_strides(SOMMap *map);
+bool allocate_som_map(SOMMap *map, int width, int height, int total_weights, CodebookLayout layout);
+size_t codebook_size(SOMMap *map);
+bool initialize_som_map(SOMMap *map, int width, int height, int total_weights, CodebookLayout layout);
+void randomize_som_weights(SOMMap *map, unsigned int *random_state);
+void free_som_map(SOMMap *map);
+double distance_between_sample_and_neuron(SOMMap *map, Sample *sample, int neuron);
+void search_bmu(SOMMap *map, Sample *sample, BMU *bmu);
+void parallel_search_bmu(ThreadPool *pool, SOMMap *map, Sample *sample, BMU *bmu);
+double squared_distance_to_neuron(SOMMap *map, const som_real *query, int neuron);
+int wrap_coordinate(int coord, int size);
+void scale_neurons_run(SOMMap *map, int first_neuron, int total_neurons, Sample *sample, const double *scales);
+void scale_neuron_at_position(SOMMap *map, int x, int y, Sample *sample, double scale);
+bool build_neighborhood_kernel(NeighborhoodKernel *kernel, double iteration_radius, double learning_rule, double epsilon);
+void free_neighborhood_kernel(NeighborhoodKernel *kernel);
+void scale_neighbors(SOMMap *map, NeighborhoodKernel *kernel, BMU *bmu, Sample *sample);
+void parallel_scale_neighbors(ThreadPool *pool, SOMMap *map, NeighborhoodKernel *kernel, BMU *bmu, Sample *sample);
+
+// BMU search kernels
+SIMDLevel detect_simd_level(void);
+const char *simd_level_name(SIMDLevel level);
+bool parse_simd_level(const char *name, SIMDLevel *level);
+void search_bmu_range(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best);
+
+// Thread pool
+int get_total_cpu_cores(void);
+bool create_thread_pool(ThreadPool *pool, int total_threads);
+void destroy_thread_pool(ThreadPool *pool);
+void run_parallel(ThreadPool *pool, ParallelTask task, void *context, int total_tasks);
+int get_pool_threads(ThreadPool *pool);
+long run_work_stealing(int total_threads, ParallelTask task, void *context, const double *costs, int total_tasks);
+
+// Training
+void default_training_params(TrainingParams *params);
+void initialize_trainer(Trainer *trainer, SOMMap *map, DatasetInfo *info, const TrainingParams *params);
+void free_trainer(Trainer *trainer);
+bool begin_next_epoch(Trainer *trainer);
+bool train_next_iteration(Trainer *trainer);
+void train_som(Trainer *trainer);
+
+// Convergence monitor
+bool start_convergence_monitor(ConvergenceMonitor *monitor, Trainer *trainer);
+void stop_convergence_monitor(ConvergenceMonitor *monitor);
+bool convergence_reached(ConvergenceMonitor *monitor);
+bool epoch_settled(ConvergenceMonitor *monitor, Trainer *trainer);
+void publish_convergence_checkpoint(ConvergenceMonitor *monitor, Trainer *trainer);
+void print_convergence_summary(ConvergenceMonitor *monitor);
+
+// Runtime configuration
+void default_som_config(SOMConfig *config);
+bool set_som_config_value(SOMConfig *config, const char *key, const char *value);
+bool set_som_config_assignment(SOMConfig *config, const char *assignment);
+bool load_som_config(SOMConfig *config, const char *filename);
+void print_som_config(SOMConfig *config);
+
+// Batch training
+bool build_batch_profile(BatchState *batch, double iteration_radius, double epsilon);
+void free_batch_state(BatchState *batch);
+bool train_batch_pass(Trainer *trainer);
+
+// Warm-started BMU search
+bool allocate_tile_bounds(TileBounds *bounds, SOMMap *map, int tile_size, int total_searchers);
+void free_tile_bounds(TileBounds *bounds);
+void refresh_tile_bounds(TileBounds *bounds, SOMMap *map);
+void extend_tile_bounds(TileBounds *bounds, SOMMap *map, NeighborhoodKernel *kernel, BMU *bmu, Sample *sample);
+void warm_search_bmu(TileBounds *bounds, int searcher, SOMMap *map, Sample *sample, BMUSearchStats *stats);
+void add_bmu_search_stats(BMUSearchStats *total, const BMUSearchStats *stats);
+void print_bmu_search_stats(const BMUSearchStats *stats, SOMMap *map);
+
+// Telemetry
+bool open_telemetry(Telemetry *telemetry, const char *filename, bool log_iterations);
+void close_telemetry(Telemetry *telemetry);
+void print_telemetry_summary(Telemetry *telemetry);
+
+#if SOM_TELEMETRY
+void begin_telemetry_epoch(Telemetry *telemetry, int epoch, double radius, double learning_rule);
+void begin_telemetry_iteration(Telemetry *telemetry, int iteration);
+
+static inline void begin_telemetry_phase(Telemetry *telemetry)
+{
+  if (telemetry != NULL)
+    clock_gettime(CLOCK_MONOTONIC, &telemetry->phase_start);
+}
+
+static inline void end_telemetry_phase(Telemetry *telemetry, TelemetryPhase phase)
+{
+  struct timespec now;
+  if (telemetry == NULL)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  telemetry->iteration.seconds[phase] += (now.tv_sec - telemetry->phase_start.tv_sec) + (now.tv_nsec - telemetry->phase_start.tv_nsec) / 1e9;
+}
+
+static inline void add_telemetry_neurons(Telemetry *telemetry, long total_neurons)
+{
+  if (telemetry != NULL)
+    telemetry->iteration.neurons_touched += total_neurons;
+}
+#else
+#define begin_telemetry_epoch(telemetry, epoch, radius, learning_rule) ((void)(telemetry))
+#define begin_telemetry_iteration(telemetry, iteration) ((void)(telemetry))
+#define begin_telemetry_phase(telemetry) ((void)(telemetry))
+#define end_telemetry_phase(telemetry, phase) ((void)(telemetry))
+#define add_telemetry_neurons(telemetry, total_neurons) ((void)(telemetry))
+#endif
+
+// Codebook snapshots
+bool allocate_codebook_snapshots(CodebookSnapshots *snapshots, SOMMap *map);
+void free_codebook_snapshots(CodebookSnapshots *snapshots);
+bool publish_codebook_snapshot(CodebookSnapshots *snapshots, Trainer *trainer, bool force);
+CodebookSnapshot *acquire_codebook_snapshot(CodebookSnapshots *snapshots, bool *fresh);
+
+// Map files
+bool save_som_map(SOMMap *map, DatasetInfo *info, const char *filename);
+bool load_som_map(SOMMap *map, DatasetInfo *info, const char *filename);
+bool som_map_matches_dataset(DatasetInfo *map_info, DatasetInfo *info);
+uint64_t append_file_string(char *strings, uint64_t *strings_size, const char *s);
+char *copy_file_string(Arena *arena, const char *strings, uint64_t strings_size, uint64_t offset);
+
+// Dataset cache
+char *dataset_cache_filename(const char *filename);
+bool is_dataset_cache(const char *data, size_t size);
+bool save_dataset_cache(DatasetInfo *info, const char *filename, const char *source_filename);
+bool load_dataset_cache(DatasetInfo *info, const char *filename, const char *source_filename);
+bool dataset_cache_up_to_date(const char *filename, const char *source_filename);
+bool read_dataset_cache_info(DatasetInfo *info, DatasetCacheLayout *layout, const char *filename);
+bool begin_dataset_cache(DatasetCacheWriter *writer, DatasetInfo *info, int total_samples, const char *filename, const char *source_filename);
+bool write_dataset_cache_column(DatasetCacheWriter *writer, int component, long first_sample, const double *values, long total_values);
+bool end_dataset_cache(DatasetCacheWriter *writer, bool complete);
+bool convert_csv_to_dataset_cache(const char *filename, const char *cache_filename);
+
+// Nearest neighbour index
+bool build_kdtree(KDTree *tree, SOMMap *map);
+void free_kdtree(KDTree *tree);
+void kdtree_search_bmu(KDTree *tree, const som_real *query, BMU *bmu);
+void kdtree_infer_samples(KDTree *tree, DatasetInfo *info, ThreadPool *pool);
+
+// Quantized inference
+bool build_quantized_map(QuantizedMap *quantized, SOMMap *map, QuantizedPrecision precision, int rerank_candidates);
+void free_quantized_map(QuantizedMap *quantized);
+size_t quantized_map_size(QuantizedMap *quantized);
+const char *quantized_precision_name(QuantizedPrecision precision);
+void quantized_search_bmu(QuantizedMap *quantized, const som_real *query, BMU *bmu);
+void quantized_infer_samples(QuantizedMap *quantized, DatasetInfo *info, ThreadPool *pool);
+
+// Inference
+void infer_samples(SOMMap *map, DatasetInfo *info, ThreadPool *pool);
+void warm_infer_samples(SOMMap *map, TileBounds *bounds, DatasetInfo *info, ThreadPool *pool, BMUSearchStats *stats);
+double quantization_error(SOMMap *map, DatasetInfo *info);
+bool adjacent_neurons(SOMMap *map, int first, int second);
+double topographic_error(SOMMap *map, DatasetInfo *info);
+void write_inference_header(FILE *fp, DatasetInfo *info);
+void write_inference_rows(FILE *fp, DatasetInfo *info, long first_sample);
+bool write_inference_results(DatasetInfo *info, const char *filename);
+
+#endif
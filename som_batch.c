@@ -0,0 +1,223 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Batch SOM training. Every pass computes the BMU of all the samples in parallel, accumulates the
+             samples of each BMU and moves every neuron to the neighborhood-weighted mean of those sums.
+             The neighborhood is the same Gaussian of the online training, applied as two 1-D passes over the
+             toroidal map (rows, then columns).
+
+Notes: The result does not depend on the number of threads. The BMUs of the samples are independent, the sums
+       are accumulated in sample order, and every smoothed value is computed by a single thread in a fixed order.
+       With a dataset stream every pass reads the whole stream once, a chunk at a time.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include "som.h"
+
+typedef struct BatchSmoothing
+{
+  SOMMap *map;
+  BatchState *batch;
+  const double *input;
+  double *output;
+} BatchSmoothing;
+
+void free_batch_state(BatchState *batch)
+{
+  free(batch->sums);
+  free(batch->smoothed);
+  free(batch->profile);
+  free(batch->non_empty_rows);
+  batch->sums = batch->smoothed = batch->profile = NULL;
+  batch->non_empty_rows = NULL;
+}
+
+// 1-D neighborhood weights exp(-10 d^2 / r^2) for |d| < r, dropping the tails below 'epsilon'. Its outer product
+// is the kernel of the online training: the corners it adds beyond the radius weigh less than exp(-10).
+bool build_batch_profile(BatchState *batch, double iteration_radius, double epsilon)
+{
+  int profile_radius = 0;
+
+  while ((profile_radius + 1 < iteration_radius) && (exp(-10.0 * pow2(profile_radius + 1) / pow2(iteration_radius)) >= epsilon))
+    profile_radius++;
+
+  free(batch->profile);
+  batch->profile_radius = profile_radius;
+  batch->profile = (double *)malloc(sizeof(double) * (2 * profile_radius + 1));
+  if (batch->profile == NULL)
+    return false;
+
+  for (int d = -profile_radius; d <= profile_radius; d++)
+    batch->profile[d + profile_radius] = exp(-10.0 * pow2(d) / pow2(iteration_radius));
+
+  return true;
+}
+
+static bool allocate_batch_buffers(BatchState *batch, SOMMap *map)
+{
+  size_t plane_size = (size_t)map->total_neurons * (map->total_weights + 1);
+
+  if (batch->sums != NULL)
+    return true;
+
+  batch->sums = (double *)malloc(sizeof(double) * plane_size);
+  batch->smoothed = (double *)malloc(sizeof(double) * plane_size);
+  batch->non_empty_rows = (bool *)malloc(sizeof(bool) * map->height);
+  return (batch->sums != NULL) && (batch->smoothed != NULL) && (batch->non_empty_rows != NULL);
+}
+
+// Planes of the row 'y' are smoothed along x. The sums are sparse (only BMUs have samples), so every non-empty
+// cell is scattered to the cells around it, in increasing x order.
+static void smooth_rows_task(void *context, int task, int total_tasks)
+{
+  BatchSmoothing *smoothing = (BatchSmoothing *)context;
+  SOMMap *map = smoothing->map;
+  BatchState *batch = smoothing->batch;
+  int total_planes = map->total_weights + 1;
+  size_t counts_plane = (size_t)map->total_weights * map->total_neurons;
+  int first = (int)(((long)map->height * task) / total_tasks);
+  int last = (int)(((long)map->height * (task + 1)) / total_tasks);
+
+  for (int y = first; y < last; y++)
+  {
+    size_t row = (size_t)y * map->width;
+
+    for (int p = 0; p < total_planes; p++)
+      memset(&smoothing->output[(size_t)p * map->total_neurons + row], 0, sizeof(double) * map->width);
+
+    batch->non_empty_rows[y] = false;
+    for (int x = 0; x < map->width; x++)
+    {
+      if (smoothing->input[counts_plane + row + x] == 0.0)
+        continue;
+
+      batch->non_empty_rows[y] = true;
+      for (int d = -batch->profile_radius; d <= batch->profile_radius; d++)
+      {
+        double weight = batch->profile[d + batch->profile_radius];
+        size_t target = row + wrap_coordinate(x + d, map->width);
+        for (int p = 0; p < total_planes; p++)
+          smoothing->output[(size_t)p * map->total_neurons + target] += weight * smoothing->input[(size_t)p * map->total_neurons + row + x];
+      }
+    }
+  }
+}
+
+// Planes of the row 'y' are the weighted sum of the non-empty rows around it
+static void smooth_columns_task(void *context, int task, int total_tasks)
+{
+  BatchSmoothing *smoothing = (BatchSmoothing *)context;
+  SOMMap *map = smoothing->map;
+  BatchState *batch = smoothing->batch;
+  int total_planes = map->total_weights + 1;
+  int first = (int)(((long)map->height * task) / total_tasks);
+  int last = (int)(((long)map->height * (task + 1)) / total_tasks);
+
+  for (int y = first; y < last; y++)
+    for (int p = 0; p < total_planes; p++)
+    {
+      double *out = &smoothing->output[(size_t)p * map->total_neurons + (size_t)y * map->width];
+      memset(out, 0, sizeof(double) * map->width);
+
+      for (int d = -batch->profile_radius; d <= batch->profile_radius; d++)
+      {
+        int source_row = wrap_coordinate(y + d, map->height);
+        if (!batch->non_empty_rows[source_row])
+          continue;
+
+        double weight = batch->profile[d + batch->profile_radius];
+        const double *in = &smoothing->input[(size_t)p * map->total_neurons + (size_t)source_row * map->width];
+        for (int x = 0; x < map->width; x++)
+          out[x] += weight * in[x];
+      }
+    }
+}
+
+// Adds the samples to the sums of their BMUs
+static void accumulate_batch_samples(Trainer *trainer, DatasetInfo *samples)
+{
+  SOMMap *map = trainer->map;
+  BatchState *batch = &trainer->batch;
+  size_t counts_plane = (size_t)map->total_weights * map->total_neurons;
+
+  // 1) BMU of every sample, in parallel. The warm-started search starts from the BMUs of the previous pass.
+  if (trainer->params.warm_search)
+    warm_infer_samples(map, &trainer->bounds, samples, trainer->pool, &trainer->search_stats);
+  else
+    infer_samples(map, samples, trainer->pool);
+
+  // 2) Sum of the samples and number of samples of each BMU, in sample order
+  for (int s = 0; s < samples->total_dataset_samples; s++)
+  {
+    Sample *sample = &samples->samples[s];
+    int neuron = sample->bmu.y_coord * map->width + sample->bmu.x_coord;
+    for (int i = 0; i < map->total_weights; i++)
+      batch->sums[(size_t)i * map->total_neurons + neuron] += sample->components[i];
+    batch->sums[counts_plane + neuron] += 1.0;
+  }
+}
+
+// One batch pass over the whole dataset with the radius of the current epoch
+bool train_batch_pass(Trainer *trainer)
+{
+  SOMMap *map = trainer->map;
+  BatchState *batch = &trainer->batch;
+  size_t counts_plane = (size_t)map->total_weights * map->total_neurons;
+  int total_tasks = min(get_pool_threads(trainer->pool), map->height);
+
+  if (!allocate_batch_buffers(batch, map))
+    return false;
+
+  begin_telemetry_phase(trainer->telemetry);
+  memset(batch->sums, 0, sizeof(double) * (counts_plane + map->total_neurons));
+  if (trainer->stream == NULL)
+    accumulate_batch_samples(trainer, trainer->info);
+  else
+  {
+    // A pass over the stream, a chunk at a time
+    StreamBuffer *buffer;
+    do
+    {
+      if ((buffer = next_stream_chunk(trainer->stream)) == NULL)
+        return false;
+      accumulate_batch_samples(trainer, &buffer->info);
+    } while (!buffer->last_of_pass);
+  }
+  end_telemetry_phase(trainer->telemetry, PHASE_BMU_SEARCH);
+
+  // 3) Neighborhood-weighted sums: rows into 'smoothed', then columns back into 'sums'
+  begin_telemetry_phase(trainer->telemetry);
+  BatchSmoothing smoothing = {.map = map, .batch = batch, .input = batch->sums, .output = batch->smoothed};
+  run_parallel(trainer->pool, smooth_rows_task, &smoothing, total_tasks);
+  smoothing.input = batch->smoothed;
+  smoothing.output = batch->sums;
+  run_parallel(trainer->pool, smooth_columns_task, &smoothing, total_tasks);
+
+  // 4) Every neuron with samples around it moves to their weighted mean. The learning rule is not applied: an
+  // online epoch makes hundreds of updates of that size, and their compound effect is close to this full step.
+  long total_updated = 0;
+  for (int n = 0; n < map->total_neurons; n++)
+  {
+    double total_weight = batch->sums[counts_plane + n];
+    if (total_weight < BATCH_MIN_NEIGHBORHOOD_WEIGHT)
+      continue;
+
+    total_updated++;
+    for (int i = 0; i < map->total_weights; i++)
+      *get_neuron_weight(map, n, i) = batch->sums[(size_t)i * map->total_neurons + n] / total_weight;
+  }
+
+  if (trainer->params.warm_search)
+    refresh_tile_bounds(&trainer->bounds, map);
+  end_telemetry_phase(trainer->telemetry, PHASE_NEIGHBORHOOD_UPDATE);
+  add_telemetry_neurons(trainer->telemetry, total_updated);
+
+  return true;
+}
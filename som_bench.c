@@ -0,0 +1,458 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Benchmarks of the SOM engine kernels. Times the BMU search, the neighborhood update and the inference
+             pass on every combination of map size, components and threads, and the loading of a dataset file. Maps
+             and samples are random but generated from a fixed seed, so two runs (or two commits) measure the same
+             work. Results are printed as a table and written to a CSV file, one row per kernel and configuration.
+
+Usage:
+gcc -std=c99 -Wno-unused-result -O3 [-DSOM_FLOAT32=1] som_bench.c som_engine.c som_simd.c som_threads.c som_batch.c som_warm_search.c som_kdtree.c som_map_file.c som_csv.c som_dataset_cache.c som_stream.c som_telemetry.c som_snapshot.c som_config.c som_quantized.c som_convergence.c -o som-bench -lm -pthread
+./som-bench [-c components] [-d dataset.csv] [-l label] [-m seconds] [-o results.csv] [-s sizes] [-t threads]
+
+Notes: Lists are comma separated, e.g. -s 50,100,1000 -c 4,11,16 -t 1,8. The map sizes are the side of square maps.
+       ns/neuron divides the time of a call by the neurons it visits (the whole map for the searches, the cells of
+       the neighborhood for the updates). GB/s counts the codebook bytes read, and written back by the updates.
+       Rates without a fixed amount of work (neurons of the dataset loading, neurons and bytes of the k-d tree
+       search, which visits a different part of the tree for every sample) are left empty.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "som.h"
+
+#define BENCHMARK_SEED 20220123
+#define BENCHMARK_MIN_SECONDS 0.25 // Every kernel runs at least this long
+#define BENCHMARK_SAMPLES 1024 // Samples of the synthetic dataset
+#define BENCHMARK_RADIUS_FRACTION 0.1 // Radius of the neighborhood updates, as a fraction of the map side
+#define BENCHMARK_LEARNING_RULE 0.5
+#define BENCHMARK_MAX_LIST 32
+
+typedef struct BenchmarkList
+{
+  int values[BENCHMARK_MAX_LIST];
+  int total;
+} BenchmarkList;
+
+typedef struct BenchmarkContext
+{
+  SOMMap *map;
+  DatasetInfo *info;
+  ThreadPool *pool;
+  NeighborhoodKernel *kernel;
+  KDTree *tree;
+  QuantizedMap *quantized;
+  int next_sample;
+} BenchmarkContext;
+
+// What a kernel does on every call, to turn its time into rates
+typedef struct BenchmarkWork
+{
+  double samples;
+  double neurons;
+  double bytes;
+} BenchmarkWork;
+
+typedef struct BenchmarkResult
+{
+  long calls;
+  double seconds;
+} BenchmarkResult;
+
+typedef void (*BenchmarkKernel)(BenchmarkContext *context);
+
+void print_usage(const char *program)
+{
+  printf("Usage: %s [options]\n", program);
+  printf("  -c, --components L  comma separated sample components (default 4,11,16)\n");
+  printf("  -d, --dataset FILE  dataset whose loading is timed (default winequality-white.csv, none to skip)\n");
+  printf("  -l, --label TEXT    written to every result row, e.g. a commit hash\n");
+  printf("  -m, --min-time S    seconds every kernel runs at least (default %g)\n", BENCHMARK_MIN_SECONDS);
+  printf("  -o, --output FILE   results file (default benchmark-results.csv)\n");
+  printf("  -s, --sizes L       comma separated map sides (default 50,100,200,300,500,1000)\n");
+  printf("  -t, --threads L     comma separated thread counts (default 1 and the CPU cores)\n");
+  printf("  -h, --help          show this help\n");
+}
+
+bool parse_benchmark_list(const char *text, BenchmarkList *list)
+{
+  char *end;
+
+  list->total = 0;
+  while (*text != '\0')
+  {
+    long value = strtol(text, &end, 10);
+    if ((end == text) || (value <= 0) || (list->total == BENCHMARK_MAX_LIST) || ((*end != ',') && (*end != '\0')))
+      return false;
+    list->values[list->total++] = (int)value;
+    text = (*end == ',') ? end + 1 : end;
+  }
+  return list->total > 0;
+}
+
+double elapsed_seconds(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Calls the kernel once to warm the caches, then as many times as fit in 'min_seconds'
+BenchmarkResult run_benchmark(BenchmarkKernel kernel, BenchmarkContext *context, double min_seconds)
+{
+  BenchmarkResult result = {0};
+  struct timespec start;
+
+  kernel(context);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do
+  {
+    kernel(context);
+    result.calls++;
+    result.seconds = elapsed_seconds(&start);
+  } while (result.seconds < min_seconds);
+
+  return result;
+}
+
+Sample *next_benchmark_sample(BenchmarkContext *context)
+{
+  Sample *sample = &context->info->samples[context->next_sample];
+  context->next_sample = (context->next_sample + 1) % context->info->total_dataset_samples;
+  return sample;
+}
+
+void benchmark_search_bmu(BenchmarkContext *context)
+{
+  Sample *sample = next_benchmark_sample(context);
+  parallel_search_bmu(context->pool, context->map, sample, &sample->bmu);
+}
+
+void benchmark_scale_neighbors(BenchmarkContext *context)
+{
+  Sample *sample = next_benchmark_sample(context);
+  parallel_scale_neighbors(context->pool, context->map, context->kernel, &sample->bmu, sample);
+}
+
+void benchmark_inference(BenchmarkContext *context)
+{
+  infer_samples(context->map, context->info, context->pool);
+}
+
+void benchmark_kdtree_inference(BenchmarkContext *context)
+{
+  kdtree_infer_samples(context->tree, context->info, context->pool);
+}
+
+void benchmark_quantized_inference(BenchmarkContext *context)
+{
+  quantized_infer_samples(context->quantized, context->info, context->pool);
+}
+
+// Percentage of samples whose BMU is the one in 'bmus'
+double bmu_agreement(DatasetInfo *info, BMU *bmus)
+{
+  int same_bmu = 0;
+
+  for (int s = 0; s < info->total_dataset_samples; s++)
+    same_bmu += (info->samples[s].bmu.x_coord == bmus[s].x_coord) && (info->samples[s].bmu.y_coord == bmus[s].y_coord);
+  return 100.0 * same_bmu / info->total_dataset_samples;
+}
+
+// Random samples in [0, 1)
+bool generate_benchmark_dataset(DatasetInfo *info, int total_components)
+{
+  memset(info, 0, sizeof(DatasetInfo));
+  info->total_components = total_components + 1;
+  if (!allocate_dataset_samples(info, BENCHMARK_SAMPLES))
+    return false;
+
+  for (int s = 0; s < BENCHMARK_SAMPLES; s++)
+  {
+    for (int i = 0; i < total_components; i++)
+      info->samples[s].components[i] = (double)rand() / (double)RAND_MAX;
+    info->targets[s] = 0.0;
+  }
+  return true;
+}
+
+void report_benchmark(FILE *fp, const char *label, const char *kernel, int size, int components, int threads, const char *simd,
+                      BenchmarkResult *result, BenchmarkWork *work)
+{
+  double seconds_per_call = result->seconds / result->calls;
+  double samples_per_second = work->samples / seconds_per_call;
+  char table_ns[32] = "-", table_gb[32] = "-", csv_ns[32] = "", csv_gb[32] = "";
+
+  // Rates without a work count are not measured: '-' in the table and empty in the CSV file
+  if (work->neurons > 0.0)
+  {
+    double ns_per_neuron = 1e9 * seconds_per_call / work->neurons;
+    snprintf(table_ns, sizeof(table_ns), "%.3f", ns_per_neuron);
+    snprintf(csv_ns, sizeof(csv_ns), "%.4f", ns_per_neuron);
+  }
+  if (work->bytes > 0.0)
+  {
+    double gb_per_second = work->bytes / seconds_per_call / 1e9;
+    snprintf(table_gb, sizeof(table_gb), "%.2f", gb_per_second);
+    snprintf(csv_gb, sizeof(csv_gb), "%.4f", gb_per_second);
+  }
+
+  printf("%-16s %5dx%-5d %10d %7d %10ld %12s %14.0f %8s\n", kernel, size, size, components, threads, result->calls, table_ns, samples_per_second, table_gb);
+  fprintf(fp, "%s;%s;%d;%d;%d;%d;%s;%ld;%.6f;%s;%.1f;%s\n", label, kernel, size, size, components, threads, simd, result->calls, result->seconds,
+          csv_ns, samples_per_second, csv_gb);
+  fflush(fp);
+}
+
+// Runs every kernel on a map of 'size' x 'size' neurons and samples of 'components' components
+bool benchmark_configuration(FILE *fp, const char *label, int size, int components, BenchmarkList *threads, double min_seconds)
+{
+  SOMMap map;
+  DatasetInfo info;
+  NeighborhoodKernel kernel = {0};
+  KDTree tree = {0};
+  QuantizedMap quantized[2] = {{0}, {0}};
+  BMU bmus[BENCHMARK_SAMPLES];
+  double agreement[2] = {0.0, 0.0};
+
+  // Every configuration starts from the same random state, whatever the ones that ran before
+  srand(BENCHMARK_SEED);
+  if (!initialize_som_map(&map, size, size, components, DEFAULT_CODEBOOK_LAYOUT))
+    return false;
+  if (!generate_benchmark_dataset(&info, components) ||
+      !build_neighborhood_kernel(&kernel, BENCHMARK_RADIUS_FRACTION * size, BENCHMARK_LEARNING_RULE, NEIGHBORHOOD_EPSILON) ||
+      !build_kdtree(&tree, &map) || !build_quantized_map(&quantized[0], &map, QUANTIZED_INT8, DEFAULT_RERANK_CANDIDATES) ||
+      !build_quantized_map(&quantized[1], &map, QUANTIZED_INT16, DEFAULT_RERANK_CANDIDATES))
+  {
+    free_quantized_map(&quantized[0]);
+    free_quantized_map(&quantized[1]);
+    free_kdtree(&tree);
+    free_neighborhood_kernel(&kernel);
+    free_dataset(&info);
+    free_som_map(&map);
+    return false;
+  }
+
+  const char *simd = simd_level_name(map.simd_level);
+  double codebook_bytes = (double)map.total_neurons * components * sizeof(som_real);
+  double samples = info.total_dataset_samples;
+  BenchmarkWork search_work = {.samples = 1, .neurons = map.total_neurons, .bytes = codebook_bytes};
+  BenchmarkWork inference_work = {.samples = samples, .neurons = samples * map.total_neurons, .bytes = samples * codebook_bytes};
+  BenchmarkWork kdtree_work = {.samples = samples, .neurons = 0.0, .bytes = 0.0};
+  BenchmarkWork quantized_work[2];
+  for (int q = 0; q < 2; q++)
+    quantized_work[q] = (BenchmarkWork){.samples = samples, .neurons = samples * map.total_neurons, .bytes = samples * quantized_map_size(&quantized[q])};
+  BenchmarkWork update_work = {.samples = 1, .neurons = kernel.total_cells, .bytes = 2.0 * kernel.total_cells * components * sizeof(som_real)};
+  BenchmarkResult result;
+  ThreadPool pool;
+
+  // The searches of every thread count run on the initial map, the updates move the weights
+  for (int t = 0; t < threads->total; t++)
+  {
+    if (!create_thread_pool(&pool, threads->values[t]))
+      continue;
+
+    BenchmarkContext context = {.map = &map, .info = &info, .pool = &pool, .kernel = &kernel, .tree = &tree};
+    result = run_benchmark(benchmark_search_bmu, &context, min_seconds);
+    report_benchmark(fp, label, "search_bmu", size, components, get_pool_threads(&pool), simd, &result, &search_work);
+    result = run_benchmark(benchmark_inference, &context, min_seconds);
+    report_benchmark(fp, label, "inference", size, components, get_pool_threads(&pool), simd, &result, &inference_work);
+    result = run_benchmark(benchmark_kdtree_inference, &context, min_seconds);
+    report_benchmark(fp, label, "kdtree_inference", size, components, get_pool_threads(&pool), simd, &result, &kdtree_work);
+
+    // The exact BMUs are the ones left by the k-d tree
+    for (int s = 0; s < info.total_dataset_samples; s++)
+      bmus[s] = info.samples[s].bmu;
+    for (int q = 0; q < 2; q++)
+    {
+      char name[32];
+      snprintf(name, sizeof(name), "%s_inference", quantized_precision_name(quantized[q].precision));
+      context.quantized = &quantized[q];
+      result = run_benchmark(benchmark_quantized_inference, &context, min_seconds);
+      report_benchmark(fp, label, name, size, components, get_pool_threads(&pool), simd, &result, &quantized_work[q]);
+      agreement[q] = bmu_agreement(&info, bmus);
+    }
+    destroy_thread_pool(&pool);
+  }
+
+  for (int t = 0; t < threads->total; t++)
+  {
+    if (!create_thread_pool(&pool, threads->values[t]))
+      continue;
+
+    // The same random BMUs, spread over the map, for every thread count (the inference replaced them)
+    srand(BENCHMARK_SEED);
+    for (int s = 0; s < info.total_dataset_samples; s++)
+    {
+      info.samples[s].bmu.x_coord = rand() % map.width;
+      info.samples[s].bmu.y_coord = rand() % map.height;
+    }
+
+    BenchmarkContext context = {.map = &map, .info = &info, .pool = &pool, .kernel = &kernel, .tree = &tree};
+    result = run_benchmark(benchmark_scale_neighbors, &context, min_seconds);
+    report_benchmark(fp, label, "scale_neighbors", size, components, get_pool_threads(&pool), simd, &result, &update_work);
+    destroy_thread_pool(&pool);
+  }
+
+  printf("%-16s %5dx%-5d %10d BMU agreement of the quantized inference (%d re-ranked candidates): int8 %.2f%% | int16 %.2f%%\n", "quantized", size, size,
+         components, DEFAULT_RERANK_CANDIDATES, agreement[0], agreement[1]);
+
+  free_quantized_map(&quantized[0]);
+  free_quantized_map(&quantized[1]);
+  free_kdtree(&tree);
+  free_neighborhood_kernel(&kernel);
+  free_dataset(&info);
+  free_som_map(&map);
+  return true;
+}
+
+// Times the parsing of the dataset file and the loading of its binary cache, before the table because the loader
+// prints the components of the dataset
+bool benchmark_dataset_loading(const char *dataset_file, BenchmarkResult results[2], BenchmarkWork work[2], int *total_components)
+{
+  for (int k = 0; k < 2; k++)
+  {
+    DatasetInfo info = {0};
+    struct timespec start;
+    bool use_cache = (k == 1);
+
+    // The first load writes the cache when it is missing or out of date
+    if (use_cache)
+    {
+      if (!load_dataset(&info, dataset_file, true))
+        return false;
+      free_dataset(&info);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!load_dataset(&info, dataset_file, use_cache))
+      return false;
+
+    results[k].calls = 1;
+    results[k].seconds = elapsed_seconds(&start);
+    work[k].samples = info.total_dataset_samples;
+    work[k].neurons = 0.0;
+    work[k].bytes = (double)info.total_dataset_samples * info.total_components * sizeof(som_real);
+    *total_components = info.total_components - 1;
+    free_dataset(&info);
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  const char *dataset_file = "winequality-white.csv";
+  const char *output_file = "benchmark-results.csv";
+  const char *label = "";
+  double min_seconds = BENCHMARK_MIN_SECONDS;
+  BenchmarkList sizes = {{50, 100, 200, 300, 500, 1000}, 6};
+  BenchmarkList components = {{4, 11, 16}, 3};
+  BenchmarkList threads = {{1, get_total_cpu_cores()}, 2};
+
+  if (threads.values[1] == 1)
+    threads.total = 1;
+
+  static struct option long_options[] = {
+      {"components", required_argument, NULL, 'c'},
+      {"dataset", required_argument, NULL, 'd'},
+      {"label", required_argument, NULL, 'l'},
+      {"min-time", required_argument, NULL, 'm'},
+      {"output", required_argument, NULL, 'o'},
+      {"sizes", required_argument, NULL, 's'},
+      {"threads", required_argument, NULL, 't'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+
+  int option;
+  while ((option = getopt_long(argc, argv, "c:d:l:m:o:s:t:h", long_options, NULL)) != -1)
+  {
+    switch (option)
+    {
+    case 'c':
+      if (!parse_benchmark_list(optarg, &components))
+      {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'd':
+      dataset_file = (strcmp(optarg, "none") == 0) ? NULL : optarg;
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    case 'm':
+      min_seconds = atof(optarg);
+      break;
+    case 'o':
+      output_file = optarg;
+      break;
+    case 's':
+      if (!parse_benchmark_list(optarg, &sizes))
+      {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 't':
+      if (!parse_benchmark_list(optarg, &threads))
+      {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  FILE *fp = fopen(output_file, "w");
+  if (fp == NULL)
+  {
+    printf("Could not open file %s\n", output_file);
+    return 1;
+  }
+
+  BenchmarkResult load_results[2];
+  BenchmarkWork load_work[2];
+  int dataset_components = 0;
+  bool dataset_loaded = (dataset_file != NULL) && benchmark_dataset_loading(dataset_file, load_results, load_work, &dataset_components);
+
+  fprintf(fp, "label;kernel;map_width;map_height;components;threads;simd;calls;seconds;ns_per_neuron;samples_per_second;gb_per_second\n");
+  printf("BMU search kernel: %s | weights: %s | seed: %d | samples: %d | minimum time per kernel: %.2fs\n", simd_level_name(detect_simd_level()),
+         SOM_REAL_NAME, BENCHMARK_SEED, BENCHMARK_SAMPLES, min_seconds);
+  printf("%-16s %11s %10s %7s %10s %12s %14s %8s\n", "KERNEL", "MAP", "COMPONENTS", "THREADS", "CALLS", "NS/NEURON", "SAMPLES/S", "GB/S");
+
+  if (dataset_loaded)
+  {
+    report_benchmark(fp, label, "load_csv", 0, dataset_components, 1, "none", &load_results[0], &load_work[0]);
+    report_benchmark(fp, label, "load_cache", 0, dataset_components, 1, "none", &load_results[1], &load_work[1]);
+  }
+
+  bool completed = true;
+  for (int s = 0; s < sizes.total; s++)
+    for (int c = 0; c < components.total; c++)
+      if (!benchmark_configuration(fp, label, sizes.values[s], components.values[c], &threads, min_seconds))
+      {
+        printf("Could not allocate the %dx%d map of %d components\n", sizes.values[s], sizes.values[s], components.values[c]);
+        completed = false;
+      }
+
+  if (fclose(fp) != 0)
+  {
+    printf("Could not write file %s\n", output_file);
+    return 1;
+  }
+  printf("Benchmark results written to %s\n", output_file);
+
+  return completed ? 0 : 1;
+}
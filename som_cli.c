@@ -0,0 +1,557 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Headless front-end of the SOM engine. Trains the map, runs the inference of every dataset sample and
+             writes the sample-to-BMU mapping to a CSV file. No window or display is needed, so it can be used on
+             batch nodes.
+
+Usage:
+gcc -std=c99 -Wno-unused-result -O3 som_cli.c som_engine.c som_simd.c som_threads.c som_batch.c som_warm_search.c som_kdtree.c som_map_file.c som_csv.c som_dataset_cache.c som_stream.c som_telemetry.c som_snapshot.c som_config.c som_quantized.c som_convergence.c -o som-cli -lm -pthread
+./som-cli [-c config] [-C] [-D key=value] [-e epochs] [-i brute|kdtree|warm|int8|int16] [-l aos|soa] [-L map.som] [-S map.som] [-m online|batch] [-n epsilon] [-o results.csv] [-P telemetry.jsonl] [-p] [-r seed] [-R candidates] [-s scalar|sse2|avx2|avx512] [-t threads] [-T] [-V map.som] [-w] [dataset.csv|dataset.csv.cache]
+
+Notes: Adding -DSOM_FLOAT32=1 to the gcc line (e.g. -o som-cli-f32) builds a single precision version. To check its
+       quality, train the same configuration and seed with both builds, save the double map with -S and pass it to the
+       float one with -V: it reports the quantization error of both maps and how many samples get the same BMU.
+       A double map loaded by the float build (-L) gives nearly the same BMUs as the double build, but not always
+       the same ones: rounding the weights to float can swap neurons that are almost equally close (3 of 4898
+       samples on a map of the white wine dataset trained for 4 epochs).
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "som.h"
+
+typedef enum InferenceMethod
+{
+  INFERENCE_BRUTE_FORCE,
+  INFERENCE_KDTREE,
+  INFERENCE_WARM_SEARCH,
+  INFERENCE_QUANTIZED
+} InferenceMethod;
+
+void print_usage(const char *program)
+{
+  printf("Usage: %s [options] [dataset.csv]\n", program);
+  printf("Options are applied in the order given, a later one overrides the values set by an earlier one.\n");
+  printf("  -c, --config FILE  read the configuration from the 'key = value' lines of FILE\n");
+  printf("  -C, --no-cache     always parse the CSV file, without reading or writing its binary cache\n");
+  printf("  -D, --set K=V      set the configuration key K: dataset, map_width, map_height (default %dx%d), epochs,\n", MAP_WIDTH, MAP_HEIGHT);
+  printf("                     iterations_per_epoch, radius, learning_rule, epsilon, mode, warm_search (yes or no),\n");
+  printf("                     convergence_threshold (stop improving epochs early, default 0: off) or holdout_samples\n");
+  printf("  -e, --epochs N     total training epochs (default %d)\n", TOTAL_EPOCHS);
+  printf("  -i, --inference M  final inference search: brute, kdtree, warm, int8 or int16 (quantized weights, default kdtree)\n");
+  printf("  -l, --layout L     codebook layout, aos or soa (default soa)\n");
+  printf("  -L, --load-map F   skip the training and use the map saved in F\n");
+  printf("  -m, --mode M       training mode, online or batch (default online)\n");
+  printf("  -n, --epsilon E    skip neighborhood updates with a smaller scale (default %g)\n", NEIGHBORHOOD_EPSILON);
+  printf("  -o, --output FILE  inference results file (default inference-results.csv)\n");
+  printf("  -P, --telemetry F  write the time of every training phase per epoch to F (JSON lines, or CSV if F is *.csv)\n");
+  printf("  -p, --telemetry-iterations  also write a telemetry record per iteration\n");
+  printf("  -r, --seed N       seed of the map initialization and the sample order (default: the current time)\n");
+  printf("  -R, --rerank N     best neurons of the int8 or int16 inference re-ranked with exact distances, 0 for none (default %d)\n", DEFAULT_RERANK_CANDIDATES);
+  printf("  -S, --save-map F   save the trained map to F\n");
+  printf("  -s, --simd ISA     BMU search kernel: scalar, sse2, avx2 or avx512 (default: best supported)\n");
+  printf("  -t, --threads N    worker threads for BMU search and inference (default: CPU cores)\n");
+  printf("  -T, --stream       train and infer out of core, reading the dataset cache a chunk at a time\n");
+  printf("  -V, --validate F   compare the quantization error and the BMUs of the samples with the ones of the map saved in F\n");
+  printf("  -w, --warm-search  train starting every BMU search from the last BMU of the sample\n");
+  printf("  -h, --help         show this help\n");
+}
+
+double elapsed_seconds(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// The dataset cache to stream: the file itself if it is one, or the cache of the CSV file, converted out of core
+// when it is missing or out of date. Free it with free().
+char *prepare_stream_file(const char *dataset_file)
+{
+  size_t length = strlen(dataset_file), suffix_length = strlen(DATASET_CACHE_SUFFIX);
+
+  if ((length > suffix_length) && (strcmp(dataset_file + length - suffix_length, DATASET_CACHE_SUFFIX) == 0))
+    return strdup(dataset_file);
+
+  char *cache_file = dataset_cache_filename(dataset_file);
+  if ((cache_file != NULL) && !dataset_cache_up_to_date(cache_file, dataset_file))
+  {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("Converting %s to %s\n", dataset_file, cache_file);
+    if (!convert_csv_to_dataset_cache(dataset_file, cache_file))
+    {
+      free(cache_file);
+      return NULL;
+    }
+    printf("Converted in %.2fs\n", elapsed_seconds(&start));
+  }
+  return cache_file;
+}
+
+// Finds the BMU of every sample with the chosen search
+void infer_with_method(InferenceMethod inference, SOMMap *map, KDTree *tree, TileBounds *bounds, QuantizedMap *quantized, DatasetInfo *samples, ThreadPool *pool,
+                       BMUSearchStats *stats)
+{
+  if (inference == INFERENCE_KDTREE)
+    kdtree_infer_samples(tree, samples, pool);
+  else if (inference == INFERENCE_QUANTIZED)
+    quantized_infer_samples(quantized, samples, pool);
+  else if (inference == INFERENCE_WARM_SEARCH)
+    warm_infer_samples(map, bounds, samples, pool, stats);
+  else
+    infer_samples(map, samples, pool);
+}
+
+// Inference of the whole dataset cache, read in file order a chunk at a time. The results are written as every
+// chunk is done. Returns the number of samples, or -1 on errors.
+long stream_inference(InferenceMethod inference, SOMMap *map, KDTree *tree, TileBounds *bounds, QuantizedMap *quantized, DatasetInfo *info, const DatasetCacheLayout *layout,
+                      const char *stream_file, ThreadPool *pool, BMUSearchStats *stats, const char *output_file, double *quantization_error_sum)
+{
+  DatasetStream stream;
+  StreamBuffer *buffer;
+  long total_samples = 0;
+  FILE *fp = fopen(output_file, "w");
+
+  if (fp == NULL)
+  {
+    printf("Could not open file %s\n", output_file);
+    return -1;
+  }
+  if (!open_dataset_stream(&stream, stream_file, info, layout, false, 0))
+  {
+    fclose(fp);
+    return -1;
+  }
+
+  write_inference_header(fp, info);
+  *quantization_error_sum = 0.0;
+  do
+  {
+    if ((buffer = next_stream_chunk(&stream)) == NULL)
+    {
+      total_samples = -1;
+      break;
+    }
+    infer_with_method(inference, map, tree, bounds, quantized, &buffer->info, pool, stats);
+    *quantization_error_sum += quantization_error(map, &buffer->info) * buffer->info.total_dataset_samples;
+    write_inference_rows(fp, &buffer->info, buffer->first_sample);
+    total_samples += buffer->info.total_dataset_samples;
+  } while (!buffer->last_of_pass);
+
+  print_dataset_stream_stats(&stream);
+  close_dataset_stream(&stream);
+  if ((fclose(fp) != 0) && (total_samples >= 0))
+  {
+    printf("Could not write file %s\n", output_file);
+    total_samples = -1;
+  }
+  return total_samples;
+}
+
+// Compares the inference of 'map', already in the samples, with the one of the map saved in 'reference_file' (of
+// either precision): quantization errors, samples with the same BMU and mean grid distance between their BMUs.
+bool validate_with_reference_map(SOMMap *map, DatasetInfo *info, ThreadPool *pool, const char *reference_file)
+{
+  SOMMap reference;
+  DatasetInfo reference_info = {0};
+  BMU *bmus = (BMU *)malloc(sizeof(BMU) * max(1, info->total_dataset_samples));
+  bool validated = false;
+
+  if (bmus == NULL)
+  {
+    printf("Could not allocate the BMUs to validate\n");
+    return false;
+  }
+  if (!load_som_map(&reference, &reference_info, reference_file))
+  {
+    free(bmus);
+    return false;
+  }
+
+  if ((reference.width != map->width) || (reference.height != map->height))
+    printf("The reference map is %dx%d and the map %dx%d\n", reference.width, reference.height, map->width, map->height);
+  else if (som_map_matches_dataset(&reference_info, info))
+  {
+    double quantization_error_map = quantization_error(map, info);
+    double quantization_error_reference;
+    double displacement = 0.0;
+    int same_bmu = 0;
+
+    for (int i = 0; i < info->total_dataset_samples; i++)
+      bmus[i] = info->samples[i].bmu;
+    reference.simd_level = map->simd_level;
+    infer_samples(&reference, info, pool);
+    quantization_error_reference = quantization_error(&reference, info);
+
+    for (int i = 0; i < info->total_dataset_samples; i++)
+    {
+      BMU *bmu = &info->samples[i].bmu;
+      same_bmu += (bmu->x_coord == bmus[i].x_coord) && (bmu->y_coord == bmus[i].y_coord);
+      displacement += sqrt(pow2((double)(bmu->x_coord - bmus[i].x_coord)) + pow2((double)(bmu->y_coord - bmus[i].y_coord)));
+      *bmu = bmus[i];
+    }
+
+    printf("Validation of the %s map with %s: quantization error %f, reference %f (%+.4f%%) | same BMU: %.2f%% of %d samples | mean BMU displacement: %.4f neurons\n",
+           SOM_REAL_NAME, reference_file, quantization_error_map, quantization_error_reference,
+           quantization_error_reference > 0.0 ? 100.0 * (quantization_error_map - quantization_error_reference) / quantization_error_reference : 0.0,
+           info->total_dataset_samples > 0 ? 100.0 * same_bmu / info->total_dataset_samples : 100.0, info->total_dataset_samples,
+           info->total_dataset_samples > 0 ? displacement / info->total_dataset_samples : 0.0);
+    validated = true;
+  }
+
+  free_som_map(&reference);
+  free_dataset(&reference_info);
+  free(bmus);
+  return validated;
+}
+
+int main(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+      {"config", required_argument, NULL, 'c'},
+      {"no-cache", no_argument, NULL, 'C'},
+      {"set", required_argument, NULL, 'D'},
+      {"epochs", required_argument, NULL, 'e'},
+      {"inference", required_argument, NULL, 'i'},
+      {"layout", required_argument, NULL, 'l'},
+      {"load-map", required_argument, NULL, 'L'},
+      {"mode", required_argument, NULL, 'm'},
+      {"epsilon", required_argument, NULL, 'n'},
+      {"output", required_argument, NULL, 'o'},
+      {"telemetry", required_argument, NULL, 'P'},
+      {"telemetry-iterations", no_argument, NULL, 'p'},
+      {"seed", required_argument, NULL, 'r'},
+      {"rerank", required_argument, NULL, 'R'},
+      {"save-map", required_argument, NULL, 'S'},
+      {"simd", required_argument, NULL, 's'},
+      {"threads", required_argument, NULL, 't'},
+      {"stream", no_argument, NULL, 'T'},
+      {"validate", required_argument, NULL, 'V'},
+      {"warm-search", no_argument, NULL, 'w'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+
+  const char *output_file = "inference-results.csv";
+  const char *load_map_file = NULL;
+  const char *save_map_file = NULL;
+  const char *validate_map_file = NULL;
+  CodebookLayout layout = DEFAULT_CODEBOOK_LAYOUT;
+  InferenceMethod inference = INFERENCE_KDTREE;
+  QuantizedPrecision quantized_precision = QUANTIZED_INT8;
+  int rerank_candidates = DEFAULT_RERANK_CANDIDATES;
+  SIMDLevel simd_level = detect_simd_level();
+  int total_threads = get_total_cpu_cores();
+  bool use_dataset_cache = true;
+  bool streaming = false;
+  unsigned int seed = (unsigned int)time(NULL);
+  const char *telemetry_file = NULL;
+  bool telemetry_iterations = false;
+  SOMConfig config;
+  default_som_config(&config);
+
+  int option;
+  while ((option = getopt_long(argc, argv, "c:CD:e:i:l:L:m:n:o:pP:r:R:s:S:t:TV:wh", long_options, NULL)) != -1)
+  {
+    switch (option)
+    {
+    case 'c':
+      if (!load_som_config(&config, optarg))
+        return 1;
+      break;
+    case 'C':
+      use_dataset_cache = false;
+      break;
+    case 'D':
+      if (!set_som_config_assignment(&config, optarg))
+        return 1;
+      break;
+    case 'e':
+      if (!set_som_config_value(&config, "epochs", optarg))
+        return 1;
+      break;
+    case 'i':
+      if (strcmp(optarg, "brute") == 0)
+        inference = INFERENCE_BRUTE_FORCE;
+      else if (strcmp(optarg, "kdtree") == 0)
+        inference = INFERENCE_KDTREE;
+      else if (strcmp(optarg, "warm") == 0)
+        inference = INFERENCE_WARM_SEARCH;
+      else if ((strcmp(optarg, "int8") == 0) || (strcmp(optarg, "int16") == 0))
+      {
+        inference = INFERENCE_QUANTIZED;
+        quantized_precision = (strcmp(optarg, "int8") == 0) ? QUANTIZED_INT8 : QUANTIZED_INT16;
+      }
+      else
+      {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'l':
+      if (strcmp(optarg, "aos") == 0)
+        layout = CODEBOOK_AOS;
+      else if (strcmp(optarg, "soa") == 0)
+        layout = CODEBOOK_SOA;
+      else
+      {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'L':
+      load_map_file = optarg;
+      break;
+    case 'm':
+      if (!set_som_config_value(&config, "mode", optarg))
+        return 1;
+      break;
+    case 'n':
+      if (!set_som_config_value(&config, "epsilon", optarg))
+        return 1;
+      break;
+    case 'o':
+      output_file = optarg;
+      break;
+    case 'p':
+      telemetry_iterations = true;
+      break;
+    case 'P':
+      telemetry_file = optarg;
+      break;
+    case 'r':
+      seed = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'R':
+      rerank_candidates = atoi(optarg);
+      if ((rerank_candidates < 0) || (rerank_candidates > MAX_RERANK_CANDIDATES))
+      {
+        printf("The re-ranked candidates must be between 0 and %d\n", MAX_RERANK_CANDIDATES);
+        return 1;
+      }
+      break;
+    case 's':
+      if (!parse_simd_level(optarg, &simd_level) || (simd_level > detect_simd_level()))
+      {
+        printf("Unsupported BMU search kernel: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'S':
+      save_map_file = optarg;
+      break;
+    case 't':
+      total_threads = atoi(optarg);
+      break;
+    case 'T':
+      streaming = true;
+      break;
+    case 'V':
+      validate_map_file = optarg;
+      break;
+    case 'w':
+      config.params.warm_search = true;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if ((optind < argc) && !set_som_config_value(&config, "dataset", argv[optind]))
+    return 1;
+  const char *dataset_csv_file = config.dataset_file;
+  TrainingParams params = config.params;
+
+  DatasetInfo info = {0};
+  DatasetInfo map_info = {0};
+  DatasetCacheLayout stream_layout;
+  DatasetStream stream;
+  char *stream_file = NULL;
+  SOMMap map;
+  Trainer trainer;
+  ThreadPool pool;
+  Telemetry telemetry = {0};
+  ConvergenceMonitor monitor;
+  struct timespec start;
+
+  // Random seed, fixed with -r to repeat a run
+  srand(seed);
+
+  // Load and initialize info and samples from the dataset. Streamed datasets only load their components.
+  if (streaming)
+  {
+    if (((stream_file = prepare_stream_file(dataset_csv_file)) == NULL) || !read_dataset_cache_info(&info, &stream_layout, stream_file))
+    {
+      free(stream_file);
+      return 1;
+    }
+    printf("Streaming %d samples of %d fields from %s\n", stream_layout.total_samples, info.total_components, stream_file);
+  }
+  else if (!load_dataset(&info, dataset_csv_file, use_dataset_cache))
+    return 1;
+
+  // Initialize the Neural Network (Self-Organizing Map), or map a trained one
+  if (load_map_file != NULL)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!load_som_map(&map, &map_info, load_map_file) || !som_map_matches_dataset(&map_info, &info))
+    {
+      free_dataset(&map_info);
+      free_dataset(&info);
+      free(stream_file);
+      return 1;
+    }
+    printf("Map %dx%d loaded from %s in %.4fs\n", map.width, map.height, load_map_file, elapsed_seconds(&start));
+  }
+  else if (!initialize_som_map(&map, config.map_width, config.map_height, info.total_components - 1, layout))
+  {
+    free_dataset(&info);
+    free(stream_file);
+    return 1;
+  }
+  map.simd_level = simd_level;
+  if (!create_thread_pool(&pool, total_threads))
+  {
+    printf("Could not create a pool of %d threads, running on a single thread\n", total_threads);
+    create_thread_pool(&pool, 1);
+  }
+  initialize_trainer(&trainer, &map, &info, &params);
+  trainer.pool = &pool;
+  if (load_map_file == NULL)
+    print_som_config(&config);
+  printf("Training mode: %s | BMU search kernel: %s | threads: %d\n", load_map_file != NULL ? "none" : params.mode == TRAINING_BATCH ? "batch" : "online",
+         map.layout == CODEBOOK_AOS ? "aos scalar" : simd_level_name(map.simd_level), get_pool_threads(&pool));
+
+  if ((telemetry_file != NULL) && (load_map_file == NULL) && open_telemetry(&telemetry, telemetry_file, telemetry_iterations))
+    trainer.telemetry = &telemetry;
+
+  bool trained = true;
+  if (streaming && (load_map_file == NULL))
+  {
+    trained = open_dataset_stream(&stream, stream_file, &info, &stream_layout, true, (unsigned int)rand());
+    trainer.stream = trained ? &stream : NULL;
+  }
+  if (trained && (load_map_file == NULL) && (params.convergence_threshold > 0.0))
+  {
+    if (streaming)
+      printf("The convergence monitor needs the samples in memory, it is not available with -T\n");
+    else
+    {
+      trained = start_convergence_monitor(&monitor, &trainer);
+      if (trained)
+        printf("Convergence monitor: %d of %d samples held out of the training\n", monitor.holdout.total_dataset_samples, info.total_dataset_samples);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (trained && (load_map_file == NULL) && begin_next_epoch(&trainer))
+  {
+    while (train_next_iteration(&trainer))
+      ;
+    printf("EPOCH %d/%d | ITERATIONS: %d | RADIUS: %.2f | LEARNING RULE: %.4f | %.2fs\n", trainer.epoch, params.total_epochs, trainer.iteration, trainer.radius, trainer.learning_rule, elapsed_seconds(&start));
+  }
+  if (trainer.monitor != NULL)
+  {
+    stop_convergence_monitor(&monitor);
+    print_convergence_summary(&monitor);
+  }
+
+  if (trainer.stream != NULL)
+  {
+    trained = !stream.failed;
+    print_dataset_stream_stats(&stream);
+    close_dataset_stream(&stream);
+    trainer.stream = NULL;
+  }
+  print_bmu_search_stats(&trainer.search_stats, &map);
+  if (trainer.telemetry != NULL)
+  {
+    close_telemetry(&telemetry);
+    print_telemetry_summary(&telemetry);
+    printf("Telemetry written to %s\n", telemetry_file);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  KDTree tree = {0};
+  QuantizedMap quantized = {0};
+  BMUSearchStats inference_stats = {0};
+  if (inference == INFERENCE_KDTREE)
+  {
+    if (!build_kdtree(&tree, &map))
+      inference = INFERENCE_BRUTE_FORCE;
+    else
+      printf("K-d tree of %d nodes built in %.2fs\n", tree.total_nodes, elapsed_seconds(&start));
+  }
+  if (inference == INFERENCE_WARM_SEARCH)
+  {
+    if ((trainer.bounds.lower == NULL) && !allocate_tile_bounds(&trainer.bounds, &map, BMU_TILE_SIZE, get_pool_threads(&pool)))
+      inference = INFERENCE_BRUTE_FORCE;
+    else
+      refresh_tile_bounds(&trainer.bounds, &map);
+  }
+  if (inference == INFERENCE_QUANTIZED)
+  {
+    if (!build_quantized_map(&quantized, &map, quantized_precision, rerank_candidates))
+      inference = INFERENCE_BRUTE_FORCE;
+    else
+      printf("%s weights of %zu bytes (scale %d, %d re-ranked candidates) built in %.2fs\n", quantized_precision_name(quantized.precision), quantized_map_size(&quantized),
+             quantized.scale, quantized.rerank_candidates, elapsed_seconds(&start));
+  }
+
+  bool written = false;
+  bool validated = true;
+  if (trained && streaming)
+  {
+    if (validate_map_file != NULL)
+    {
+      printf("The validation needs the samples in memory, it is not available with -T\n");
+      validated = false;
+    }
+    double quantization_error_sum;
+    long total_samples = stream_inference(inference, &map, &tree, &trainer.bounds, &quantized, &info, &stream_layout, stream_file, &pool, &inference_stats, output_file, &quantization_error_sum);
+    print_bmu_search_stats(&inference_stats, &map);
+    written = (total_samples > 0);
+    if (written)
+    {
+      printf("Inference of %ld samples: %.2fs\n", total_samples, elapsed_seconds(&start));
+      printf("Quantization error: %f\n", quantization_error_sum / total_samples);
+    }
+  }
+  else if (trained)
+  {
+    infer_with_method(inference, &map, &tree, &trainer.bounds, &quantized, &info, &pool, &inference_stats);
+    print_bmu_search_stats(&inference_stats, &map);
+    printf("Inference of %d samples: %.2fs\n", info.total_dataset_samples, elapsed_seconds(&start));
+    printf("Quantization error: %f\n", quantization_error(&map, &info));
+    written = write_inference_results(&info, output_file);
+    validated = (validate_map_file == NULL) || validate_with_reference_map(&map, &info, &pool, validate_map_file);
+  }
+  if (written)
+    printf("Inference results written to %s\n", output_file);
+  free_kdtree(&tree);
+  free_quantized_map(&quantized);
+
+  if (trained && (save_map_file != NULL) && save_som_map(&map, &info, save_map_file))
+    printf("Map saved to %s\n", save_map_file);
+
+  free_trainer(&trainer);
+  destroy_thread_pool(&pool);
+  free_som_map(&map);
+  free_dataset(&map_info);
+  free_dataset(&info);
+  free(stream_file);
+
+  return (written && validated) ? 0 : 1;
+}
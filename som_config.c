@@ -0,0 +1,194 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Runtime configuration of the front-ends: the dataset, the size of the map and the training schedule.
+             Values are read from 'key = value' lines of a configuration file or given one at a time on the
+             command line, so experiments do not need a recompile.
+
+Notes: Lines starting with '#' are comments. The keys are the ones of config_keys below, and every value is
+       checked when it is set. Values not set keep the defaults of som.h.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include "som.h"
+
+static const char *config_keys = "dataset, map_width, map_height, epochs, iterations_per_epoch, radius, learning_rule, epsilon, mode, warm_search, convergence_threshold, holdout_samples";
+
+void default_som_config(SOMConfig *config)
+{
+  memset(config, 0, sizeof(SOMConfig));
+  snprintf(config->dataset_file, sizeof(config->dataset_file), "%s", DEFAULT_DATASET_FILE);
+  config->map_width = MAP_WIDTH;
+  config->map_height = MAP_HEIGHT;
+  default_training_params(&config->params);
+}
+
+static bool parse_config_int(const char *value, int min_value, int max_value, int *result)
+{
+  char *end;
+  long number = strtol(value, &end, 10);
+
+  if ((end == value) || (*end != '\0') || (number < min_value) || (number > max_value))
+    return false;
+  *result = (int)number;
+  return true;
+}
+
+static bool parse_config_double(const char *value, double *result)
+{
+  char *end;
+
+  *result = strtod(value, &end);
+  return (end != value) && (*end == '\0');
+}
+
+// Sets a single value. Returns false, printing why, if the key is unknown or the value is not valid for it.
+bool set_som_config_value(SOMConfig *config, const char *key, const char *value)
+{
+  TrainingParams *params = &config->params;
+  double number;
+  bool valid;
+
+  if (strcmp(key, "dataset") == 0)
+    valid = (*value != '\0') && (snprintf(config->dataset_file, sizeof(config->dataset_file), "%s", value) < (int)sizeof(config->dataset_file));
+  else if (strcmp(key, "map_width") == 0)
+    valid = parse_config_int(value, 1, MAX_MAP_SIDE, &config->map_width);
+  else if (strcmp(key, "map_height") == 0)
+    valid = parse_config_int(value, 1, MAX_MAP_SIDE, &config->map_height);
+  else if (strcmp(key, "epochs") == 0)
+    valid = parse_config_int(value, 1, INT_MAX, &params->total_epochs);
+  else if (strcmp(key, "iterations_per_epoch") == 0)
+    valid = parse_config_int(value, 1, INT_MAX, &params->initial_iterations_per_epoch);
+  else if (strcmp(key, "radius") == 0)
+  {
+    valid = parse_config_double(value, &number) && (number >= 1.0);
+    if (valid)
+      params->initial_radius = number;
+  }
+  else if (strcmp(key, "learning_rule") == 0)
+  {
+    valid = parse_config_double(value, &number) && (number > 0.0) && (number <= 1.0);
+    if (valid)
+      params->initial_learning_rule = number;
+  }
+  else if (strcmp(key, "epsilon") == 0)
+  {
+    valid = parse_config_double(value, &number) && (number >= 0.0) && (number < 1.0);
+    if (valid)
+      params->neighborhood_epsilon = number;
+  }
+  else if (strcmp(key, "mode") == 0)
+  {
+    valid = (strcmp(value, "online") == 0) || (strcmp(value, "batch") == 0);
+    if (valid)
+      params->mode = (strcmp(value, "batch") == 0) ? TRAINING_BATCH : TRAINING_ONLINE;
+  }
+  else if (strcmp(key, "warm_search") == 0)
+  {
+    valid = (strcmp(value, "yes") == 0) || (strcmp(value, "no") == 0);
+    if (valid)
+      params->warm_search = (strcmp(value, "yes") == 0);
+  }
+  else if (strcmp(key, "convergence_threshold") == 0)
+  {
+    valid = parse_config_double(value, &number) && (number >= 0.0) && (number < 1.0);
+    if (valid)
+      params->convergence_threshold = number;
+  }
+  else if (strcmp(key, "holdout_samples") == 0)
+    valid = parse_config_int(value, 1, INT_MAX, &params->holdout_samples);
+  else
+  {
+    printf("Unknown configuration key '%s', the keys are: %s\n", key, config_keys);
+    return false;
+  }
+
+  if (!valid)
+    printf("Invalid value '%s' for the configuration key '%s'\n", value, key);
+  return valid;
+}
+
+static char *trim(char *s)
+{
+  char *end = s + strlen(s);
+
+  while (isspace((unsigned char)*s))
+    s++;
+  while ((end > s) && isspace((unsigned char)end[-1]))
+    end--;
+  *end = '\0';
+  return s;
+}
+
+// Sets the value of a 'key=value' assignment, as given with -D on the command line
+bool set_som_config_assignment(SOMConfig *config, const char *assignment)
+{
+  char line[CONFIG_LINE_SIZE];
+  char *equals;
+
+  if ((snprintf(line, sizeof(line), "%s", assignment) >= (int)sizeof(line)) || ((equals = strchr(line, '=')) == NULL))
+  {
+    printf("Invalid configuration assignment '%s', expected key=value\n", assignment);
+    return false;
+  }
+
+  *equals = '\0';
+  return set_som_config_value(config, trim(line), trim(equals + 1));
+}
+
+bool load_som_config(SOMConfig *config, const char *filename)
+{
+  char line[CONFIG_LINE_SIZE];
+  int line_number = 0;
+  bool loaded = true;
+  FILE *fp = fopen(filename, "r");
+
+  if (fp == NULL)
+  {
+    printf("Could not open file %s\n", filename);
+    return false;
+  }
+
+  while (loaded && (fgets(line, sizeof(line), fp) != NULL))
+  {
+    char *content;
+
+    line_number++;
+    if ((strchr(line, '\n') == NULL) && !feof(fp))
+    {
+      printf("Line %d of %s is too long\n", line_number, filename);
+      loaded = false;
+      break;
+    }
+
+    content = trim(line);
+    if ((*content == '\0') || (*content == '#'))
+      continue;
+
+    loaded = set_som_config_assignment(config, content);
+    if (!loaded)
+      printf("Error in line %d of %s\n", line_number, filename);
+  }
+
+  fclose(fp);
+  return loaded;
+}
+
+void print_som_config(SOMConfig *config)
+{
+  TrainingParams *params = &config->params;
+
+  printf("Dataset: %s | map: %dx%d | epochs: %d | iterations per epoch: %d | radius: %g | learning rule: %g | epsilon: %g\n",
+         config->dataset_file, config->map_width, config->map_height, params->total_epochs, params->initial_iterations_per_epoch,
+         params->initial_radius, params->initial_learning_rule, params->neighborhood_epsilon);
+  if (params->convergence_threshold > 0.0)
+    printf("Convergence threshold: %g\n", params->convergence_threshold);
+}
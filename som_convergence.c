@@ -0,0 +1,314 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Convergence monitor of the training. A few samples are held out of the training and a thread running
+             next to it estimates the quantization error of the codebook checkpoints the trainer publishes during
+             the fine-tuning epochs. Once the error stops improving the trainer cuts the epoch short, and once a
+             whole epoch stops improving it ends the training, so the training time follows how hard the dataset
+             is instead of the fixed schedule.
+
+Notes: The monitor only looks at the fine-tuning epochs, the ones with the learning rule at its floor and a radius
+       narrower than the map. The error of the earlier epochs can stall while the map is reorganized, and stopping
+       there left a 60x40 map trained for 4 epochs at a radius of 133 with a quantization error of 0.42 instead of
+       0.26. Only the quantization error drives the decisions, the topographic error of a few hundred samples
+       moves in steps too coarse to compare, and it is only estimated for the final map. The threshold is a
+       relative improvement per epoch: an epoch has settled when the improvement between two consecutive
+       checkpoints, at that pace for a whole epoch, is below it, and the training has converged when an epoch
+       settles less than the threshold below the last checkpoint of the previous one. An epoch of a single
+       iteration (a batch pass) has a single checkpoint and can not be cut short: the training has converged when
+       it improves the error of the previous epoch less than the threshold, which the trainer sees once the next
+       epoch has begun. The monitor evaluates the newest checkpoint when it is done with the previous one, so which
+       ones it sees depends on the speed of both threads: runs with the monitor are not repeatable with the same
+       seed.
+
+       The held-out BMUs are found with the warm-started search of the previous checkpoint's BMUs, which scans
+       about 3% of a fine-tuned 300x300 map: a checkpoint takes about 40ms of CPU instead of the 270ms of the two
+       full scans per sample it took before. Measured on one core with winequality-white.csv (-r 3):
+         300x300, 8 epochs   without monitor 17.7s, QE 0.0853 | threshold 0.01: 18.5s, QE 0.0857, no epoch cut
+                             (before: 20.3s, QE 0.0918, epochs 5 to 7 cut, two of them above the learning rule floor)
+         60x40, 4 epochs     threshold 0.01: no fine-tuning epoch, QE 0.259 like without monitor (before: 0.450)
+         60x40, 10 epochs    without monitor 2.7s, QE 0.1091 | threshold 0.05: 1.8s, QE 0.1105, 3 epochs cut
+       The 0.0004 the 300x300 map loses with the monitor comes from the held-out samples it is not trained with.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "som.h"
+
+// Copy of the dataset with a subset of its samples. The samples point to the rows of the dataset, and the targets
+// are left out (the training does not read them).
+static bool allocate_dataset_view(DatasetInfo *view, DatasetInfo *dataset, int total_samples)
+{
+  *view = *dataset;
+  view->targets = NULL;
+  view->total_dataset_samples = total_samples;
+  view->samples = (Sample *)malloc(sizeof(Sample) * max(total_samples, 1));
+  if (view->samples == NULL)
+  {
+    printf("Could not allocate the samples of the convergence monitor\n");
+    return false;
+  }
+  return true;
+}
+
+// Splits the dataset of the trainer into the training samples and the held-out ones, picked at random
+static bool split_holdout_samples(ConvergenceMonitor *monitor, DatasetInfo *dataset, int holdout_samples, unsigned int *random_state)
+{
+  int total = dataset->total_dataset_samples;
+  int *order;
+
+  if ((holdout_samples < 1) || (total - holdout_samples < 1))
+  {
+    printf("The dataset has too few samples to hold %d out for the convergence monitor\n", holdout_samples);
+    return false;
+  }
+  if ((order = (int *)malloc(sizeof(int) * total)) == NULL)
+  {
+    printf("Could not allocate the samples of the convergence monitor\n");
+    return false;
+  }
+  if (!allocate_dataset_view(&monitor->holdout, dataset, holdout_samples) || !allocate_dataset_view(&monitor->training, dataset, total - holdout_samples))
+  {
+    free(order);
+    return false;
+  }
+
+  // Partial Fisher-Yates shuffle, the first samples of the order are the held-out ones. The training ones keep
+  // the dataset order.
+  for (int i = 0; i < total; i++)
+    order[i] = i;
+  for (int i = 0; i < holdout_samples; i++)
+  {
+    int j = i + ((random_state != NULL) ? rand_r(random_state) : rand()) % (total - i);
+    int swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+
+  bool *held_out = (bool *)calloc(total, sizeof(bool));
+  if (held_out == NULL)
+  {
+    printf("Could not allocate the samples of the convergence monitor\n");
+    free(order);
+    return false;
+  }
+  for (int i = 0; i < holdout_samples; i++)
+  {
+    monitor->holdout.samples[i] = dataset->samples[order[i]];
+    monitor->holdout.samples[i].bmu = (BMU){0};
+    held_out[order[i]] = true;
+  }
+  for (int i = 0, t = 0; i < total; i++)
+    if (!held_out[i])
+      monitor->training.samples[t++] = dataset->samples[i];
+
+  free(held_out);
+  free(order);
+  return true;
+}
+
+// Quantization error of the held-out samples, whose BMUs are only used by the monitor. The BMUs move little
+// between checkpoints, so the warm-started search scans a few tiles of the map for most of them.
+static double evaluate_holdout(ConvergenceMonitor *monitor, SOMMap *map)
+{
+  BMUSearchStats stats = {0};
+
+  refresh_tile_bounds(&monitor->bounds, map);
+  for (int i = 0; i < monitor->holdout.total_dataset_samples; i++)
+    warm_search_bmu(&monitor->bounds, 0, map, &monitor->holdout.samples[i], &stats);
+
+  return quantization_error(map, &monitor->holdout);
+}
+
+// Relative improvement of the error, negative when it got worse
+static double error_improvement(double previous, double current)
+{
+  return (previous > 0.0) ? (previous - current) / previous : 0.0;
+}
+
+// Evaluates a checkpoint and applies the rules of the notes above
+static void evaluate_checkpoint(ConvergenceMonitor *monitor, CodebookSnapshot *checkpoint)
+{
+  double previous_error = monitor->quantization_error;
+  int previous_epoch = monitor->evaluated_epoch;
+  int previous_iteration = monitor->evaluated_iteration;
+
+  if ((previous_epoch != 0) && (checkpoint->epoch != previous_epoch))
+    monitor->previous_epoch_error = previous_error;
+
+  monitor->quantization_error = evaluate_holdout(monitor, &checkpoint->map);
+  monitor->evaluations++;
+  monitor->evaluated_epoch = checkpoint->epoch;
+  monitor->evaluated_iteration = checkpoint->iteration;
+
+  if (checkpoint->iterations_per_epoch == 1)
+  {
+    if ((previous_epoch != 0) && (checkpoint->epoch != previous_epoch) && (error_improvement(previous_error, monitor->quantization_error) < monitor->threshold))
+      __atomic_store_n(&monitor->converged, true, __ATOMIC_RELEASE);
+    return;
+  }
+
+  // Improvement of a whole epoch at the pace of the last checkpoints
+  int evaluated_iterations = checkpoint->iteration - previous_iteration;
+  if ((checkpoint->epoch != previous_epoch) || (evaluated_iterations <= 0) ||
+      (error_improvement(previous_error, monitor->quantization_error) * checkpoint->iterations_per_epoch / evaluated_iterations >= monitor->threshold))
+    return;
+
+  __atomic_store_n(&monitor->settled_epoch, checkpoint->epoch, __ATOMIC_RELEASE);
+  if ((checkpoint->epoch > 1) && (monitor->previous_epoch_error > 0.0) &&
+      (error_improvement(monitor->previous_epoch_error, monitor->quantization_error) < monitor->threshold))
+    __atomic_store_n(&monitor->converged, true, __ATOMIC_RELEASE);
+}
+
+static void *convergence_monitor_thread(void *argument)
+{
+  ConvergenceMonitor *monitor = (ConvergenceMonitor *)argument;
+
+  for (;;)
+  {
+    bool fresh;
+
+    pthread_mutex_lock(&monitor->mutex);
+    while (!monitor->quit && !(__atomic_load_n(&monitor->checkpoints.middle, __ATOMIC_ACQUIRE) & SNAPSHOT_FRESH))
+      pthread_cond_wait(&monitor->published, &monitor->mutex);
+    bool quit = monitor->quit;
+    pthread_mutex_unlock(&monitor->mutex);
+    if (quit)
+      break;
+
+    CodebookSnapshot *checkpoint = acquire_codebook_snapshot(&monitor->checkpoints, &fresh);
+    if (fresh)
+      evaluate_checkpoint(monitor, checkpoint);
+  }
+
+  return NULL;
+}
+
+// Holds out trainer->params.holdout_samples samples, at most CONVERGENCE_MAX_HOLDOUT_FRACTION of the dataset, and
+// starts evaluating the checkpoints of the trainer. The trainer samples from the rest of the dataset until the
+// monitor is stopped. The map of the trainer must be initialized.
+bool start_convergence_monitor(ConvergenceMonitor *monitor, Trainer *trainer)
+{
+  DatasetInfo *dataset = trainer->info;
+  int holdout_samples = min(trainer->params.holdout_samples, (int)(dataset->total_dataset_samples * CONVERGENCE_MAX_HOLDOUT_FRACTION));
+
+  memset(monitor, 0, sizeof(ConvergenceMonitor));
+  monitor->trainer = trainer;
+  monitor->dataset = dataset;
+  monitor->threshold = trainer->params.convergence_threshold;
+  if (!split_holdout_samples(monitor, dataset, holdout_samples, trainer->random_state))
+  {
+    free(monitor->holdout.samples);
+    free(monitor->training.samples);
+    return false;
+  }
+  if (!allocate_codebook_snapshots(&monitor->checkpoints, trainer->map))
+  {
+    printf("Could not allocate the checkpoints of the convergence monitor\n");
+    free(monitor->holdout.samples);
+    free(monitor->training.samples);
+    return false;
+  }
+  if (!allocate_tile_bounds(&monitor->bounds, trainer->map, BMU_TILE_SIZE, 1))
+  {
+    free_codebook_snapshots(&monitor->checkpoints);
+    free(monitor->holdout.samples);
+    free(monitor->training.samples);
+    return false;
+  }
+
+  pthread_mutex_init(&monitor->mutex, NULL);
+  pthread_cond_init(&monitor->published, NULL);
+  if (pthread_create(&monitor->thread, NULL, convergence_monitor_thread, monitor) != 0)
+  {
+    printf("Could not start the convergence monitor\n");
+    pthread_cond_destroy(&monitor->published);
+    pthread_mutex_destroy(&monitor->mutex);
+    free_tile_bounds(&monitor->bounds);
+    free_codebook_snapshots(&monitor->checkpoints);
+    free(monitor->holdout.samples);
+    free(monitor->training.samples);
+    return false;
+  }
+
+  trainer->info = &monitor->training;
+  trainer->monitor = monitor;
+  return true;
+}
+
+// Stops the thread, evaluates the final map and gives the whole dataset back to the trainer
+void stop_convergence_monitor(ConvergenceMonitor *monitor)
+{
+  Trainer *trainer = monitor->trainer;
+
+  pthread_mutex_lock(&monitor->mutex);
+  monitor->quit = true;
+  pthread_cond_signal(&monitor->published);
+  pthread_mutex_unlock(&monitor->mutex);
+  pthread_join(monitor->thread, NULL);
+  pthread_cond_destroy(&monitor->published);
+  pthread_mutex_destroy(&monitor->mutex);
+
+  monitor->quantization_error = evaluate_holdout(monitor, trainer->map);
+  monitor->topographic_error = topographic_error(trainer->map, &monitor->holdout);
+  monitor->evaluated_epoch = trainer->epoch;
+  monitor->evaluated_iteration = trainer->iteration;
+
+  trainer->info = monitor->dataset;
+  trainer->monitor = NULL;
+  free_tile_bounds(&monitor->bounds);
+  free_codebook_snapshots(&monitor->checkpoints);
+  free(monitor->holdout.samples);
+  free(monitor->training.samples);
+  monitor->holdout.samples = NULL;
+  monitor->training.samples = NULL;
+}
+
+// True once an epoch stopped improving on the previous one
+bool convergence_reached(ConvergenceMonitor *monitor)
+{
+  return (monitor != NULL) && __atomic_load_n(&monitor->converged, __ATOMIC_ACQUIRE);
+}
+
+// True if the current epoch of the trainer stopped improving
+bool epoch_settled(ConvergenceMonitor *monitor, Trainer *trainer)
+{
+  return (monitor != NULL) && (__atomic_load_n(&monitor->settled_epoch, __ATOMIC_ACQUIRE) == trainer->epoch);
+}
+
+// The epochs before the learning rule reaches its floor, or with a radius wider than the map, reorganize the map
+// and their error can stall for a while without the map being any close to trained
+static bool fine_tuning_epoch(Trainer *trainer)
+{
+  return (trainer->learning_rule <= (double)FINAL_LEARNING_RULE) && (trainer->radius < min(trainer->map->width, trainer->map->height));
+}
+
+// Called after every iteration of the fine-tuning epochs. Publishes a copy of the codebook
+// CONVERGENCE_CHECKS_PER_EPOCH times per epoch, the last one at the end of the epoch, and wakes the monitor up.
+void publish_convergence_checkpoint(ConvergenceMonitor *monitor, Trainer *trainer)
+{
+  if ((monitor == NULL) || !fine_tuning_epoch(trainer))
+    return;
+
+  int interval = max(1, trainer->iterations_per_epoch / CONVERGENCE_CHECKS_PER_EPOCH);
+  if ((trainer->iteration % interval != 0) && (trainer->iteration != trainer->iterations_per_epoch))
+    return;
+
+  publish_codebook_snapshot(&monitor->checkpoints, trainer, true);
+  pthread_mutex_lock(&monitor->mutex);
+  pthread_cond_signal(&monitor->published);
+  pthread_mutex_unlock(&monitor->mutex);
+}
+
+void print_convergence_summary(ConvergenceMonitor *monitor)
+{
+  printf("Convergence monitor: %d held-out samples | %ld checkpoints evaluated | %d epochs cut short | %s\n", monitor->holdout.total_dataset_samples,
+         monitor->evaluations, monitor->shortened_epochs, monitor->converged ? "converged" : "whole schedule trained");
+  printf("Held-out quantization error: %f | topographic error: %.2f%%\n", monitor->quantization_error, 100.0 * monitor->topographic_error);
+}
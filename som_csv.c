@@ -0,0 +1,909 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Dataset loader. The CSV file is memory-mapped and parsed in a single pass: the first row holds the
+             component names, and the rows after it are split in chunks that are parsed in parallel on large
+             files. Every chunk grows its own buffer and keeps the min and max value of every column, and the
+             buffers are joined in file order into the sample matrix, so no row count is needed in advance. The
+             components are then normalized between 0 and 1 like normalize-dataset.py does, the target (last)
+             column is kept as is.
+             The result is saved to a binary cache next to the CSV file (see som_dataset_cache.c), which later
+             runs load instead of parsing the CSV file again.
+
+Notes: Files already written by normalize-dataset.py are recognized by their second and third rows, the min and
+       max values of every column, followed by components that span exactly [0, 1] and targets inside the range
+       rows. They are loaded without normalizing them again.
+       Rows with a wrong number of fields or with invalid numbers are reported with their line number and
+       skipped. Numbers are parsed by parse_csv_number, which returns exactly the value of strtod.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "som.h"
+
+#define CSV_DELIMITER ';'
+#define CSV_MAX_NUMBER_LENGTH 64 // Longer numbers are reported as invalid
+#define CSV_CHUNKS_PER_THREAD 4
+#define CSV_WINDOW_ROWS 4096 // Rows parsed at a time when converting a file out of core
+
+typedef struct CSVError
+{
+  long line; // Line number inside the chunk, starting at 0
+  const char *reason;
+  int field; // Field where the error was found, starting at 0
+} CSVError;
+
+typedef struct CSVField
+{
+  const char *begin;
+  const char *end;
+} CSVField;
+
+typedef struct CSVChunk
+{
+  const char *begin;
+  const char *end;
+  int total_fields;
+  double *values; // Rows of total_fields values
+  double *lower; // Min and max value of every column
+  double *upper;
+  CSVField *fields; // Text of every column min, max and of the fields of the current row
+  long total_rows; // Rows in 'values'
+  long capacity_rows;
+  long flushed_rows; // Rows handed to the parser window before the ones in 'values'
+  long first_sample; // Sample index of the first row of the chunk in the converted file
+  double *column; // Values of a component of the window being written
+  bool write_failed;
+  long total_lines;
+  long total_malformed_rows;
+  int total_errors; // Errors kept, at most CSV_MAX_REPORTED_ERRORS
+  CSVError errors[CSV_MAX_REPORTED_ERRORS];
+  bool out_of_memory;
+} CSVChunk;
+
+typedef struct CSVParser
+{
+  CSVChunk *chunks; // The first chunk holds the second and third lines, the min and max rows of a normalized file
+  int total_chunks;
+  int first_chunk; // Chunk parsed by the first task
+  long window_rows; // The rows of a chunk are handed to 'flush' every window_rows rows. 0 keeps them all.
+  void (*flush)(struct CSVParser *parser, CSVChunk *chunk);
+  DatasetInfo *info;
+  bool normalized_layout;
+  DatasetCacheWriter *writer;
+} CSVParser;
+
+static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+                                       1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static bool is_blank(char c)
+{
+  return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+static double parse_with_strtod(const char *begin, const char *end, bool *valid)
+{
+  char buffer[CSV_MAX_NUMBER_LENGTH + 1];
+  char *parsed_end;
+
+  if (end - begin > CSV_MAX_NUMBER_LENGTH)
+  {
+    *valid = false;
+    return 0.0;
+  }
+
+  memcpy(buffer, begin, end - begin);
+  buffer[end - begin] = '\0';
+  double value = strtod(buffer, &parsed_end);
+  *valid = (parsed_end == buffer + (end - begin));
+  return value;
+}
+
+// Parses the number of [begin, end), which must hold nothing else. Decimal numbers with up to 19 significant digits
+// and a small exponent are computed with one exact mantissa and one rounding (two on x87 long doubles, checked to be
+// equivalent), everything else goes through strtod.
+bool parse_csv_number(const char *begin, const char *end, double *value)
+{
+  const char *p = begin;
+  bool negative = false, valid;
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0, total_digits = 0;
+
+  if ((p < end) && ((*p == '-') || (*p == '+')))
+    negative = (*p++ == '-');
+
+  for (; (p < end) && (*p >= '0') && (*p <= '9'); p++, total_digits++)
+    if ((mantissa != 0) || (*p != '0'))
+    {
+      if (digits++ < 19)
+        mantissa = mantissa * 10 + (*p - '0');
+      else
+        exponent++;
+    }
+
+  if ((p < end) && (*p == '.'))
+  {
+    for (p++; (p < end) && (*p >= '0') && (*p <= '9'); p++, total_digits++)
+    {
+      if ((mantissa == 0) && (*p == '0'))
+        exponent--; // Leading zero
+      else if (digits++ < 19)
+      {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+    }
+  }
+
+  if (total_digits == 0)
+    return false; // Only decimal numbers, no inf or nan
+
+  if ((p < end) && ((*p == 'e') || (*p == 'E')))
+  {
+    const char *exponent_start = p++;
+    bool negative_exponent = false;
+    int explicit_exponent = 0;
+
+    if ((p < end) && ((*p == '-') || (*p == '+')))
+      negative_exponent = (*p++ == '-');
+    if ((p == end) || (*p < '0') || (*p > '9'))
+      p = exponent_start; // Not an exponent, reported below as trailing characters
+    else
+      for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+        explicit_exponent = min(explicit_exponent * 10 + (*p - '0'), 100000);
+    exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+  }
+
+  if (p != end)
+    return false;
+
+  if (mantissa == 0)
+  {
+    *value = negative ? -0.0 : 0.0;
+    return true;
+  }
+
+  if ((digits <= 19) && (mantissa <= (1ULL << 53)) && (exponent >= -22) && (exponent <= 22))
+  {
+    // Both operands are exact doubles, so a single rounding gives the correctly rounded value
+    double result = exponent < 0 ? (double)mantissa / powers_of_ten[-exponent] : (double)mantissa * powers_of_ten[exponent];
+    *value = negative ? -result : result;
+    return true;
+  }
+
+#if LDBL_MANT_DIG >= 64
+  if ((digits <= 19) && (exponent >= -27) && (exponent <= 27))
+  {
+    // The mantissa and 10^27 are exact long doubles. Rounding the long double result to double again is only wrong
+    // when it lies exactly half way between two doubles.
+    long double power = 1.0L;
+    for (int e = 0; e < abs(exponent); e++)
+      power *= 10.0L;
+
+    long double exact = exponent < 0 ? (long double)mantissa / power : (long double)mantissa * power;
+    double result = (double)exact;
+    double neighbor = nextafter(result, exact > result ? DBL_MAX : -DBL_MAX);
+    if ((exact == result) || ((long double)result + (long double)neighbor != 2.0L * exact))
+    {
+      *value = negative ? -result : result;
+      return true;
+    }
+  }
+#endif
+
+  *value = parse_with_strtod(begin, end, &valid);
+  return valid;
+}
+
+static void add_csv_error(CSVChunk *chunk, const char *reason, int field)
+{
+  chunk->total_malformed_rows++;
+  if (chunk->total_errors < CSV_MAX_REPORTED_ERRORS)
+    chunk->errors[chunk->total_errors++] = (CSVError){.line = chunk->total_lines, .reason = reason, .field = field};
+}
+
+// Parses the fields of the line [begin, end) into 'values'. Returns false and reports the error on malformed lines.
+static bool parse_csv_row(CSVChunk *chunk, const char *begin, const char *end, double *values)
+{
+  const char *p = begin;
+
+  for (int f = 0; f < chunk->total_fields; f++)
+  {
+    const char *field_end = memchr(p, CSV_DELIMITER, end - p);
+    if (field_end == NULL)
+      field_end = end;
+    else if (f == chunk->total_fields - 1)
+    {
+      add_csv_error(chunk, "too many fields", f + 1);
+      return false;
+    }
+
+    if ((field_end == end) && (f < chunk->total_fields - 1))
+    {
+      add_csv_error(chunk, "missing fields", f + 1);
+      return false;
+    }
+
+    const char *field_begin = p;
+    const char *number_end = field_end;
+    while ((field_begin < number_end) && is_blank(*field_begin))
+      field_begin++;
+    while ((number_end > field_begin) && is_blank(number_end[-1]))
+      number_end--;
+    chunk->fields[2 * chunk->total_fields + f] = (CSVField){.begin = field_begin, .end = number_end};
+
+    if ((field_begin == number_end) || !parse_csv_number(field_begin, number_end, &values[f]) || !isfinite(values[f]))
+    {
+      add_csv_error(chunk, "invalid number", f);
+      return false;
+    }
+
+    p = field_end + 1;
+  }
+
+  return true;
+}
+
+static bool is_blank_line(const char *begin, const char *end)
+{
+  for (const char *p = begin; p < end; p++)
+    if (!is_blank(*p))
+      return false;
+  return true;
+}
+
+// Keeps the min and max value of every column, and the text they were parsed from
+static void update_csv_statistics(CSVChunk *chunk, const double *values)
+{
+  for (int f = 0; f < chunk->total_fields; f++)
+  {
+    if (values[f] < chunk->lower[f])
+    {
+      chunk->lower[f] = values[f];
+      chunk->fields[f] = chunk->fields[2 * chunk->total_fields + f];
+    }
+    if (values[f] > chunk->upper[f])
+    {
+      chunk->upper[f] = values[f];
+      chunk->fields[chunk->total_fields + f] = chunk->fields[2 * chunk->total_fields + f];
+    }
+  }
+}
+
+// Hands the rows parsed to the flush function of the parser, if any, and empties the buffer
+static void flush_csv_window(CSVParser *parser, CSVChunk *chunk)
+{
+  if (parser->flush != NULL)
+    parser->flush(parser, chunk);
+  chunk->flushed_rows += chunk->total_rows;
+  chunk->total_rows = 0;
+}
+
+static long csv_chunk_rows(CSVChunk *chunk)
+{
+  return chunk->flushed_rows + chunk->total_rows;
+}
+
+static void parse_csv_chunk(void *context, int task, int total_tasks)
+{
+  CSVParser *parser = (CSVParser *)context;
+  CSVChunk *chunk = &parser->chunks[parser->first_chunk + task];
+  const char *line = chunk->begin;
+
+  (void)total_tasks;
+
+  if (chunk->lower == NULL)
+    chunk->lower = (double *)malloc(sizeof(double) * 2 * chunk->total_fields);
+  if (chunk->fields == NULL)
+    chunk->fields = (CSVField *)malloc(sizeof(CSVField) * 3 * chunk->total_fields);
+  if ((chunk->lower == NULL) || (chunk->fields == NULL))
+  {
+    chunk->out_of_memory = true;
+    return;
+  }
+
+  chunk->upper = chunk->lower + chunk->total_fields;
+  for (int f = 0; f < chunk->total_fields; f++)
+  {
+    chunk->lower[f] = DBL_MAX;
+    chunk->upper[f] = -DBL_MAX;
+  }
+
+  while (line < chunk->end)
+  {
+    const char *line_end = memchr(line, '\n', chunk->end - line);
+    if (line_end == NULL)
+      line_end = chunk->end;
+
+    if (!is_blank_line(line, line_end))
+    {
+      if ((parser->window_rows > 0) && (chunk->total_rows == parser->window_rows))
+        flush_csv_window(parser, chunk);
+
+      if (chunk->total_rows == chunk->capacity_rows)
+      {
+        long capacity = (parser->window_rows > 0) ? parser->window_rows : max(1024, 2 * chunk->capacity_rows);
+        double *values = (double *)realloc(chunk->values, sizeof(double) * chunk->total_fields * capacity);
+        if (values == NULL)
+        {
+          chunk->out_of_memory = true;
+          return;
+        }
+        chunk->values = values;
+        chunk->capacity_rows = capacity;
+      }
+
+      double *values = &chunk->values[chunk->total_rows * chunk->total_fields];
+      if (parse_csv_row(chunk, line, line_end, values))
+      {
+        update_csv_statistics(chunk, values);
+        chunk->total_rows++;
+      }
+    }
+
+    chunk->total_lines++;
+    line = line_end + 1;
+  }
+
+  if (parser->flush != NULL)
+    flush_csv_window(parser, chunk);
+}
+
+// Returns the end of the line that starts at *line and moves *line to the next one
+static const char *next_csv_line(const char **line, const char *end)
+{
+  const char *line_end = memchr(*line, '\n', end - *line);
+
+  if (line_end == NULL)
+    line_end = end;
+  *line = (line_end == end) ? end : line_end + 1;
+  return line_end;
+}
+
+// Copies a header field without its blanks and quotes
+static char *copy_csv_field(Arena *arena, const char *begin, const char *end)
+{
+  while ((begin < end) && is_blank(*begin))
+    begin++;
+  while ((end > begin) && is_blank(end[-1]))
+    end--;
+  if ((end - begin >= 2) && (*begin == '"') && (end[-1] == '"'))
+  {
+    begin++;
+    end--;
+  }
+  return arena_strndup(arena, begin, end - begin);
+}
+
+// Splits the header line [begin, end) into 'total_fields' strings. Returns false if it has another number of fields.
+static bool split_csv_header_line(Arena *arena, const char *begin, const char *end, int total_fields, char **fields)
+{
+  const char *p = begin;
+
+  for (int f = 0; f < total_fields; f++)
+  {
+    const char *field_end = memchr(p, CSV_DELIMITER, end - p);
+    if ((field_end == NULL) != (f == total_fields - 1))
+      return false;
+    if (field_end == NULL)
+      field_end = end;
+
+    fields[f] = copy_csv_field(arena, p, field_end);
+    if (fields[f] == NULL)
+      return false;
+    p = field_end + 1;
+  }
+
+  return true;
+}
+
+// Parses the component names, in the first row
+static bool parse_csv_header(DatasetInfo *info, const char **cursor, const char *end, const char *filename)
+{
+  const char *names = *cursor;
+  const char *names_end = next_csv_line(cursor, end);
+  int total_components = 1;
+
+  for (const char *p = names; p < names_end; p++)
+    if (*p == CSV_DELIMITER)
+      total_components++;
+
+  info->components = (ComponentInfo *)arena_allocate(&info->arena, sizeof(ComponentInfo) * total_components);
+  if (info->components == NULL)
+    return false;
+  info->total_components = total_components;
+
+  char **fields = (char **)calloc(total_components, sizeof(char *));
+  if (fields == NULL)
+    return false;
+
+  bool valid = split_csv_header_line(&info->arena, names, names_end, total_components, fields);
+  for (int i = 0; i < total_components; i++)
+    info->components[i].name = fields[i];
+
+  if (!valid)
+    printf("%s:1: expected the names of the %d components\n", filename, total_components);
+
+  free(fields);
+  return valid;
+}
+
+// Parses the second and third rows of a file written by normalize-dataset.py: the min and max values of the components
+static bool parse_csv_ranges(DatasetInfo *info, const char *cursor, const char *end, const char *filename)
+{
+  char **fields = (char **)malloc(sizeof(char *) * info->total_components);
+  bool valid = (fields != NULL);
+
+  for (int row = 1; valid && (row < 3); row++)
+  {
+    const char *line = cursor;
+    const char *line_end = next_csv_line(&cursor, end);
+
+    memset(fields, 0, sizeof(char *) * info->total_components);
+    valid = split_csv_header_line(&info->arena, line, line_end, info->total_components, fields);
+    for (int i = 0; i < info->total_components; i++)
+    {
+      ComponentInfo *component = &info->components[i];
+      double *value = (row == 1) ? &component->min_value : &component->max_value;
+
+      if (row == 1)
+        component->min_value_str = fields[i];
+      else
+        component->max_value_str = fields[i];
+      valid = valid && parse_csv_number(fields[i], fields[i] + strlen(fields[i]), value);
+    }
+
+    if (!valid)
+      printf("%s:%d: expected the %s value of the %d components\n", filename, row + 1, row == 1 ? "min" : "max", info->total_components);
+  }
+
+  free(fields);
+  return valid;
+}
+
+static void report_csv_errors(CSVChunk *chunks, int total_chunks, long first_line, const char *filename)
+{
+  long total_malformed_rows = 0;
+  int total_reported = 0;
+
+  for (int c = 0; c < total_chunks; c++)
+  {
+    for (int e = 0; (e < chunks[c].total_errors) && (total_reported < CSV_MAX_REPORTED_ERRORS); e++, total_reported++)
+      printf("%s:%ld: %s (field %d), row skipped\n", filename, first_line + chunks[c].errors[e].line, chunks[c].errors[e].reason, chunks[c].errors[e].field + 1);
+
+    first_line += chunks[c].total_lines;
+    total_malformed_rows += chunks[c].total_malformed_rows;
+  }
+
+  if (total_malformed_rows > total_reported)
+    printf("%s: %ld more malformed rows skipped\n", filename, total_malformed_rows - total_reported);
+}
+
+// Splits the lines of [begin, end) in chunks: the second and third lines of the file first, and the rest in chunks
+// of similar size that start at the beginning of a line
+static CSVChunk *split_csv_chunks(DatasetInfo *info, const char *begin, const char *end, int total_data_chunks, int *total_chunks)
+{
+  CSVChunk *chunks = (CSVChunk *)calloc(total_data_chunks + 1, sizeof(CSVChunk));
+  const char *chunk_begin = begin;
+
+  if (chunks == NULL)
+    return NULL;
+
+  next_csv_line(&chunk_begin, end);
+  next_csv_line(&chunk_begin, end);
+  chunks[0].begin = begin;
+  chunks[0].end = chunk_begin;
+
+  const char *data_begin = chunk_begin;
+  for (int c = 1; c <= total_data_chunks; c++)
+  {
+    const char *chunk_end = (c == total_data_chunks) ? end : data_begin + ((end - data_begin) / total_data_chunks) * c;
+    if (chunk_end < chunk_begin)
+      chunk_end = chunk_begin;
+    else if (chunk_end < end)
+      next_csv_line(&chunk_end, end);
+
+    chunks[c].begin = chunk_begin;
+    chunks[c].end = chunk_end;
+    chunk_begin = chunk_end;
+  }
+
+  *total_chunks = total_data_chunks + 1;
+  for (int c = 0; c < *total_chunks; c++)
+    chunks[c].total_fields = info->total_components;
+  return chunks;
+}
+
+static void free_csv_chunks(CSVChunk *chunks, int total_chunks)
+{
+  for (int c = 0; c < total_chunks; c++)
+  {
+    free(chunks[c].values);
+    free(chunks[c].lower);
+    free(chunks[c].fields);
+    free(chunks[c].column);
+  }
+  free(chunks);
+}
+
+// Parses the chunks, in parallel on large files. Returns false if a chunk ran out of memory.
+static bool parse_csv_chunks(CSVParser *parser, const char *filename)
+{
+  ThreadPool pool;
+  size_t total_bytes = parser->chunks[parser->total_chunks - 1].end - parser->chunks[0].begin;
+  bool parallel = (total_bytes >= CSV_PARALLEL_MIN_BYTES) && create_thread_pool(&pool, get_total_cpu_cores());
+  bool out_of_memory = false;
+
+  run_parallel(parallel ? &pool : NULL, parse_csv_chunk, parser, parser->total_chunks - parser->first_chunk);
+  if (parallel)
+    destroy_thread_pool(&pool);
+
+  for (int c = 0; c < parser->total_chunks; c++)
+    out_of_memory = out_of_memory || parser->chunks[c].out_of_memory;
+  if (out_of_memory)
+    printf("Could not allocate the samples of %s\n", filename);
+  return !out_of_memory;
+}
+
+// Number of chunks the sample rows of a file of 'size' bytes are split in
+static int count_csv_data_chunks(size_t size)
+{
+  return (size >= CSV_PARALLEL_MIN_BYTES) ? get_total_cpu_cores() * CSV_CHUNKS_PER_THREAD : 1;
+}
+
+// True when the first chunk holds the min and max values of every column and the rows after them are the ones
+// normalize-dataset.py writes: every component spans exactly [0, 1] (the rows with the min and the max of the
+// column), or is 0 when the column is constant, and the target keeps its values, inside the range rows. A raw file
+// whose components already lie between 0 and 1 would otherwise lose its first two samples as ranges.
+static bool has_normalized_layout(CSVChunk *chunks, int total_chunks)
+{
+  CSVChunk *head = &chunks[0];
+  int total_fields = head->total_fields;
+  long total_rows = 0;
+
+  if ((head->total_malformed_rows > 0) || (head->total_rows != 2))
+    return false;
+
+  for (int f = 0; f < total_fields; f++)
+  {
+    double lower = DBL_MAX, upper = -DBL_MAX;
+    double min_value = head->values[f], max_value = head->values[total_fields + f];
+
+    if (min_value > max_value)
+      return false;
+    for (int c = 1; c < total_chunks; c++)
+      if (csv_chunk_rows(&chunks[c]) > 0)
+      {
+        lower = fmin(lower, chunks[c].lower[f]);
+        upper = fmax(upper, chunks[c].upper[f]);
+      }
+
+    if (f == total_fields - 1)
+    {
+      if ((lower < min_value) || (upper > max_value))
+        return false;
+    }
+    else if ((lower != 0.0) || (upper != ((min_value < max_value) ? 1.0 : 0.0)))
+      return false;
+  }
+
+  for (int c = 1; c < total_chunks; c++)
+    total_rows += csv_chunk_rows(&chunks[c]);
+
+  return total_rows > 0;
+}
+
+// Takes the ranges of the components from the second and third lines of a normalized file, or from the statistics
+// of the chunks. 'begin' is the second line of the file.
+static bool set_component_ranges(DatasetInfo *info, CSVParser *parser, const char *begin, const char *end, const char *filename)
+{
+  if (parser->normalized_layout)
+    return parse_csv_ranges(info, begin, end, filename);
+
+  for (int i = 0; i < info->total_components; i++)
+  {
+    ComponentInfo *component = &info->components[i];
+    CSVField lower_text = {0}, upper_text = {0};
+
+    component->min_value = DBL_MAX;
+    component->max_value = -DBL_MAX;
+    for (int c = 0; c < parser->total_chunks; c++)
+    {
+      CSVChunk *chunk = &parser->chunks[c];
+      if (csv_chunk_rows(chunk) == 0)
+        continue;
+      if (chunk->lower[i] < component->min_value)
+      {
+        component->min_value = chunk->lower[i];
+        lower_text = chunk->fields[i];
+      }
+      if (chunk->upper[i] > component->max_value)
+      {
+        component->max_value = chunk->upper[i];
+        upper_text = chunk->fields[info->total_components + i];
+      }
+    }
+
+    component->min_value_str = arena_strndup(&info->arena, lower_text.begin, lower_text.end - lower_text.begin);
+    component->max_value_str = arena_strndup(&info->arena, upper_text.begin, upper_text.end - upper_text.begin);
+    if ((component->min_value_str == NULL) || (component->max_value_str == NULL))
+    {
+      printf("Could not allocate the ranges of the components\n");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Min/max normalization of the components of a row, the same operations as normalize-dataset.py. Constant
+// components are 0.
+static void normalize_row(DatasetInfo *info, double *row)
+{
+  for (int i = 0; i < info->total_components - 1; i++)
+  {
+    ComponentInfo *component = &info->components[i];
+    row[i] = (component->max_value > component->min_value) ? (row[i] - component->min_value) / (component->max_value - component->min_value) : 0.0;
+  }
+}
+
+// Rows of the chunks that are samples. Returns -1 if there are none or too many.
+static long count_csv_samples(CSVParser *parser)
+{
+  long total_rows = 0;
+
+  for (int c = parser->normalized_layout ? 1 : 0; c < parser->total_chunks; c++)
+    total_rows += csv_chunk_rows(&parser->chunks[c]);
+
+  if ((total_rows == 0) || (total_rows > INT32_MAX))
+  {
+    printf("The dataset has %ld valid samples\n", total_rows);
+    return -1;
+  }
+  return total_rows;
+}
+
+// Joins the rows of the chunks in file order into the sample matrix and the targets of the dataset
+static bool join_csv_chunks(DatasetInfo *info, CSVParser *parser)
+{
+  long total_rows = count_csv_samples(parser);
+
+  if ((total_rows < 0) || !allocate_dataset_samples(info, (int)total_rows))
+    return false;
+
+  int total_weights = info->total_components - 1;
+  int sample = 0;
+  for (int c = parser->normalized_layout ? 1 : 0; c < parser->total_chunks; c++)
+    for (long r = 0; r < parser->chunks[c].total_rows; r++, sample++)
+    {
+      double *row = &parser->chunks[c].values[r * info->total_components];
+      if (!parser->normalized_layout)
+        normalize_row(info, row);
+      for (int i = 0; i < total_weights; i++)
+        info->samples[sample].components[i] = row[i];
+      info->targets[sample] = row[total_weights];
+    }
+
+  return true;
+}
+
+// Parses the rows after the names line, which starts at 'begin'. Tells if the samples had to be normalized.
+static bool parse_csv_samples(DatasetInfo *info, const char *begin, const char *end, const char *filename, bool *normalized)
+{
+  CSVParser parser = {.info = info};
+
+  parser.chunks = split_csv_chunks(info, begin, end, count_csv_data_chunks(end - begin), &parser.total_chunks);
+  if (parser.chunks == NULL)
+  {
+    printf("Could not allocate the samples of %s\n", filename);
+    return false;
+  }
+
+  bool parsed = parse_csv_chunks(&parser, filename);
+  if (parsed)
+  {
+    report_csv_errors(parser.chunks, parser.total_chunks, 2, filename);
+    parser.normalized_layout = has_normalized_layout(parser.chunks, parser.total_chunks);
+    parsed = set_component_ranges(info, &parser, begin, end, filename) && join_csv_chunks(info, &parser);
+    *normalized = !parser.normalized_layout;
+  }
+
+  free_csv_chunks(parser.chunks, parser.total_chunks);
+  return parsed;
+}
+
+// Maps a whole file for reading. Returns NULL if it cannot be mapped or is empty.
+static const char *map_csv_file(const char *filename, size_t *size)
+{
+  struct stat file_stat;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+  {
+    printf("Could not open file %s\n", filename);
+    return NULL;
+  }
+
+  if ((fstat(fd, &file_stat) != 0) || (file_stat.st_size == 0))
+  {
+    printf("%s is empty\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  const char *data = (const char *)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    printf("Could not map file %s\n", filename);
+    return NULL;
+  }
+
+  *size = file_stat.st_size;
+  return data;
+}
+
+// Loads a CSV file, raw or written by normalize-dataset.py, or a dataset cache. With 'use_cache' the dataset is
+// loaded from the cache of the CSV file when it is up to date, and the cache is written otherwise.
+bool load_dataset(DatasetInfo *info, const char *filename, bool use_cache)
+{
+  struct timespec start, now;
+  const char *source = NULL;
+  size_t size;
+  bool loaded, normalized = false;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(info, 0, sizeof(DatasetInfo));
+
+  const char *data = map_csv_file(filename, &size);
+  if (data == NULL)
+    return false;
+
+  char *cache_filename = use_cache ? dataset_cache_filename(filename) : NULL;
+  if (is_dataset_cache(data, size))
+  {
+    loaded = load_dataset_cache(info, filename, NULL);
+    source = "dataset cache";
+  }
+  else if ((cache_filename != NULL) && load_dataset_cache(info, cache_filename, filename))
+  {
+    loaded = true;
+    source = cache_filename;
+  }
+  else
+  {
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    const char *cursor = data;
+    const char *end = data + size;
+    loaded = parse_csv_header(info, &cursor, end, filename) && parse_csv_samples(info, cursor, end, filename, &normalized);
+    if (loaded && (cache_filename != NULL))
+      save_dataset_cache(info, cache_filename, filename);
+  }
+  munmap((void *)data, size);
+
+  if (!loaded)
+  {
+    free(cache_filename);
+    free_dataset(info);
+    return false;
+  }
+
+  printf("Total fields: %d\n", info->total_components);
+  for (int i = 0; i < info->total_components; i++)
+    printf(" field %d: %s\n", i, info->components[i].name);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  printf("\n\nTotal samples: %d (%.3fs", info->total_dataset_samples, (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+  if (source != NULL)
+    printf(", loaded from %s)\n\n", source);
+  else
+    printf(normalized ? ", normalized)\n\n" : ")\n\n");
+
+  free(cache_filename);
+  return true;
+}
+
+// Normalizes a window of rows of a chunk and writes it to the columns of the cache
+static void write_csv_window(CSVParser *parser, CSVChunk *chunk)
+{
+  DatasetInfo *info = parser->info;
+
+  if (chunk->write_failed || (chunk->total_rows == 0))
+    return;
+
+  if (chunk->column == NULL)
+    chunk->column = (double *)malloc(sizeof(double) * parser->window_rows);
+  if (chunk->column == NULL)
+  {
+    chunk->write_failed = true;
+    return;
+  }
+
+  for (long r = 0; (r < chunk->total_rows) && !parser->normalized_layout; r++)
+    normalize_row(info, &chunk->values[r * info->total_components]);
+
+  for (int i = 0; (i < info->total_components) && !chunk->write_failed; i++)
+  {
+    for (long r = 0; r < chunk->total_rows; r++)
+      chunk->column[r] = chunk->values[r * info->total_components + i];
+    chunk->write_failed = !write_dataset_cache_column(parser->writer, i, chunk->first_sample + chunk->flushed_rows, chunk->column, chunk->total_rows);
+  }
+}
+
+// Writes the cache of a CSV file without loading it: a first pass finds the ranges of the components and the number
+// of samples, and a second one normalizes the samples and writes them, a window of rows at a time. The memory used
+// does not depend on the size of the file.
+bool convert_csv_to_dataset_cache(const char *filename, const char *cache_filename)
+{
+  DatasetInfo info = {0};
+  DatasetCacheWriter writer;
+  size_t size;
+  bool converted = false;
+
+  const char *data = map_csv_file(filename, &size);
+  if (data == NULL)
+    return false;
+  madvise((void *)data, size, MADV_SEQUENTIAL);
+
+  const char *cursor = data;
+  const char *end = data + size;
+  CSVParser parser = {.info = &info, .window_rows = CSV_WINDOW_ROWS};
+
+  if (parse_csv_header(&info, &cursor, end, filename))
+    parser.chunks = split_csv_chunks(&info, cursor, end, count_csv_data_chunks(end - cursor), &parser.total_chunks);
+
+  if ((parser.chunks != NULL) && parse_csv_chunks(&parser, filename))
+  {
+    report_csv_errors(parser.chunks, parser.total_chunks, 2, filename);
+    parser.normalized_layout = has_normalized_layout(parser.chunks, parser.total_chunks);
+
+    long total_samples = count_csv_samples(&parser);
+    if ((total_samples > 0) && set_component_ranges(&info, &parser, cursor, end, filename) &&
+        begin_dataset_cache(&writer, &info, (int)total_samples, cache_filename, filename))
+    {
+      // Second pass, every chunk writes its rows after the ones of the previous chunks
+      long first_sample = 0;
+      parser.first_chunk = parser.normalized_layout ? 1 : 0;
+      for (int c = parser.first_chunk; c < parser.total_chunks; c++)
+      {
+        CSVChunk *chunk = &parser.chunks[c];
+        chunk->first_sample = first_sample;
+        first_sample += csv_chunk_rows(chunk);
+        chunk->total_rows = chunk->flushed_rows = chunk->total_lines = 0;
+        chunk->total_malformed_rows = chunk->total_errors = 0;
+      }
+
+      parser.flush = write_csv_window;
+      parser.writer = &writer;
+      converted = parse_csv_chunks(&parser, filename);
+      for (int c = parser.first_chunk; c < parser.total_chunks; c++)
+        converted = converted && !parser.chunks[c].write_failed;
+
+      if (!end_dataset_cache(&writer, converted) && converted)
+      {
+        printf("Could not write the dataset cache %s\n", cache_filename);
+        converted = false;
+      }
+    }
+  }
+
+  if (parser.chunks != NULL)
+    free_csv_chunks(parser.chunks, parser.total_chunks);
+  munmap((void *)data, size);
+  free_dataset(&info);
+  return converted;
+}
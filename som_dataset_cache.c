@@ -0,0 +1,425 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Binary dataset cache. Once a CSV file has been parsed and normalized, its samples are saved next to it
+             with the names and ranges of the components, so the following runs only copy them from the mapped
+             cache. The values are stored by columns, every column aligned to a cache line, with the target
+             column last.
+
+File format (version 1, native byte order, all offsets in bytes from the start of the file):
+  SOMDatasetFileHeader
+  SOMDatasetFileComponent[total_components]   min/max values and the offsets of its name, min and max strings
+  strings                                     NUL terminated, at strings_offset
+  columns                                     total_components columns of column_stride values, at a
+                                              CODEBOOK_ALIGNMENT multiple
+
+Notes: The cache keeps the size and modification time of its CSV file, and it is ignored (and written again)
+       when they do not match anymore. Caches are written column by column through a DatasetCacheWriter, so a
+       CSV file can also be converted a window of rows at a time (see convert_csv_to_dataset_cache), and they
+       can be read a chunk of samples at a time (see som_stream.c).
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "som.h"
+
+#define SOM_DATASET_FILE_MAGIC "SOMDATA\0"
+#define SOM_DATASET_FILE_VERSION 1
+#define SOM_DATASET_FILE_BYTE_ORDER 0x01020304
+
+typedef struct SOMDatasetFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // Files written on a machine with another byte order are rejected
+  int32_t total_components; // Includes the target column
+  int32_t total_samples;
+  uint64_t source_size; // Size and modification time of the CSV file
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t column_stride; // Values per column, a multiple of DATASET_COLUMN_PADDING
+  uint64_t components_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t columns_offset;
+  uint64_t columns_size;
+} SOMDatasetFileHeader;
+
+typedef struct SOMDatasetFileComponent
+{
+  double min_value;
+  double max_value;
+  uint64_t name_offset; // Offsets inside the strings block
+  uint64_t min_value_str_offset;
+  uint64_t max_value_str_offset;
+} SOMDatasetFileComponent;
+
+// Name of the cache of a CSV file. Free it with free().
+char *dataset_cache_filename(const char *filename)
+{
+  char *cache_filename = (char *)malloc(strlen(filename) + sizeof(DATASET_CACHE_SUFFIX));
+
+  if (cache_filename != NULL)
+  {
+    strcpy(cache_filename, filename);
+    strcat(cache_filename, DATASET_CACHE_SUFFIX);
+  }
+  return cache_filename;
+}
+
+bool is_dataset_cache(const char *data, size_t size)
+{
+  return (size >= sizeof(SOMDatasetFileHeader)) && (memcmp(data, SOM_DATASET_FILE_MAGIC, 8) == 0);
+}
+
+static void set_source_stat(SOMDatasetFileHeader *header, const struct stat *source_stat)
+{
+  header->source_size = source_stat->st_size;
+  header->source_mtime_sec = source_stat->st_mtim.tv_sec;
+  header->source_mtime_nsec = source_stat->st_mtim.tv_nsec;
+}
+
+static void close_dataset_cache_writer(DatasetCacheWriter *writer)
+{
+  if (writer->fd >= 0)
+    close(writer->fd);
+  free(writer->filename);
+  free(writer->temporary_filename);
+  writer->fd = -1;
+  writer->filename = writer->temporary_filename = NULL;
+}
+
+// Writes the metadata of the dataset to a temporary file, sized to hold 'total_samples' samples. The columns are
+// then written by write_dataset_cache_column, and end_dataset_cache replaces the cache with the temporary file, so
+// a cache is never left half written.
+bool begin_dataset_cache(DatasetCacheWriter *writer, DatasetInfo *info, int total_samples, const char *filename, const char *source_filename)
+{
+  SOMDatasetFileHeader header = {0};
+  struct stat source_stat;
+  size_t max_strings_size = 0;
+
+  writer->fd = -1;
+  writer->filename = strdup(filename);
+  writer->temporary_filename = (char *)malloc(strlen(filename) + sizeof(".tmp"));
+  if ((writer->filename == NULL) || (writer->temporary_filename == NULL))
+  {
+    printf("Could not allocate the dataset cache %s\n", filename);
+    close_dataset_cache_writer(writer);
+    return false;
+  }
+  strcpy(writer->temporary_filename, filename);
+  strcat(writer->temporary_filename, ".tmp");
+
+  if (stat(source_filename, &source_stat) != 0)
+  {
+    printf("Could not stat file %s\n", source_filename);
+    close_dataset_cache_writer(writer);
+    return false;
+  }
+
+  for (int i = 0; i < info->total_components; i++)
+    max_strings_size += strlen(info->components[i].name) + strlen(info->components[i].min_value_str) + strlen(info->components[i].max_value_str) + 3;
+
+  memcpy(header.magic, SOM_DATASET_FILE_MAGIC, sizeof(header.magic));
+  header.version = SOM_DATASET_FILE_VERSION;
+  header.byte_order = SOM_DATASET_FILE_BYTE_ORDER;
+  header.total_components = info->total_components;
+  header.total_samples = total_samples;
+  set_source_stat(&header, &source_stat);
+  header.column_stride = round_up(total_samples, DATASET_COLUMN_PADDING);
+
+  SOMDatasetFileComponent *components = (SOMDatasetFileComponent *)calloc(info->total_components, sizeof(SOMDatasetFileComponent));
+  char *strings = (char *)malloc(max(1, max_strings_size));
+  if ((components == NULL) || (strings == NULL))
+  {
+    printf("Could not allocate the dataset cache %s\n", filename);
+    free(components);
+    free(strings);
+    close_dataset_cache_writer(writer);
+    return false;
+  }
+
+  for (int i = 0; i < info->total_components; i++)
+  {
+    components[i].min_value = info->components[i].min_value;
+    components[i].max_value = info->components[i].max_value;
+    components[i].name_offset = append_file_string(strings, &header.strings_size, info->components[i].name);
+    components[i].min_value_str_offset = append_file_string(strings, &header.strings_size, info->components[i].min_value_str);
+    components[i].max_value_str_offset = append_file_string(strings, &header.strings_size, info->components[i].max_value_str);
+  }
+
+  header.components_offset = sizeof(SOMDatasetFileHeader);
+  header.strings_offset = header.components_offset + sizeof(SOMDatasetFileComponent) * info->total_components;
+  header.columns_offset = round_up(header.strings_offset + header.strings_size, CODEBOOK_ALIGNMENT);
+  header.columns_size = sizeof(double) * header.column_stride * info->total_components;
+
+  size_t components_size = sizeof(SOMDatasetFileComponent) * info->total_components;
+  writer->layout.total_samples = total_samples;
+  writer->layout.column_stride = header.column_stride;
+  writer->layout.columns_offset = header.columns_offset;
+  writer->fd = open(writer->temporary_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool written = (writer->fd >= 0) &&
+                 (ftruncate(writer->fd, header.columns_offset + header.columns_size) == 0) && // The padding reads as zeros
+                 (pwrite(writer->fd, &header, sizeof(header), 0) == sizeof(header)) &&
+                 (pwrite(writer->fd, components, components_size, header.components_offset) == (ssize_t)components_size) &&
+                 (pwrite(writer->fd, strings, header.strings_size, header.strings_offset) == (ssize_t)header.strings_size);
+
+  free(components);
+  free(strings);
+  if (!written)
+  {
+    printf("Could not write the dataset cache %s\n", filename);
+    end_dataset_cache(writer, false);
+  }
+  return written;
+}
+
+// Writes the values of the samples [first_sample, first_sample + total_values) of a component. Several threads can
+// write different samples at once.
+bool write_dataset_cache_column(DatasetCacheWriter *writer, int component, long first_sample, const double *values, long total_values)
+{
+  off_t offset = writer->layout.columns_offset + sizeof(double) * (component * writer->layout.column_stride + first_sample);
+  size_t size = sizeof(double) * total_values;
+
+  return pwrite(writer->fd, values, size, offset) == (ssize_t)size;
+}
+
+// Replaces the cache with the temporary file when 'complete', removes the temporary file otherwise
+bool end_dataset_cache(DatasetCacheWriter *writer, bool complete)
+{
+  complete = complete && (close(writer->fd) == 0);
+  writer->fd = -1;
+  complete = complete && (rename(writer->temporary_filename, writer->filename) == 0);
+  if (!complete)
+    unlink(writer->temporary_filename);
+
+  close_dataset_cache_writer(writer);
+  return complete;
+}
+
+bool save_dataset_cache(DatasetInfo *info, const char *filename, const char *source_filename)
+{
+  DatasetCacheWriter writer;
+  bool written;
+
+  if (!begin_dataset_cache(&writer, info, info->total_dataset_samples, filename, source_filename))
+    return false;
+
+  double *column = (double *)malloc(sizeof(double) * max(1, info->total_dataset_samples));
+  written = (column != NULL);
+  for (int i = 0; written && (i < info->total_components); i++)
+  {
+    for (int s = 0; s < info->total_dataset_samples; s++)
+      column[s] = (i < info->total_components - 1) ? info->samples[s].components[i] : info->targets[s];
+    written = write_dataset_cache_column(&writer, i, 0, column, info->total_dataset_samples);
+  }
+  free(column);
+
+  written = end_dataset_cache(&writer, written);
+  if (!written)
+    printf("Could not write the dataset cache %s\n", filename);
+  return written;
+}
+
+static bool valid_dataset_file_header(const SOMDatasetFileHeader *header, size_t file_size)
+{
+  if ((memcmp(header->magic, SOM_DATASET_FILE_MAGIC, sizeof(header->magic)) != 0) || (header->byte_order != SOM_DATASET_FILE_BYTE_ORDER))
+    return false;
+  if ((header->total_components <= 0) || (header->total_samples <= 0) || (header->column_stride < (uint64_t)header->total_samples))
+    return false;
+
+  return (header->components_offset + sizeof(SOMDatasetFileComponent) * header->total_components <= header->strings_offset) &&
+         (header->strings_offset + header->strings_size <= header->columns_offset) &&
+         (header->columns_offset % CODEBOOK_ALIGNMENT == 0) &&
+         (header->columns_size == sizeof(double) * header->column_stride * header->total_components) &&
+         (header->columns_offset + header->columns_size <= file_size);
+}
+
+static bool check_dataset_file_header(const SOMDatasetFileHeader *header, size_t file_size, const char *filename)
+{
+  if ((memcmp(header->magic, SOM_DATASET_FILE_MAGIC, sizeof(header->magic)) == 0) && (header->version != SOM_DATASET_FILE_VERSION))
+  {
+    printf("%s is a version %u dataset cache, only version %d is supported\n", filename, header->version, SOM_DATASET_FILE_VERSION);
+    return false;
+  }
+  if (!valid_dataset_file_header(header, file_size))
+  {
+    printf("%s is not a valid dataset cache\n", filename);
+    return false;
+  }
+  return true;
+}
+
+// True when the header was written from the current version of the source file
+static bool matches_source_file(const SOMDatasetFileHeader *header, const char *source_filename)
+{
+  SOMDatasetFileHeader source = {0};
+  struct stat source_stat;
+
+  if ((stat(source_filename, &source_stat) != 0) || (header->version != SOM_DATASET_FILE_VERSION))
+    return false;
+
+  set_source_stat(&source, &source_stat);
+  return (header->source_size == source.source_size) && (header->source_mtime_sec == source.source_mtime_sec) &&
+         (header->source_mtime_nsec == source.source_mtime_nsec);
+}
+
+bool dataset_cache_up_to_date(const char *filename, const char *source_filename)
+{
+  SOMDatasetFileHeader header;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    return false;
+
+  bool up_to_date = (pread(fd, &header, sizeof(header), 0) == sizeof(header)) &&
+                    (memcmp(header.magic, SOM_DATASET_FILE_MAGIC, sizeof(header.magic)) == 0) &&
+                    matches_source_file(&header, source_filename);
+  close(fd);
+  return up_to_date;
+}
+
+// Copies the components of the cache to 'info'. 'data' holds the file up to the columns.
+static bool parse_dataset_file_components(DatasetInfo *info, const SOMDatasetFileHeader *header, const char *data, const char *filename)
+{
+  const SOMDatasetFileComponent *components = (const SOMDatasetFileComponent *)(data + header->components_offset);
+  const char *strings = data + header->strings_offset;
+  bool valid = true;
+
+  info->total_components = header->total_components;
+  info->components = (ComponentInfo *)arena_allocate(&info->arena, sizeof(ComponentInfo) * header->total_components);
+  for (int i = 0; (i < header->total_components) && (info->components != NULL); i++)
+  {
+    info->components[i].min_value = components[i].min_value;
+    info->components[i].max_value = components[i].max_value;
+    info->components[i].name = copy_file_string(&info->arena, strings, header->strings_size, components[i].name_offset);
+    info->components[i].min_value_str = copy_file_string(&info->arena, strings, header->strings_size, components[i].min_value_str_offset);
+    info->components[i].max_value_str = copy_file_string(&info->arena, strings, header->strings_size, components[i].max_value_str_offset);
+    valid = valid && (info->components[i].name != NULL) && (info->components[i].min_value_str != NULL) && (info->components[i].max_value_str != NULL);
+  }
+
+  if ((info->components == NULL) || !valid)
+  {
+    printf("%s has invalid component names\n", filename);
+    return false;
+  }
+  return true;
+}
+
+// Reads the components of a cache and where its columns are, without reading any sample. 'info' holds no samples,
+// free it with free_dataset.
+bool read_dataset_cache_info(DatasetInfo *info, DatasetCacheLayout *layout, const char *filename)
+{
+  SOMDatasetFileHeader header;
+  struct stat file_stat;
+  int fd = open(filename, O_RDONLY);
+  char *data = NULL;
+
+  memset(info, 0, sizeof(DatasetInfo));
+  if (fd < 0)
+  {
+    printf("Could not open file %s\n", filename);
+    return false;
+  }
+
+  bool valid = (fstat(fd, &file_stat) == 0) && (pread(fd, &header, sizeof(header), 0) == sizeof(header));
+  if (!valid)
+    printf("%s is not a dataset cache\n", filename);
+  valid = valid && check_dataset_file_header(&header, file_stat.st_size, filename);
+
+  if (valid)
+  {
+    data = (char *)malloc(header.columns_offset);
+    valid = (data != NULL) && (pread(fd, data, header.columns_offset, 0) == (ssize_t)header.columns_offset) &&
+            parse_dataset_file_components(info, &header, data, filename);
+  }
+  close(fd);
+  free(data);
+
+  if (!valid)
+  {
+    free_dataset(info);
+    return false;
+  }
+
+  layout->total_samples = header.total_samples;
+  layout->column_stride = header.column_stride;
+  layout->columns_offset = header.columns_offset;
+  return true;
+}
+
+// Loads the dataset saved in a cache. With a 'source_filename', a missing cache or the cache of another version of
+// that file is silently ignored. Free the dataset with free_dataset.
+bool load_dataset_cache(DatasetInfo *info, const char *filename, const char *source_filename)
+{
+  struct stat file_stat;
+  int fd = open(filename, O_RDONLY);
+
+  memset(info, 0, sizeof(DatasetInfo));
+  if (fd < 0)
+  {
+    if (source_filename == NULL)
+      printf("Could not open file %s\n", filename);
+    return false;
+  }
+
+  if ((fstat(fd, &file_stat) != 0) || ((size_t)file_stat.st_size < sizeof(SOMDatasetFileHeader)))
+  {
+    printf("%s is not a dataset cache\n", filename);
+    close(fd);
+    return false;
+  }
+
+  char *data = (char *)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    printf("Could not map file %s\n", filename);
+    return false;
+  }
+
+  const SOMDatasetFileHeader *header = (const SOMDatasetFileHeader *)data;
+  if (((source_filename != NULL) && !matches_source_file(header, source_filename)) ||
+      !check_dataset_file_header(header, file_stat.st_size, filename))
+  {
+    munmap(data, file_stat.st_size);
+    return false;
+  }
+
+  madvise(data, file_stat.st_size, MADV_WILLNEED);
+
+  if (!parse_dataset_file_components(info, header, data, filename) || !allocate_dataset_samples(info, header->total_samples))
+  {
+    free_dataset(info);
+    munmap(data, file_stat.st_size);
+    return false;
+  }
+
+  // Back to rows, a block of samples at a time so the rows being written stay in cache
+  const double *columns = (const double *)(data + header->columns_offset);
+  int total_weights = header->total_components - 1;
+  for (int first = 0; first < header->total_samples; first += DATASET_COLUMN_PADDING * 64)
+  {
+    int last = min(first + DATASET_COLUMN_PADDING * 64, header->total_samples);
+    for (int i = 0; i < total_weights; i++)
+    {
+      const double *column = &columns[(size_t)i * header->column_stride];
+      for (int s = first; s < last; s++)
+        info->samples[s].components[i] = column[s];
+    }
+  }
+  memcpy(info->targets, &columns[(size_t)total_weights * header->column_stride], sizeof(double) * header->total_samples);
+  munmap(data, file_stat.st_size);
+
+  return true;
+}
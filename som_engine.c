@@ -0,0 +1,779 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Self-Organizing Map (SOM algorithm) training engine. Trains the map and runs the inference of the
+             dataset samples (loaded by som_csv.c) without any dependency on a display.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "som.h"
+
+// Returns zeroed memory that lives until free_arena. Allocations are aligned like malloc.
+void *arena_allocate(Arena *arena, size_t size)
+{
+  const size_t alignment = sizeof(long double);
+  ArenaBlock *block = arena->blocks;
+  size_t header_size = round_up(sizeof(ArenaBlock), alignment);
+
+  size = round_up(max(size, 1), alignment);
+  if ((block == NULL) || (block->used + size > block->size))
+  {
+    size_t block_size = max(ARENA_BLOCK_SIZE, header_size + size);
+    block = (ArenaBlock *)calloc(1, block_size);
+    if (block == NULL)
+      return NULL;
+    block->next = arena->blocks;
+    block->size = block_size;
+    block->used = header_size;
+    arena->blocks = block;
+  }
+
+  void *memory = (char *)block + block->used;
+  block->used += size;
+  return memory;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t length)
+{
+  char *copy = (char *)arena_allocate(arena, length + 1);
+
+  if (copy != NULL)
+    memcpy(copy, s, length); // Already NUL terminated
+  return copy;
+}
+
+void free_arena(Arena *arena)
+{
+  while (arena->blocks != NULL)
+  {
+    ArenaBlock *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+}
+
+// Allocates the matrix of the sample components, the targets and the samples pointing to their rows. The padding
+// of the rows is zeroed, so kernels can read whole rows.
+bool allocate_dataset_samples(DatasetInfo *info, int total_samples)
+{
+  size_t sample_stride = round_up(info->total_components - 1, DATASET_ROW_PADDING);
+  size_t matrix_size = sizeof(som_real) * sample_stride * max(total_samples, 1);
+
+  if (posix_memalign((void **)&info->values, CODEBOOK_ALIGNMENT, matrix_size) != 0)
+    info->values = NULL;
+  info->targets = (double *)malloc(sizeof(double) * max(total_samples, 1));
+  info->samples = (Sample *)malloc(sizeof(Sample) * max(total_samples, 1));
+  if ((info->values == NULL) || (info->targets == NULL) || (info->samples == NULL))
+  {
+    printf("Could not allocate the %d samples of the dataset\n", total_samples);
+    return false;
+  }
+
+  memset(info->values, 0, matrix_size);
+  info->sample_stride = sample_stride;
+  info->total_dataset_samples = total_samples;
+  for (int i = 0; i < total_samples; i++)
+  {
+    info->samples[i].components = &info->values[(size_t)i * sample_stride];
+    info->samples[i].bmu.x_coord = 0;
+    info->samples[i].bmu.y_coord = 0;
+  }
+
+  return true;
+}
+
+void free_dataset(DatasetInfo *info)
+{
+  free_arena(&info->arena);
+  free(info->samples);
+  free(info->values);
+  free(info->targets);
+
+  info->components = NULL;
+  info->samples = NULL;
+  info->values = NULL;
+  info->targets = NULL;
+  info->total_components = 0;
+  info->total_dataset_samples = 0;
+}
+
+// Draws from rand(), or from rand_r when there is a random state of its own (trainers running side by side)
+static int next_random(unsigned int *random_state)
+{
+  return (random_state != NULL) ? rand_r(random_state) : rand();
+}
+
+Sample *pick_random_sample(DatasetInfo *info, unsigned int *random_state)
+{
+  int i = next_random(random_state) % info->total_dataset_samples;
+  return &info->samples[i];
+}
+
+size_t round_up(size_t value, size_t multiple)
+{
+  return ((value + multiple - 1) / multiple) * multiple;
+}
+
+// Reserves the whole codebook as one cache-line aligned block. Weights are left uninitialized.
+// Strides of the codebook for the layout, the number of neurons and the number of weights of the map
+void set_codebook_strides(SOMMap *map)
+{
+  if (map->layout == CODEBOOK_AOS)
+  {
+    map->neuron_stride = round_up(map->total_weights, CODEBOOK_AOS_PADDING);
+    map->component_stride = 1;
+  }
+  else
+  {
+    map->neuron_stride = 1;
+    map->component_stride = round_up(map->total_neurons, CODEBOOK_SOA_PADDING);
+  }
+}
+
+bool allocate_som_map(SOMMap *map, int width, int height, int total_weights, CodebookLayout layout)
+{
+  size_t total_values;
+
+  map->layout = layout;
+  map->width = width;
+  map->height = height;
+  map->total_weights = total_weights;
+  map->total_neurons = width * height;
+  map->simd_level = detect_simd_level();
+  map->mapping = NULL;
+  map->mapping_size = 0;
+  set_codebook_strides(map);
+  total_values = codebook_size(map) / sizeof(som_real);
+
+  if (posix_memalign((void **)&map->weights, CODEBOOK_ALIGNMENT, total_values * sizeof(som_real)) != 0)
+  {
+    printf("Could not allocate the %dx%d map", width, height);
+    map->weights = NULL;
+    return false;
+  }
+
+  // Padding weights are never read as neurons, but keep them deterministic
+  memset(map->weights, 0, total_values * sizeof(som_real));
+  return true;
+}
+
+// Bytes of the weights block
+size_t codebook_size(SOMMap *map)
+{
+  size_t total_values = (map->layout == CODEBOOK_AOS) ? map->neuron_stride * map->total_neurons : map->component_stride * map->total_weights;
+  return total_values * sizeof(som_real);
+}
+
+bool initialize_som_map(SOMMap *map, int width, int height, int total_weights, CodebookLayout layout)
+{
+  if (!allocate_som_map(map, width, height, total_weights, layout))
+    return false;
+
+  randomize_som_weights(map, NULL);
+  return true;
+}
+
+// NULL draws the weights from rand()
+void randomize_som_weights(SOMMap *map, unsigned int *random_state)
+{
+  for (int n = 0; n < map->total_neurons; n++)
+    for (int i = 0; i < map->total_weights; i++)
+      *get_neuron_weight(map, n, i) = (double)next_random(random_state) / (double)RAND_MAX; // a random double value between 0 and 1
+}
+
+void free_som_map(SOMMap *map)
+{
+  if (map->mapping != NULL)
+    munmap(map->mapping, map->mapping_size);
+  else
+    free(map->weights);
+  map->weights = NULL;
+  map->mapping = NULL;
+}
+
+double squared_distance_to_neuron(SOMMap *map, const som_real *query, int neuron)
+{
+  double euclidean_distance = 0.0f;
+  som_real *weights = get_neuron_weight(map, neuron, 0);
+
+  for (int i = 0; i < map->total_weights; i++)
+    euclidean_distance += pow2(query[i] - weights[i * map->component_stride]);
+
+  return euclidean_distance;
+}
+
+double distance_between_sample_and_neuron(SOMMap *map, Sample *sample, int neuron)
+{
+  //return the Euclidean_distance;
+  return sqrt(squared_distance_to_neuron(map, sample->components, neuron));
+}
+
+void search_bmu(SOMMap *map, Sample *sample, BMU *bmu)
+{
+  // The argmin of the squared distances is the argmin of the distances, no square root is needed
+  BMUCandidate best = {.distance = DBL_MAX, .neuron = 0};
+  search_bmu_range(map, sample->components, 0, map->total_neurons, &best);
+
+  bmu->x_coord = best.neuron % map->width;
+  bmu->y_coord = best.neuron / map->width;
+}
+
+typedef struct ParallelBMUSearch
+{
+  SOMMap *map;
+  const som_real *query;
+  int neurons_per_task;
+  BMUCandidate *candidates;
+} ParallelBMUSearch;
+
+static void search_bmu_task(void *context, int task, int total_tasks)
+{
+  ParallelBMUSearch *search = (ParallelBMUSearch *)context;
+  int first = task * search->neurons_per_task;
+  int last = min(first + search->neurons_per_task, search->map->total_neurons);
+
+  (void)total_tasks;
+
+  search->candidates[task].distance = DBL_MAX;
+  search->candidates[task].neuron = first;
+  if (first < last)
+    search_bmu_range(search->map, search->query, first, last, &search->candidates[task]);
+}
+
+// Every thread searches a contiguous slice of the map. The slices are reduced in map order keeping the first
+// strictly closer candidate, so ties resolve to the lowest neuron index exactly like the serial search.
+void parallel_search_bmu(ThreadPool *pool, SOMMap *map, Sample *sample, BMU *bmu)
+{
+  int total_tasks = get_pool_threads(pool);
+
+  if ((total_tasks == 1) || (map->total_neurons < PARALLEL_SEARCH_MIN_NEURONS))
+  {
+    search_bmu(map, sample, bmu);
+    return;
+  }
+
+  BMUCandidate candidates[total_tasks];
+  ParallelBMUSearch search = {
+      .map = map,
+      .query = sample->components,
+      .neurons_per_task = (int)round_up((map->total_neurons + total_tasks - 1) / total_tasks, CODEBOOK_SOA_PADDING),
+      .candidates = candidates};
+
+  run_parallel(pool, search_bmu_task, &search, total_tasks);
+
+  BMUCandidate best = candidates[0];
+  for (int i = 1; i < total_tasks; i++)
+    if (candidates[i].distance < best.distance)
+      best = candidates[i];
+
+  bmu->x_coord = best.neuron % map->width;
+  bmu->y_coord = best.neuron / map->width;
+}
+
+double get_coordinate_distance(Coordinate *p1, Coordinate *p2)
+{
+  double x_sub = (p1->x) - (p2->x);
+  double y_sub = (p1->y) - (p2->y);
+  return sqrt(x_sub * x_sub + y_sub * y_sub);
+}
+
+typedef void (*ScaleNeuronsKernel)(SOMMap *map, int first_neuron, int total_neurons, Sample *sample, const double *scales);
+
+static inline __attribute__((always_inline)) void scale_neurons(SOMMap *map, int first_neuron, int total_neurons, Sample *sample, const double *scales, int total_weights)
+{
+  for (int i = 0; i < total_weights; i++)
+  {
+    double component = sample->components[i];
+    som_real *weights = get_neuron_weight(map, first_neuron, i);
+
+    for (int n = 0; n < total_neurons; n++)
+    {
+      som_real *weight = &weights[n * map->neuron_stride];
+      *weight = (component * scales[n]) + (*weight * (1.0f - scales[n]));
+    }
+  }
+}
+
+// Instances of scale_neurons with the number of weights fixed at compile time, like the BMU search kernels
+#define SPECIALIZED_SCALE_KERNEL(weights) \
+  static void scale_neurons_##weights(SOMMap *map, int first_neuron, int total_neurons, Sample *sample, const double *scales) \
+  { \
+    scale_neurons(map, first_neuron, total_neurons, sample, scales, weights); \
+  }
+#define SCALE_KERNEL_ENTRY(weights) [weights] = scale_neurons_##weights,
+SPECIALIZED_WEIGHTS(SPECIALIZED_SCALE_KERNEL)
+static const ScaleNeuronsKernel scale_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SCALE_KERNEL_ENTRY)};
+
+// Moves a run of consecutive neurons of the same row towards the sample, each one by its own scale
+void scale_neurons_run(SOMMap *map, int first_neuron, int total_neurons, Sample *sample, const double *scales)
+{
+  if (SOM_SPECIALIZED_KERNELS && (map->total_weights <= MAX_SPECIALIZED_WEIGHTS) && (scale_kernels[map->total_weights] != NULL))
+    scale_kernels[map->total_weights](map, first_neuron, total_neurons, sample, scales);
+  else
+    scale_neurons(map, first_neuron, total_neurons, sample, scales, map->total_weights);
+}
+
+void scale_neuron_at_position(SOMMap *map, int x, int y, Sample *sample, double scale)
+{
+  scale_neurons_run(map, y * map->width + x, 1, sample, &scale);
+}
+
+void free_neighborhood_kernel(NeighborhoodKernel *kernel)
+{
+  free(kernel->first_x);
+  free(kernel->scales);
+  kernel->first_x = kernel->last_x = kernel->row_start = NULL;
+  kernel->scales = NULL;
+  kernel->total_cells = 0;
+}
+
+// Tabulates the scale 'learning_rule * exp(-10 d^2 / r^2)' of every offset inside the radius. The radius and the
+// learning rule only change once per epoch, so the update of every iteration becomes a table lookup. Offsets whose
+// scale is below 'epsilon' are dropped: each one would move a weight by less than epsilon * |sample - weight|.
+// With epsilon 0 the table holds exactly the offsets and scales of the original per-cell computation.
+bool build_neighborhood_kernel(NeighborhoodKernel *kernel, double iteration_radius, double learning_rule, double epsilon)
+{
+  Coordinate center = {
+          .x = 0.0L,
+          .y = 0.0L
+  };
+
+  Coordinate outer;
+  double distance, scale;
+  int int_iteration_radius = (int)iteration_radius;
+  int total_rows = 2 * int_iteration_radius;
+
+  free_neighborhood_kernel(kernel);
+  kernel->radius = iteration_radius;
+  kernel->learning_rule = learning_rule;
+  kernel->epsilon = epsilon;
+  kernel->int_radius = int_iteration_radius;
+  kernel->first_y = 0;
+  kernel->last_y = 0;
+
+  // A single block holds the first_x, last_x and row_start arrays
+  kernel->first_x = (int *)malloc(sizeof(int) * (3 * total_rows + 1));
+  if (kernel->first_x == NULL)
+    return false;
+  kernel->last_x = kernel->first_x + total_rows;
+  kernel->row_start = kernel->last_x + total_rows;
+
+  // First pass: the span of included offsets of every row. The scale decreases with the distance, so the
+  // included offsets of a row are always contiguous.
+  kernel->row_start[0] = 0;
+  for (int y = -int_iteration_radius; y < int_iteration_radius; y++)
+  {
+    int row = y + int_iteration_radius;
+    kernel->first_x[row] = 0;
+    kernel->last_x[row] = 0;
+
+    for (int x = -int_iteration_radius; x < int_iteration_radius; x++)
+    {
+      outer.x = x;
+      outer.y = y;
+      distance = get_coordinate_distance(&outer, &center);
+      if (distance < iteration_radius)
+      {
+        scale = learning_rule * exp(-10.0f * (distance * distance) / (iteration_radius * iteration_radius));
+        if (scale >= epsilon)
+        {
+          if (kernel->first_x[row] == kernel->last_x[row])
+            kernel->first_x[row] = x;
+          kernel->last_x[row] = x + 1;
+        }
+      }
+    }
+
+    if (kernel->first_x[row] != kernel->last_x[row])
+    {
+      if (kernel->first_y == kernel->last_y)
+        kernel->first_y = y;
+      kernel->last_y = y + 1;
+    }
+
+    kernel->row_start[row + 1] = kernel->row_start[row] + (kernel->last_x[row] - kernel->first_x[row]);
+  }
+
+  kernel->total_cells = kernel->row_start[total_rows];
+  kernel->scales = (double *)malloc(sizeof(double) * max(1, kernel->total_cells));
+  if (kernel->scales == NULL)
+    return false;
+
+  // Second pass: the scales of the included offsets, row after row
+  for (int row = 0; row < total_rows; row++)
+    for (int x = kernel->first_x[row]; x < kernel->last_x[row]; x++)
+    {
+      outer.x = x;
+      outer.y = row - int_iteration_radius;
+      distance = get_coordinate_distance(&outer, &center);
+      scale = learning_rule * exp(-10.0f * (distance * distance) / (iteration_radius * iteration_radius));
+      kernel->scales[kernel->row_start[row] + (x - kernel->first_x[row])] = scale;
+    }
+
+  return true;
+}
+
+int wrap_coordinate(int coord, int size)
+{
+  coord %= size;
+  return coord < 0 ? coord + size : coord;
+}
+
+typedef struct NeighborhoodUpdate
+{
+  SOMMap *map;
+  NeighborhoodKernel *kernel;
+  BMU *bmu;
+  Sample *sample;
+  int first_row;
+  int total_rows;
+} NeighborhoodUpdate;
+
+// Applies every neighborhood offset that lands on this map row. On a toroidal map several 'y' offsets can wrap
+// onto the same row (and several 'x' offsets onto the same column), so they are applied in the same (y, x)
+// order as a plain sweep of the neighborhood, which keeps the result independent of how rows are split.
+static void scale_neighbors_row(NeighborhoodUpdate *update, int row)
+{
+  SOMMap *map = update->map;
+  NeighborhoodKernel *kernel = update->kernel;
+  int row_offset = wrap_coordinate(row - update->bmu->y_coord, map->height);
+
+  // First offset congruent with the row that is not above the kernel
+  int first_y = row_offset - ((row_offset - kernel->first_y) / map->height) * map->height;
+
+  for (int y = first_y; y < kernel->last_y; y += map->height)
+  {
+    int kernel_row = y + kernel->int_radius;
+    int first_x = kernel->first_x[kernel_row];
+    int last_x = kernel->last_x[kernel_row];
+    const double *scales = &kernel->scales[kernel->row_start[kernel_row]];
+
+    // Split the span in runs of consecutive columns that do not wrap around the map border
+    for (int x = first_x; x < last_x;)
+    {
+      int column = wrap_coordinate(x + update->bmu->x_coord, map->width);
+      int run = min(last_x - x, map->width - column);
+      scale_neurons_run(map, row * map->width + column, run, update->sample, &scales[x - first_x]);
+      x += run;
+    }
+  }
+}
+
+static void scale_neighbors_task(void *context, int task, int total_tasks)
+{
+  NeighborhoodUpdate *update = (NeighborhoodUpdate *)context;
+  int first = (int)(((long)update->total_rows * task) / total_tasks);
+  int last = (int)(((long)update->total_rows * (task + 1)) / total_tasks);
+
+  for (int i = first; i < last; i++)
+    scale_neighbors_row(update, wrap_coordinate(update->first_row + i, update->map->height));
+}
+
+// The rows touched by the neighborhood are split in bands, one per task. Bands never share a row, so the
+// threads update disjoint neurons and the result is bit-identical to the single-threaded update.
+void parallel_scale_neighbors(ThreadPool *pool, SOMMap *map, NeighborhoodKernel *kernel, BMU *bmu, Sample *sample)
+{
+  int kernel_rows = kernel->last_y - kernel->first_y;
+  NeighborhoodUpdate update = {
+      .map = map,
+      .kernel = kernel,
+      .bmu = bmu,
+      .sample = sample,
+      .first_row = (kernel_rows >= map->height) ? 0 : bmu->y_coord + kernel->first_y,
+      .total_rows = min(map->height, kernel_rows)};
+
+  int total_tasks = min(get_pool_threads(pool), update.total_rows);
+  if (kernel->total_cells < PARALLEL_UPDATE_MIN_NEURONS)
+    total_tasks = min(1, total_tasks);
+
+  run_parallel(pool, scale_neighbors_task, &update, total_tasks);
+}
+
+void scale_neighbors(SOMMap *map, NeighborhoodKernel *kernel, BMU *bmu, Sample *sample)
+{
+  parallel_scale_neighbors(NULL, map, kernel, bmu, sample);
+}
+
+void default_training_params(TrainingParams *params)
+{
+  params->total_epochs = TOTAL_EPOCHS;
+  params->initial_iterations_per_epoch = INITIAL_TRAINING_ITERATIONS_PER_EPOCH;
+  params->initial_radius = INITIAL_RADIUS;
+  params->mode = TRAINING_ONLINE;
+  params->initial_learning_rule = INITIAL_LEARNING_RULE;
+  params->neighborhood_epsilon = NEIGHBORHOOD_EPSILON;
+  params->warm_search = false;
+  params->convergence_threshold = CONVERGENCE_THRESHOLD;
+  params->holdout_samples = CONVERGENCE_HOLDOUT_SAMPLES;
+}
+
+void initialize_trainer(Trainer *trainer, SOMMap *map, DatasetInfo *info, const TrainingParams *params)
+{
+  trainer->map = map;
+  trainer->info = info;
+  trainer->pool = NULL;
+  trainer->stream = NULL;
+  trainer->params = *params;
+  trainer->epoch = 0;
+  trainer->iteration = 0;
+  trainer->iterations_per_epoch = params->initial_iterations_per_epoch;
+  trainer->radius = params->initial_radius;
+  trainer->learning_rule = params->initial_learning_rule;
+  memset(&trainer->kernel, 0, sizeof(NeighborhoodKernel));
+  memset(&trainer->batch, 0, sizeof(BatchState));
+  memset(&trainer->bounds, 0, sizeof(TileBounds));
+  memset(&trainer->search_stats, 0, sizeof(BMUSearchStats));
+  trainer->telemetry = NULL;
+  trainer->monitor = NULL;
+  trainer->random_state = NULL;
+}
+
+void free_trainer(Trainer *trainer)
+{
+  free_neighborhood_kernel(&trainer->kernel);
+  free_batch_state(&trainer->batch);
+  free_tile_bounds(&trainer->bounds);
+}
+
+// Moves the training schedule to the next epoch. Returns false once all the epochs have been trained, or the
+// convergence monitor found that the map stopped improving.
+bool begin_next_epoch(Trainer *trainer)
+{
+  TrainingParams *params = &trainer->params;
+  int epoch = trainer->epoch;
+
+  if ((epoch >= params->total_epochs) || convergence_reached(trainer->monitor))
+    return false;
+
+  trainer->radius = max(1.0L, (epoch == 0) ? params->initial_radius : (trainer->radius - (trainer->radius / 3.0L)));
+  trainer->learning_rule = max(FINAL_LEARNING_RULE, params->initial_learning_rule * exp(-10.0L * (epoch * epoch) / (params->total_epochs * params->total_epochs)));
+  trainer->iterations_per_epoch = (epoch == 0) ? params->initial_iterations_per_epoch : (trainer->iterations_per_epoch * 2);
+  trainer->epoch++;
+  trainer->iteration = 0;
+  begin_telemetry_epoch(trainer->telemetry, trainer->epoch, trainer->radius, trainer->learning_rule);
+
+  if (params->warm_search)
+  {
+    // Tighten the boxes widened by the online updates of the previous epoch
+    if ((trainer->bounds.lower == NULL) && !allocate_tile_bounds(&trainer->bounds, trainer->map, BMU_TILE_SIZE, get_pool_threads(trainer->pool)))
+      return false;
+    refresh_tile_bounds(&trainer->bounds, trainer->map);
+  }
+
+  if (params->mode == TRAINING_BATCH)
+  {
+    // An iteration of the batch training is a whole pass over the dataset
+    trainer->iterations_per_epoch = BATCH_PASSES_PER_EPOCH;
+    return build_batch_profile(&trainer->batch, trainer->radius, params->neighborhood_epsilon);
+  }
+
+  return build_neighborhood_kernel(&trainer->kernel, trainer->radius, trainer->learning_rule, params->neighborhood_epsilon);
+}
+
+// Trains the map with one random sample, or the next one of the stream. Returns false when the current epoch has no
+// iterations left, or the convergence monitor found that it stopped improving.
+bool train_next_iteration(Trainer *trainer)
+{
+  BMU bmu;
+  Sample *sample;
+
+  if (trainer->iteration >= trainer->iterations_per_epoch)
+    return false;
+  if (epoch_settled(trainer->monitor, trainer))
+  {
+    trainer->monitor->shortened_epochs++;
+    return false;
+  }
+
+  begin_telemetry_iteration(trainer->telemetry, trainer->iteration + 1);
+  if (trainer->params.mode == TRAINING_BATCH)
+  {
+    trainer->iteration++;
+    if (!train_batch_pass(trainer))
+      return false;
+    publish_convergence_checkpoint(trainer->monitor, trainer);
+    return true;
+  }
+
+  sample = (trainer->stream != NULL) ? next_stream_sample(trainer->stream) : pick_random_sample(trainer->info, trainer->random_state);
+  if (sample == NULL)
+    return false;
+
+  begin_telemetry_phase(trainer->telemetry);
+  if (trainer->params.warm_search)
+  {
+    warm_search_bmu(&trainer->bounds, 0, trainer->map, sample, &trainer->search_stats);
+    bmu = sample->bmu;
+  }
+  else
+    parallel_search_bmu(trainer->pool, trainer->map, sample, &bmu); // search for the Best Match Unit
+  end_telemetry_phase(trainer->telemetry, PHASE_BMU_SEARCH);
+
+  begin_telemetry_phase(trainer->telemetry);
+  parallel_scale_neighbors(trainer->pool, trainer->map, &trainer->kernel, &bmu, sample);
+  if (trainer->params.warm_search)
+    extend_tile_bounds(&trainer->bounds, trainer->map, &trainer->kernel, &bmu, sample);
+  end_telemetry_phase(trainer->telemetry, PHASE_NEIGHBORHOOD_UPDATE);
+  add_telemetry_neurons(trainer->telemetry, trainer->kernel.total_cells);
+  trainer->iteration++;
+  publish_convergence_checkpoint(trainer->monitor, trainer);
+  return true;
+}
+
+void train_som(Trainer *trainer)
+{
+  while (begin_next_epoch(trainer))
+    while (train_next_iteration(trainer))
+      ;
+}
+
+typedef struct ParallelInference
+{
+  SOMMap *map;
+  DatasetInfo *info;
+  TileBounds *bounds;         // Only used by the warm-started search
+  BMUSearchStats *task_stats; // Statistics of every task of the warm-started search
+  int next_sample;            // First sample not claimed yet by the warm-started search
+} ParallelInference;
+
+static void infer_samples_task(void *context, int task, int total_tasks)
+{
+  ParallelInference *inference = (ParallelInference *)context;
+  int first = task * INFERENCE_SAMPLES_PER_TASK;
+  int last = min(first + INFERENCE_SAMPLES_PER_TASK, inference->info->total_dataset_samples);
+
+  (void)total_tasks;
+
+  for (int i = first; i < last; i++)
+    search_bmu(inference->map, &inference->info->samples[i], &inference->info->samples[i].bmu);
+}
+
+// Every task is a searcher with a candidates buffer of its own, and claims INFERENCE_SAMPLES_PER_TASK samples at
+// a time until none is left
+static void warm_infer_samples_task(void *context, int task, int total_tasks)
+{
+  ParallelInference *inference = (ParallelInference *)context;
+  int total_samples = inference->info->total_dataset_samples;
+  int first;
+
+  (void)total_tasks;
+
+  while ((first = __atomic_fetch_add(&inference->next_sample, INFERENCE_SAMPLES_PER_TASK, __ATOMIC_RELAXED)) < total_samples)
+    for (int i = first; i < min(first + INFERENCE_SAMPLES_PER_TASK, total_samples); i++)
+      warm_search_bmu(inference->bounds, task, inference->map, &inference->info->samples[i], &inference->task_stats[task]);
+}
+
+// Calculate inference for each sample of the dataset. Samples are independent, so the pool splits the samples
+// instead of the map.
+void infer_samples(SOMMap *map, DatasetInfo *info, ThreadPool *pool)
+{
+  ParallelInference inference = {.map = map, .info = info, .bounds = NULL, .task_stats = NULL, .next_sample = 0};
+  int total_tasks = (info->total_dataset_samples + INFERENCE_SAMPLES_PER_TASK - 1) / INFERENCE_SAMPLES_PER_TASK;
+
+  run_parallel(pool, infer_samples_task, &inference, total_tasks);
+}
+
+// Same as infer_samples, starting every search from the BMU cached in the sample. 'bounds' must be up to date.
+void warm_infer_samples(SOMMap *map, TileBounds *bounds, DatasetInfo *info, ThreadPool *pool, BMUSearchStats *stats)
+{
+  int total_tasks = min(get_pool_threads(pool), bounds->total_searchers);
+  BMUSearchStats *task_stats = (BMUSearchStats *)calloc(total_tasks, sizeof(BMUSearchStats));
+  ParallelInference inference = {.map = map, .info = info, .bounds = bounds, .task_stats = task_stats, .next_sample = 0};
+
+  if (task_stats == NULL)
+  {
+    infer_samples(map, info, pool);
+    return;
+  }
+
+  run_parallel(pool, warm_infer_samples_task, &inference, total_tasks);
+
+  for (int t = 0; t < total_tasks; t++)
+    add_bmu_search_stats(stats, &task_stats[t]);
+  free(task_stats);
+}
+
+// Mean distance between every sample and its BMU. Requires the inference of the samples.
+double quantization_error(SOMMap *map, DatasetInfo *info)
+{
+  double total_error = 0.0;
+
+  for (int i = 0; i < info->total_dataset_samples; i++)
+  {
+    Sample *sample = &info->samples[i];
+    total_error += distance_between_sample_and_neuron(map, sample, sample->bmu.y_coord * map->width + sample->bmu.x_coord);
+  }
+
+  return info->total_dataset_samples > 0 ? total_error / info->total_dataset_samples : 0.0;
+}
+
+// True if the neurons are the same or neighbors (diagonals included) on the toroidal map
+bool adjacent_neurons(SOMMap *map, int first, int second)
+{
+  int dx = abs(first % map->width - second % map->width);
+  int dy = abs(first / map->width - second / map->width);
+
+  return (min(dx, map->width - dx) <= 1) && (min(dy, map->height - dy) <= 1);
+}
+
+// Fraction of the samples whose two closest neurons are not neighbors. Like quantization_error, it needs the BMUs
+// of the samples to be the ones of the map.
+double topographic_error(SOMMap *map, DatasetInfo *info)
+{
+  int total_errors = 0;
+
+  if (map->total_neurons < 2)
+    return 0.0;
+
+  for (int i = 0; i < info->total_dataset_samples; i++)
+  {
+    Sample *sample = &info->samples[i];
+    int bmu = sample->bmu.y_coord * map->width + sample->bmu.x_coord;
+    BMUCandidate second = {.distance = DBL_MAX, .neuron = 0};
+
+    search_bmu_range(map, sample->components, 0, bmu, &second);
+    search_bmu_range(map, sample->components, bmu + 1, map->total_neurons, &second);
+    total_errors += !adjacent_neurons(map, bmu, second.neuron);
+  }
+
+  return info->total_dataset_samples > 0 ? (double)total_errors / info->total_dataset_samples : 0.0;
+}
+
+void write_inference_header(FILE *fp, DatasetInfo *info)
+{
+  fprintf(fp, "sample;bmu_x;bmu_y;%s\n", info->components[info->total_components - 1].name);
+}
+
+// Writes the BMU of every sample, numbered from 'first_sample'
+void write_inference_rows(FILE *fp, DatasetInfo *info, long first_sample)
+{
+  for (int i = 0; i < info->total_dataset_samples; i++)
+    fprintf(fp, "%ld;%d;%d;%g\n", first_sample + i, info->samples[i].bmu.x_coord, info->samples[i].bmu.y_coord, info->targets[i]);
+}
+
+bool write_inference_results(DatasetInfo *info, const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+
+  if (fp == NULL)
+  {
+    printf("Could not open file %s", filename);
+    return false;
+  }
+
+  write_inference_header(fp, info);
+  write_inference_rows(fp, info, 0);
+
+  fclose(fp);
+  return true;
+}
@@ -0,0 +1,231 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Exact nearest neighbour index over a trained codebook. Once the training has finished the weights do
+             not change anymore, so a k-d tree built over the neurons answers each BMU query visiting a few leaves
+             instead of the whole map. The tree only depends on the SOMMap, so it can also score new samples
+             against a map that was trained elsewhere.
+
+Notes: Every node keeps the bounding box of its neurons. The distance from a query to a box is computed exactly in
+       double and shrunk by DISTANCE_ROUNDING_SLACK, the most the distances to the neurons can round below the
+       exact ones when they are accumulated in som_real (float in the SOM_FLOAT32 build). So it never exceeds the
+       distance to any neuron of the node, and a node is only discarded when it is strictly farther than the best
+       neuron. Ties are resolved to the lowest neuron index, so the BMUs are exactly the ones of search_bmu.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <stdbool.h>
+#include <string.h>
+#include "som.h"
+
+typedef struct KDTreeBuilder
+{
+  KDTree *tree;
+  SOMMap *map;
+  int *neurons;
+  int split_component;
+} KDTreeBuilder;
+
+void free_kdtree(KDTree *tree)
+{
+  free(tree->nodes);
+  free(tree->lower);
+  free(tree->points);
+  free(tree->neurons);
+  tree->nodes = NULL;
+  tree->lower = tree->upper = NULL;
+  tree->points = NULL;
+  tree->neurons = NULL;
+  tree->total_nodes = 0;
+}
+
+static int compare_neurons_by_component(const void *a, const void *b, void *context)
+{
+  KDTreeBuilder *builder = (KDTreeBuilder *)context;
+  int n1 = *(const int *)a, n2 = *(const int *)b;
+  double w1 = *get_neuron_weight(builder->map, n1, builder->split_component);
+  double w2 = *get_neuron_weight(builder->map, n2, builder->split_component);
+
+  if (w1 != w2)
+    return w1 < w2 ? -1 : 1;
+  return n1 - n2;
+}
+
+// Builds the node of the neurons [first, last) and its children. Returns the node index.
+static int build_kdtree_node(KDTreeBuilder *builder, int first, int last)
+{
+  KDTree *tree = builder->tree;
+  SOMMap *map = builder->map;
+  int node = tree->total_nodes++;
+  double *lower = &tree->lower[(size_t)node * tree->total_weights];
+  double *upper = &tree->upper[(size_t)node * tree->total_weights];
+  int split_component = 0;
+
+  tree->nodes[node].first = first;
+  tree->nodes[node].last = last;
+  tree->nodes[node].left = tree->nodes[node].right = -1;
+
+  for (int i = 0; i < tree->total_weights; i++)
+  {
+    lower[i] = DBL_MAX;
+    upper[i] = -DBL_MAX;
+    for (int p = first; p < last; p++)
+    {
+      double weight = *get_neuron_weight(map, builder->neurons[p], i);
+      lower[i] = weight < lower[i] ? weight : lower[i];
+      upper[i] = weight > upper[i] ? weight : upper[i];
+    }
+    if (upper[i] - lower[i] > upper[split_component] - lower[split_component])
+      split_component = i;
+  }
+
+  if (last - first <= KDTREE_LEAF_SIZE)
+    return node;
+
+  // Median split along the widest component
+  int middle = first + (last - first) / 2;
+  builder->split_component = split_component;
+  qsort_r(&builder->neurons[first], last - first, sizeof(int), compare_neurons_by_component, builder);
+
+  int left = build_kdtree_node(builder, first, middle);
+  int right = build_kdtree_node(builder, middle, last);
+  tree->nodes[node].left = left;
+  tree->nodes[node].right = right;
+  return node;
+}
+
+bool build_kdtree(KDTree *tree, SOMMap *map)
+{
+  // Leaves hold between KDTREE_LEAF_SIZE / 2 and KDTREE_LEAF_SIZE neurons
+  int max_nodes = 4 * (map->total_neurons / KDTREE_LEAF_SIZE + 1);
+  KDTreeBuilder builder = {.tree = tree, .map = map};
+
+  tree->total_weights = map->total_weights;
+  tree->width = map->width;
+  tree->total_points = map->total_neurons;
+  tree->total_nodes = 0;
+  tree->nodes = (KDTreeNode *)malloc(sizeof(KDTreeNode) * max_nodes);
+  tree->lower = (double *)malloc(sizeof(double) * 2 * max_nodes * map->total_weights);
+  tree->points = (som_real *)malloc(sizeof(som_real) * map->total_neurons * map->total_weights);
+  tree->neurons = (int *)malloc(sizeof(int) * map->total_neurons);
+  if ((tree->nodes == NULL) || (tree->lower == NULL) || (tree->points == NULL) || (tree->neurons == NULL))
+  {
+    printf("Could not allocate the k-d tree of the map\n");
+    free_kdtree(tree);
+    return false;
+  }
+  tree->upper = tree->lower + (size_t)max_nodes * map->total_weights;
+
+  builder.neurons = tree->neurons;
+  for (int n = 0; n < map->total_neurons; n++)
+    tree->neurons[n] = n;
+  build_kdtree_node(&builder, 0, map->total_neurons);
+
+  // The weights are copied in leaf order, so every leaf is scanned from a single contiguous block
+  for (int p = 0; p < map->total_neurons; p++)
+    for (int i = 0; i < map->total_weights; i++)
+      tree->points[(size_t)p * map->total_weights + i] = *get_neuron_weight(map, tree->neurons[p], i);
+
+  return true;
+}
+
+static double node_lower_bound(KDTree *tree, int node, const som_real *query)
+{
+  const double *lower = &tree->lower[(size_t)node * tree->total_weights];
+  const double *upper = &tree->upper[(size_t)node * tree->total_weights];
+  double distance = 0.0;
+
+  for (int i = 0; i < tree->total_weights; i++)
+  {
+    if (query[i] < lower[i])
+      distance += pow2(query[i] - lower[i]);
+    else if (query[i] > upper[i])
+      distance += pow2(query[i] - upper[i]);
+  }
+
+  return distance * (1.0 - DISTANCE_ROUNDING_SLACK(tree->total_weights));
+}
+
+static void search_kdtree_node(KDTree *tree, int node, const som_real *query, double lower_bound, BMUCandidate *best)
+{
+  KDTreeNode *current = &tree->nodes[node];
+
+  if (lower_bound > best->distance)
+    return;
+
+  if (current->left < 0)
+  {
+    for (int p = current->first; p < current->last; p++)
+    {
+      const som_real *weights = &tree->points[(size_t)p * tree->total_weights];
+      som_real distance = 0.0;
+
+      for (int i = 0; i < tree->total_weights; i++)
+        distance += pow2(query[i] - weights[i]);
+
+      if ((distance < best->distance) || ((distance == best->distance) && (tree->neurons[p] < best->neuron)))
+      {
+        best->distance = distance;
+        best->neuron = tree->neurons[p];
+      }
+    }
+    return;
+  }
+
+  // The closest child first, so the best distance shrinks as soon as possible
+  double left_bound = node_lower_bound(tree, current->left, query);
+  double right_bound = node_lower_bound(tree, current->right, query);
+  if (left_bound <= right_bound)
+  {
+    search_kdtree_node(tree, current->left, query, left_bound, best);
+    search_kdtree_node(tree, current->right, query, right_bound, best);
+  }
+  else
+  {
+    search_kdtree_node(tree, current->right, query, right_bound, best);
+    search_kdtree_node(tree, current->left, query, left_bound, best);
+  }
+}
+
+// Same result as search_bmu
+void kdtree_search_bmu(KDTree *tree, const som_real *query, BMU *bmu)
+{
+  BMUCandidate best = {.distance = DBL_MAX, .neuron = tree->total_points};
+
+  search_kdtree_node(tree, 0, query, node_lower_bound(tree, 0, query), &best);
+
+  bmu->x_coord = best.neuron % tree->width;
+  bmu->y_coord = best.neuron / tree->width;
+}
+
+typedef struct KDTreeInference
+{
+  KDTree *tree;
+  DatasetInfo *info;
+} KDTreeInference;
+
+static void kdtree_infer_samples_task(void *context, int task, int total_tasks)
+{
+  KDTreeInference *inference = (KDTreeInference *)context;
+  int first = task * INFERENCE_SAMPLES_PER_TASK;
+  int last = min(first + INFERENCE_SAMPLES_PER_TASK, inference->info->total_dataset_samples);
+
+  (void)total_tasks;
+
+  for (int i = first; i < last; i++)
+    kdtree_search_bmu(inference->tree, inference->info->samples[i].components, &inference->info->samples[i].bmu);
+}
+
+// Same as infer_samples, querying the tree of the map instead of scanning all of its neurons
+void kdtree_infer_samples(KDTree *tree, DatasetInfo *info, ThreadPool *pool)
+{
+  KDTreeInference inference = {.tree = tree, .info = info};
+  int total_tasks = (info->total_dataset_samples + INFERENCE_SAMPLES_PER_TASK - 1) / INFERENCE_SAMPLES_PER_TASK;
+
+  run_parallel(pool, kdtree_infer_samples_task, &inference, total_tasks);
+}
@@ -0,0 +1,329 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Binary map files. A trained map is saved with the dimensions, the component names and ranges of its
+             dataset and the codebook block exactly as it is laid out in memory. Loading a map maps the file and
+             points the codebook to the mapped weights, so it takes the same time whatever the size of the map.
+             A map saved by a build of the other precision (SOM_FLOAT32) is converted to this one when loaded.
+
+File format (version 1, native byte order, all offsets in bytes from the start of the file):
+  SOMMapFileHeader
+  SOMMapFileComponent[total_components]   min/max values and the offsets of its name, min and max strings
+  strings                                 NUL terminated, at strings_offset
+  weights                                 the codebook block, at a CODEBOOK_ALIGNMENT multiple, of weight_size
+                                          bytes per weight (0 in files written before weight_size means 8)
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "som.h"
+
+#define SOM_MAP_FILE_MAGIC "SOMMAP\0"
+#define SOM_MAP_FILE_VERSION 1
+#define SOM_MAP_FILE_BYTE_ORDER 0x01020304
+
+typedef struct SOMMapFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // Files written on a machine with another byte order are rejected
+  int32_t width;
+  int32_t height;
+  int32_t total_weights;
+  int32_t layout;
+  int32_t total_components; // Includes the target column
+  int32_t weight_size; // sizeof(som_real) of the build that saved the map
+  uint64_t neuron_stride;
+  uint64_t component_stride;
+  uint64_t components_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t weights_offset;
+  uint64_t weights_size;
+} SOMMapFileHeader;
+
+typedef struct SOMMapFileComponent
+{
+  double min_value;
+  double max_value;
+  uint64_t name_offset; // Offsets inside the strings block
+  uint64_t min_value_str_offset;
+  uint64_t max_value_str_offset;
+} SOMMapFileComponent;
+
+// Copies 's' to the end of a strings block. Returns its offset inside the block.
+uint64_t append_file_string(char *strings, uint64_t *strings_size, const char *s)
+{
+  uint64_t offset = *strings_size;
+  size_t length = strlen(s) + 1;
+
+  memcpy(&strings[offset], s, length);
+  *strings_size += length;
+  return offset;
+}
+
+bool save_som_map(SOMMap *map, DatasetInfo *info, const char *filename)
+{
+  SOMMapFileHeader header = {0};
+  SOMMapFileComponent *components = (SOMMapFileComponent *)calloc(info->total_components, sizeof(SOMMapFileComponent));
+  size_t max_strings_size = 0;
+  char *strings;
+  bool written;
+
+  for (int i = 0; i < info->total_components; i++)
+    max_strings_size += strlen(info->components[i].name) + strlen(info->components[i].min_value_str) + strlen(info->components[i].max_value_str) + 3;
+
+  strings = (char *)malloc(max(1, max_strings_size));
+  if ((components == NULL) || (strings == NULL))
+  {
+    printf("Could not allocate the map file %s\n", filename);
+    free(components);
+    free(strings);
+    return false;
+  }
+
+  for (int i = 0; i < info->total_components; i++)
+  {
+    components[i].min_value = info->components[i].min_value;
+    components[i].max_value = info->components[i].max_value;
+    components[i].name_offset = append_file_string(strings, &header.strings_size, info->components[i].name);
+    components[i].min_value_str_offset = append_file_string(strings, &header.strings_size, info->components[i].min_value_str);
+    components[i].max_value_str_offset = append_file_string(strings, &header.strings_size, info->components[i].max_value_str);
+  }
+
+  memcpy(header.magic, SOM_MAP_FILE_MAGIC, sizeof(header.magic));
+  header.version = SOM_MAP_FILE_VERSION;
+  header.byte_order = SOM_MAP_FILE_BYTE_ORDER;
+  header.width = map->width;
+  header.height = map->height;
+  header.total_weights = map->total_weights;
+  header.layout = map->layout;
+  header.total_components = info->total_components;
+  header.neuron_stride = map->neuron_stride;
+  header.component_stride = map->component_stride;
+  header.components_offset = sizeof(SOMMapFileHeader);
+  header.strings_offset = header.components_offset + sizeof(SOMMapFileComponent) * info->total_components;
+  header.weights_offset = round_up(header.strings_offset + header.strings_size, CODEBOOK_ALIGNMENT);
+  header.weight_size = sizeof(som_real);
+  header.weights_size = codebook_size(map);
+
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL)
+  {
+    printf("Could not open file %s\n", filename);
+    free(components);
+    free(strings);
+    return false;
+  }
+
+  static const char padding[CODEBOOK_ALIGNMENT] = {0};
+  written = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+            (fwrite(components, sizeof(SOMMapFileComponent), info->total_components, fp) == (size_t)info->total_components) &&
+            (fwrite(strings, 1, header.strings_size, fp) == header.strings_size) &&
+            (fwrite(padding, 1, header.weights_offset - (header.strings_offset + header.strings_size), fp) == header.weights_offset - (header.strings_offset + header.strings_size)) &&
+            (fwrite(map->weights, 1, header.weights_size, fp) == header.weights_size);
+  written = (fclose(fp) == 0) && written;
+
+  if (!written)
+    printf("Could not write the map file %s\n", filename);
+
+  free(components);
+  free(strings);
+  return written;
+}
+
+static size_t map_file_weight_size(const SOMMapFileHeader *header)
+{
+  return header->weight_size == 0 ? sizeof(double) : (size_t)header->weight_size;
+}
+
+// True if 'size' bytes starting at 'offset' end at or before 'limit', without overflowing
+static bool block_fits(uint64_t offset, uint64_t size, uint64_t limit)
+{
+  return (offset <= limit) && (size <= limit - offset);
+}
+
+// The strides must be the ones allocate_som_map computes for the dimensions and the layout, and the weights
+// block must hold them, so that no neuron is read outside the file.
+static bool valid_map_file_header(const SOMMapFileHeader *header, size_t file_size)
+{
+  SOMMap expected = {0};
+  size_t weight_size = map_file_weight_size(header);
+
+  if ((memcmp(header->magic, SOM_MAP_FILE_MAGIC, sizeof(header->magic)) != 0) || (header->byte_order != SOM_MAP_FILE_BYTE_ORDER))
+    return false;
+  if ((header->width <= 0) || (header->height <= 0) || (header->width > MAX_MAP_SIDE) || (header->height > MAX_MAP_SIDE) ||
+      (header->total_components < 2) || (header->total_weights != header->total_components - 1) ||
+      ((header->layout != CODEBOOK_AOS) && (header->layout != CODEBOOK_SOA)) ||
+      ((weight_size != sizeof(double)) && (weight_size != sizeof(float))))
+    return false;
+
+  expected.layout = header->layout;
+  expected.total_weights = header->total_weights;
+  expected.total_neurons = header->width * header->height;
+  set_codebook_strides(&expected);
+  if ((header->neuron_stride != expected.neuron_stride) || (header->component_stride != expected.component_stride))
+    return false;
+
+  return (header->components_offset >= sizeof(SOMMapFileHeader)) &&
+         block_fits(header->components_offset, sizeof(SOMMapFileComponent) * (uint64_t)header->total_components, header->strings_offset) &&
+         block_fits(header->strings_offset, header->strings_size, header->weights_offset) &&
+         (header->weights_offset % CODEBOOK_ALIGNMENT == 0) &&
+         (header->weights_size == codebook_size(&expected) / sizeof(som_real) * weight_size) &&
+         block_fits(header->weights_offset, header->weights_size, file_size);
+}
+
+// Copies the string at 'offset' of a strings block. Returns NULL if it is not inside the block.
+char *copy_file_string(Arena *arena, const char *strings, uint64_t strings_size, uint64_t offset)
+{
+  if ((offset >= strings_size) || (memchr(&strings[offset], '\0', strings_size - offset) == NULL))
+    return NULL;
+  return arena_strndup(arena, &strings[offset], strlen(&strings[offset]));
+}
+
+// Copies the weights of a map file saved with the other precision into a codebook of this one
+static bool convert_map_file_weights(SOMMap *map, const SOMMapFileHeader *header, const char *data)
+{
+  size_t total_values = header->weights_size / map_file_weight_size(header);
+
+  if (!allocate_som_map(map, header->width, header->height, header->total_weights, header->layout))
+    return false;
+
+  if (map_file_weight_size(header) == sizeof(double))
+  {
+    const double *weights = (const double *)(data + header->weights_offset);
+    for (size_t i = 0; i < total_values; i++)
+      map->weights[i] = weights[i];
+  }
+  else
+  {
+    const float *weights = (const float *)(data + header->weights_offset);
+    for (size_t i = 0; i < total_values; i++)
+      map->weights[i] = weights[i];
+  }
+  return true;
+}
+
+// Maps a map file. The weights are used in place (copy-on-write), and the component names and ranges are copied
+// to 'info', which holds no samples. Free them with free_som_map and free_dataset. The weights of a map saved with
+// the other precision are converted into an allocated codebook instead.
+bool load_som_map(SOMMap *map, DatasetInfo *info, const char *filename)
+{
+  struct stat file_stat;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+  {
+    printf("Could not open file %s\n", filename);
+    return false;
+  }
+
+  if ((fstat(fd, &file_stat) != 0) || ((size_t)file_stat.st_size < sizeof(SOMMapFileHeader)))
+  {
+    printf("%s is not a map file\n", filename);
+    close(fd);
+    return false;
+  }
+
+  char *data = (char *)mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    printf("Could not map file %s\n", filename);
+    return false;
+  }
+
+  const SOMMapFileHeader *header = (const SOMMapFileHeader *)data;
+  if ((memcmp(header->magic, SOM_MAP_FILE_MAGIC, sizeof(header->magic)) == 0) && (header->version != SOM_MAP_FILE_VERSION))
+  {
+    printf("%s is a version %u map file, only version %d is supported\n", filename, header->version, SOM_MAP_FILE_VERSION);
+    munmap(data, file_stat.st_size);
+    return false;
+  }
+  if (!valid_map_file_header(header, file_stat.st_size))
+  {
+    printf("%s is not a valid map file\n", filename);
+    munmap(data, file_stat.st_size);
+    return false;
+  }
+
+  const SOMMapFileComponent *components = (const SOMMapFileComponent *)(data + header->components_offset);
+  const char *strings = data + header->strings_offset;
+  bool valid = true;
+
+  memset(info, 0, sizeof(DatasetInfo));
+  info->total_components = header->total_components;
+  info->components = (ComponentInfo *)arena_allocate(&info->arena, sizeof(ComponentInfo) * header->total_components);
+  for (int i = 0; (i < header->total_components) && (info->components != NULL); i++)
+  {
+    info->components[i].min_value = components[i].min_value;
+    info->components[i].max_value = components[i].max_value;
+    info->components[i].name = copy_file_string(&info->arena, strings, header->strings_size, components[i].name_offset);
+    info->components[i].min_value_str = copy_file_string(&info->arena, strings, header->strings_size, components[i].min_value_str_offset);
+    info->components[i].max_value_str = copy_file_string(&info->arena, strings, header->strings_size, components[i].max_value_str_offset);
+    valid = valid && (info->components[i].name != NULL) && (info->components[i].min_value_str != NULL) && (info->components[i].max_value_str != NULL);
+  }
+
+  if ((info->components == NULL) || !valid)
+  {
+    printf("%s has invalid component names\n", filename);
+    free_dataset(info);
+    munmap(data, file_stat.st_size);
+    return false;
+  }
+
+  if (map_file_weight_size(header) != sizeof(som_real))
+  {
+    bool converted = convert_map_file_weights(map, header, data);
+    if (!converted)
+    {
+      printf("Could not convert the %zu byte weights of %s\n", map_file_weight_size(header), filename);
+      free_dataset(info);
+    }
+    munmap(data, file_stat.st_size);
+    return converted;
+  }
+
+  map->layout = header->layout;
+  map->width = header->width;
+  map->height = header->height;
+  map->total_weights = header->total_weights;
+  map->total_neurons = header->width * header->height;
+  map->neuron_stride = header->neuron_stride;
+  map->component_stride = header->component_stride;
+  map->simd_level = detect_simd_level();
+  map->weights = (som_real *)(data + header->weights_offset);
+  map->mapping = data;
+  map->mapping_size = file_stat.st_size;
+
+  return true;
+}
+
+// The map must have been trained with the components of the dataset, in the same order
+bool som_map_matches_dataset(DatasetInfo *map_info, DatasetInfo *info)
+{
+  if (map_info->total_components != info->total_components)
+  {
+    printf("The map has %d components and the dataset %d\n", map_info->total_components, info->total_components);
+    return false;
+  }
+
+  for (int i = 0; i < info->total_components; i++)
+    if (strcmp(map_info->components[i].name, info->components[i].name) != 0)
+    {
+      printf("Component %d of the map is '%s' and the one of the dataset '%s'\n", i, map_info->components[i].name, info->components[i].name);
+      return false;
+    }
+
+  return true;
+}
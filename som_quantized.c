@@ -0,0 +1,412 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Quantized inference of a trained map. Scoring samples against a frozen map only needs the BMUs, so
+             the weights can be stored as 8 or 16 bit integers and compared with integer SIMD kernels, which read
+             a fraction of the bytes of the codebook and evaluate twice as many components per instruction. The
+             few best neurons of the quantized distances can be re-ranked with their exact distances.
+
+Notes: The samples and the weights are normalized with the min/max of the dataset components, so [0, 1] is stored
+       as [0, scale] and values out of the range are clamped. The kernels multiply-add pairs of 16 bit component
+       differences into 32 bit sums (madd), so the scale is lowered when needed to keep the distance of a neuron,
+       at most 2 * total_pairs * scale^2, inside 32 bits. Quantized distances can tie or swap neurons that are
+       closer than the quantization step, so the BMUs are not always the ones of search_bmu. The re-rank fixes
+       most of them, and som-cli -L map.som -i int8 -V map.som measures how many agree. On the map trained with
+       the whole schedule on the white wine dataset, int8 agrees on 94.2% of the samples without re-rank, 99.3%
+       with 4 candidates and 100% with 8. Maps trained for fewer epochs are smoother, many neighbors fall within a
+       step of each other and int8 agrees far less: 24% with 4 candidates, 39% with 8 and 61% with 16 after 4
+       epochs. int16 agrees on 99.9% of the samples of that map with 4 candidates and 100% with 8, so it is the
+       precision to use on maps trained with short schedules.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "som.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SOM_X86 1
+#include <immintrin.h>
+#endif
+
+typedef struct QuantizedCandidate
+{
+  int32_t distance;
+  int neuron;
+} QuantizedCandidate;
+
+// Best neurons of the quantized distances, sorted from the closest one
+typedef struct QuantizedCandidates
+{
+  QuantizedCandidate candidates[MAX_RERANK_CANDIDATES];
+  int total;
+  int capacity;
+} QuantizedCandidates;
+
+typedef void (*QuantizedScanKernel)(QuantizedMap *quantized, const int16_t *query, QuantizedCandidates *best);
+
+// Every kernel below is instantiated for each precision, once for any number of weights and once for each number
+// of SPECIALIZED_WEIGHTS, where the number of component pairs is a constant and the compiler unrolls the pair loop
+#define GENERIC_SCAN_KERNELS(kernel, attributes) \
+  attributes static void kernel##_int8_generic(QuantizedMap *quantized, const int16_t *query, QuantizedCandidates *best) \
+  { \
+    kernel(quantized, query, best, QUANTIZED_INT8, quantized->total_pairs); \
+  } \
+  attributes static void kernel##_int16_generic(QuantizedMap *quantized, const int16_t *query, QuantizedCandidates *best) \
+  { \
+    kernel(quantized, query, best, QUANTIZED_INT16, quantized->total_pairs); \
+  }
+#define SPECIALIZED_SCAN_KERNELS(kernel, attributes, weights) \
+  attributes static void kernel##_int8_##weights(QuantizedMap *quantized, const int16_t *query, QuantizedCandidates *best) \
+  { \
+    kernel(quantized, query, best, QUANTIZED_INT8, ((weights) + 1) / 2); \
+  } \
+  attributes static void kernel##_int16_##weights(QuantizedMap *quantized, const int16_t *query, QuantizedCandidates *best) \
+  { \
+    kernel(quantized, query, best, QUANTIZED_INT16, ((weights) + 1) / 2); \
+  }
+
+const char *quantized_precision_name(QuantizedPrecision precision)
+{
+  return precision == QUANTIZED_INT8 ? "int8" : "int16";
+}
+
+static int quantize_value(double value, int scale)
+{
+  if (value <= 0.0)
+    return 0;
+  if (value >= 1.0)
+    return scale;
+  return (int)lround(value * scale);
+}
+
+static size_t quantized_weight_size(QuantizedMap *quantized)
+{
+  return quantized->precision == QUANTIZED_INT8 ? sizeof(uint8_t) : sizeof(int16_t);
+}
+
+// Bytes of the quantized weights
+size_t quantized_map_size(QuantizedMap *quantized)
+{
+  return (size_t)quantized->total_blocks * quantized->total_pairs * QUANTIZED_BLOCK_NEURONS * 2 * quantized_weight_size(quantized);
+}
+
+// Quantizes the weights of a trained map. The map must outlive the quantized one and keep its weights.
+bool build_quantized_map(QuantizedMap *quantized, SOMMap *map, QuantizedPrecision precision, int rerank_candidates)
+{
+  int max_scale = precision == QUANTIZED_INT8 ? UINT8_MAX : INT16_MAX;
+
+  quantized->map = map;
+  quantized->precision = precision;
+  quantized->total_weights = map->total_weights;
+  quantized->total_pairs = (map->total_weights + 1) / 2;
+  quantized->total_blocks = (map->total_neurons + QUANTIZED_BLOCK_NEURONS - 1) / QUANTIZED_BLOCK_NEURONS;
+  quantized->scale = min(max_scale, (int)floor(sqrt(INT32_MAX / (2.0 * quantized->total_pairs))));
+  quantized->rerank_candidates = min(max(rerank_candidates, 0), MAX_RERANK_CANDIDATES);
+  quantized->simd_level = map->simd_level;
+
+  if (posix_memalign(&quantized->weights, CODEBOOK_ALIGNMENT, quantized_map_size(quantized)) != 0)
+  {
+    printf("Could not allocate the %s weights of the map\n", quantized_precision_name(precision));
+    quantized->weights = NULL;
+    return false;
+  }
+
+  // Padding neurons and components are zeros. The padding component adds nothing to the distances and the
+  // padding neurons are never candidates.
+  memset(quantized->weights, 0, quantized_map_size(quantized));
+  for (int n = 0; n < map->total_neurons; n++)
+    for (int i = 0; i < map->total_weights; i++)
+    {
+      size_t index = (((size_t)(n / QUANTIZED_BLOCK_NEURONS) * quantized->total_pairs + i / 2) * QUANTIZED_BLOCK_NEURONS + n % QUANTIZED_BLOCK_NEURONS) * 2 + i % 2;
+      int value = quantize_value(*get_neuron_weight(map, n, i), quantized->scale);
+
+      if (precision == QUANTIZED_INT8)
+        ((uint8_t *)quantized->weights)[index] = (uint8_t)value;
+      else
+        ((int16_t *)quantized->weights)[index] = (int16_t)value;
+    }
+
+  return true;
+}
+
+void free_quantized_map(QuantizedMap *quantized)
+{
+  free(quantized->weights);
+  quantized->weights = NULL;
+}
+
+// Distance of the worst candidate, the one a neuron has to improve
+static inline int32_t candidates_threshold(QuantizedCandidates *best)
+{
+  return best->total < best->capacity ? INT32_MAX : best->candidates[best->capacity - 1].distance;
+}
+
+// Inserts a neuron if it is closer than the worst candidate. Neurons come in increasing index order, so ties keep
+// the lowest index.
+static inline void add_quantized_candidate(QuantizedCandidates *best, int32_t distance, int neuron)
+{
+  int c;
+
+  if (best->total < best->capacity)
+    c = best->total++;
+  else if (distance < best->candidates[best->capacity - 1].distance)
+    c = best->capacity - 1;
+  else
+    return;
+
+  while ((c > 0) && (best->candidates[c - 1].distance > distance))
+  {
+    best->candidates[c] = best->candidates[c - 1];
+    c--;
+  }
+  best->candidates[c] = (QuantizedCandidate){.distance = distance, .neuron = neuron};
+}
+
+// Only called for the blocks with a neuron closer than the worst candidate. The padding neurons of the last block
+// are skipped.
+static void add_block_candidates(QuantizedMap *quantized, QuantizedCandidates *best, const int32_t *distances, int block)
+{
+  for (int j = 0; j < QUANTIZED_BLOCK_NEURONS; j++)
+  {
+    int neuron = block * QUANTIZED_BLOCK_NEURONS + j;
+    if (neuron < quantized->map->total_neurons)
+      add_quantized_candidate(best, distances[j], neuron);
+  }
+}
+
+static inline __attribute__((always_inline)) int32_t quantized_weight(QuantizedMap *quantized, size_t index, QuantizedPrecision precision)
+{
+  return precision == QUANTIZED_INT8 ? ((uint8_t *)quantized->weights)[index] : ((int16_t *)quantized->weights)[index];
+}
+
+static inline __attribute__((always_inline)) void quantized_scan_scalar(QuantizedMap *quantized, const int16_t *query, QuantizedCandidates *best, QuantizedPrecision precision, int total_pairs)
+{
+  int32_t distances[QUANTIZED_BLOCK_NEURONS];
+  size_t index = 0;
+
+  for (int block = 0; block < quantized->total_blocks; block++)
+  {
+    int32_t threshold = candidates_threshold(best);
+    bool improves = false;
+
+    for (int j = 0; j < QUANTIZED_BLOCK_NEURONS; j++)
+      distances[j] = 0;
+    for (int p = 0; p < total_pairs; p++)
+      for (int j = 0; j < QUANTIZED_BLOCK_NEURONS; j++, index += 2)
+      {
+        int32_t first = query[2 * p] - quantized_weight(quantized, index, precision);
+        int32_t second = query[2 * p + 1] - quantized_weight(quantized, index + 1, precision);
+        distances[j] += first * first + second * second;
+      }
+
+    for (int j = 0; j < QUANTIZED_BLOCK_NEURONS; j++)
+      improves = improves || (distances[j] < threshold);
+    if (improves)
+      add_block_candidates(quantized, best, distances, block);
+  }
+}
+
+GENERIC_SCAN_KERNELS(quantized_scan_scalar, )
+#define SCALAR_SCAN_KERNELS(weights) SPECIALIZED_SCAN_KERNELS(quantized_scan_scalar, , weights)
+#define SCALAR_INT8_ENTRY(weights) [weights] = quantized_scan_scalar_int8_##weights,
+#define SCALAR_INT16_ENTRY(weights) [weights] = quantized_scan_scalar_int16_##weights,
+SPECIALIZED_WEIGHTS(SCALAR_SCAN_KERNELS)
+static const QuantizedScanKernel scalar_int8_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SCALAR_INT8_ENTRY)};
+static const QuantizedScanKernel scalar_int16_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SCALAR_INT16_ENTRY)};
+
+#ifdef SOM_X86
+
+// The two components of a query pair, repeated in every 32 bit lane, so a 16 bit subtraction pairs them with the
+// ones of every neuron
+static inline int32_t query_pair(const int16_t *query, int pair)
+{
+  int32_t value;
+  memcpy(&value, &query[2 * pair], sizeof(value));
+  return value;
+}
+
+__attribute__((target("sse2"))) static inline __attribute__((always_inline)) void quantized_scan_sse2(QuantizedMap *quantized, const int16_t *query, QuantizedCandidates *best, QuantizedPrecision precision, int total_pairs)
+{
+  int32_t distances[QUANTIZED_BLOCK_NEURONS] __attribute__((aligned(16)));
+  __m128i pairs[total_pairs];
+
+  for (int p = 0; p < total_pairs; p++)
+    pairs[p] = _mm_set1_epi32(query_pair(query, p));
+
+  for (int block = 0; block < quantized->total_blocks; block++)
+  {
+    size_t index = (size_t)block * total_pairs * QUANTIZED_BLOCK_NEURONS * 2;
+    __m128i acc[2] = {_mm_setzero_si128(), _mm_setzero_si128()};
+
+    for (int p = 0; p < total_pairs; p++, index += QUANTIZED_BLOCK_NEURONS * 2)
+    {
+      __m128i weights[2];
+      if (precision == QUANTIZED_INT8)
+      {
+        __m128i packed = _mm_loadu_si128((const __m128i *)&((uint8_t *)quantized->weights)[index]);
+        weights[0] = _mm_unpacklo_epi8(packed, _mm_setzero_si128());
+        weights[1] = _mm_unpackhi_epi8(packed, _mm_setzero_si128());
+      }
+      else
+      {
+        weights[0] = _mm_loadu_si128((const __m128i *)&((int16_t *)quantized->weights)[index]);
+        weights[1] = _mm_loadu_si128((const __m128i *)&((int16_t *)quantized->weights)[index + 8]);
+      }
+
+      for (int h = 0; h < 2; h++)
+      {
+        __m128i difference = _mm_sub_epi16(pairs[p], weights[h]);
+        acc[h] = _mm_add_epi32(acc[h], _mm_madd_epi16(difference, difference));
+      }
+    }
+
+    __m128i threshold = _mm_set1_epi32(candidates_threshold(best));
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi32(acc[0], threshold), _mm_cmplt_epi32(acc[1], threshold))) != 0)
+    {
+      _mm_store_si128((__m128i *)distances, acc[0]);
+      _mm_store_si128((__m128i *)(distances + 4), acc[1]);
+      add_block_candidates(quantized, best, distances, block);
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) void quantized_scan_avx2(QuantizedMap *quantized, const int16_t *query, QuantizedCandidates *best, QuantizedPrecision precision, int total_pairs)
+{
+  int32_t distances[QUANTIZED_BLOCK_NEURONS] __attribute__((aligned(32)));
+  __m256i pairs[total_pairs];
+
+  for (int p = 0; p < total_pairs; p++)
+    pairs[p] = _mm256_set1_epi32(query_pair(query, p));
+
+  for (int block = 0; block < quantized->total_blocks; block++)
+  {
+    size_t index = (size_t)block * total_pairs * QUANTIZED_BLOCK_NEURONS * 2;
+    __m256i acc = _mm256_setzero_si256();
+
+    for (int p = 0; p < total_pairs; p++, index += QUANTIZED_BLOCK_NEURONS * 2)
+    {
+      __m256i weights;
+      if (precision == QUANTIZED_INT8)
+        weights = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)&((uint8_t *)quantized->weights)[index]));
+      else
+        weights = _mm256_loadu_si256((const __m256i *)&((int16_t *)quantized->weights)[index]);
+
+      __m256i difference = _mm256_sub_epi16(pairs[p], weights);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(difference, difference));
+    }
+
+    if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(_mm256_set1_epi32(candidates_threshold(best)), acc)) != 0)
+    {
+      _mm256_store_si256((__m256i *)distances, acc);
+      add_block_candidates(quantized, best, distances, block);
+    }
+  }
+}
+
+GENERIC_SCAN_KERNELS(quantized_scan_sse2, __attribute__((target("sse2"))))
+#define SSE2_SCAN_KERNELS(weights) SPECIALIZED_SCAN_KERNELS(quantized_scan_sse2, __attribute__((target("sse2"))), weights)
+#define SSE2_INT8_ENTRY(weights) [weights] = quantized_scan_sse2_int8_##weights,
+#define SSE2_INT16_ENTRY(weights) [weights] = quantized_scan_sse2_int16_##weights,
+SPECIALIZED_WEIGHTS(SSE2_SCAN_KERNELS)
+static const QuantizedScanKernel sse2_int8_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SSE2_INT8_ENTRY)};
+static const QuantizedScanKernel sse2_int16_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SSE2_INT16_ENTRY)};
+
+GENERIC_SCAN_KERNELS(quantized_scan_avx2, __attribute__((target("avx2"))))
+#define AVX2_SCAN_KERNELS(weights) SPECIALIZED_SCAN_KERNELS(quantized_scan_avx2, __attribute__((target("avx2"))), weights)
+#define AVX2_INT8_ENTRY(weights) [weights] = quantized_scan_avx2_int8_##weights,
+#define AVX2_INT16_ENTRY(weights) [weights] = quantized_scan_avx2_int16_##weights,
+SPECIALIZED_WEIGHTS(AVX2_SCAN_KERNELS)
+static const QuantizedScanKernel avx2_int8_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(AVX2_INT8_ENTRY)};
+static const QuantizedScanKernel avx2_int16_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(AVX2_INT16_ENTRY)};
+
+#endif
+
+// The kernel specialized for the number of weights of the map if there is one, the generic one otherwise
+static QuantizedScanKernel select_scan_kernel(const QuantizedScanKernel *specialized, QuantizedScanKernel generic, int total_weights)
+{
+  if (SOM_SPECIALIZED_KERNELS && (total_weights <= MAX_SPECIALIZED_WEIGHTS) && (specialized[total_weights] != NULL))
+    return specialized[total_weights];
+  return generic;
+}
+
+// AVX-512 machines run the AVX2 kernels: a block of 8 neurons and 2 components fills 256 bits
+static QuantizedScanKernel select_quantized_kernel(QuantizedMap *quantized)
+{
+  bool int8 = (quantized->precision == QUANTIZED_INT8);
+
+#ifdef SOM_X86
+  if (quantized->simd_level >= SIMD_AVX2)
+    return int8 ? select_scan_kernel(avx2_int8_kernels, quantized_scan_avx2_int8_generic, quantized->total_weights)
+                : select_scan_kernel(avx2_int16_kernels, quantized_scan_avx2_int16_generic, quantized->total_weights);
+  if (quantized->simd_level == SIMD_SSE2)
+    return int8 ? select_scan_kernel(sse2_int8_kernels, quantized_scan_sse2_int8_generic, quantized->total_weights)
+                : select_scan_kernel(sse2_int16_kernels, quantized_scan_sse2_int16_generic, quantized->total_weights);
+#endif
+  return int8 ? select_scan_kernel(scalar_int8_kernels, quantized_scan_scalar_int8_generic, quantized->total_weights)
+              : select_scan_kernel(scalar_int16_kernels, quantized_scan_scalar_int16_generic, quantized->total_weights);
+}
+
+// BMU of a normalized sample. The candidates are the closest neurons of the quantized distances, and the one
+// with the lowest exact distance wins.
+void quantized_search_bmu(QuantizedMap *quantized, const som_real *query, BMU *bmu)
+{
+  int16_t quantized_query[2 * quantized->total_pairs];
+  QuantizedCandidates best = {.total = 0, .capacity = max(quantized->rerank_candidates, 1)};
+
+  for (int i = 0; i < 2 * quantized->total_pairs; i++)
+    quantized_query[i] = (int16_t)(i < quantized->total_weights ? quantize_value(query[i], quantized->scale) : 0);
+  select_quantized_kernel(quantized)(quantized, quantized_query, &best);
+
+  int winner = best.candidates[0].neuron;
+  if (quantized->rerank_candidates > 0)
+  {
+    double winner_distance = squared_distance_to_neuron(quantized->map, query, winner);
+    for (int c = 1; c < best.total; c++)
+    {
+      int neuron = best.candidates[c].neuron;
+      double distance = squared_distance_to_neuron(quantized->map, query, neuron);
+      if ((distance < winner_distance) || ((distance == winner_distance) && (neuron < winner)))
+      {
+        winner_distance = distance;
+        winner = neuron;
+      }
+    }
+  }
+
+  bmu->x_coord = winner % quantized->map->width;
+  bmu->y_coord = winner / quantized->map->width;
+}
+
+typedef struct QuantizedInference
+{
+  QuantizedMap *quantized;
+  DatasetInfo *info;
+} QuantizedInference;
+
+static void quantized_infer_samples_task(void *context, int task, int total_tasks)
+{
+  QuantizedInference *inference = (QuantizedInference *)context;
+  int first = task * INFERENCE_SAMPLES_PER_TASK;
+  int last = min(first + INFERENCE_SAMPLES_PER_TASK, inference->info->total_dataset_samples);
+
+  (void)total_tasks;
+
+  for (int i = first; i < last; i++)
+    quantized_search_bmu(inference->quantized, inference->info->samples[i].components, &inference->info->samples[i].bmu);
+}
+
+// Same as infer_samples, comparing the quantized weights
+void quantized_infer_samples(QuantizedMap *quantized, DatasetInfo *info, ThreadPool *pool)
+{
+  QuantizedInference inference = {.quantized = quantized, .info = info};
+  int total_tasks = (info->total_dataset_samples + INFERENCE_SAMPLES_PER_TASK - 1) / INFERENCE_SAMPLES_PER_TASK;
+
+  run_parallel(pool, quantized_infer_samples_task, &inference, total_tasks);
+}
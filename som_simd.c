@@ -0,0 +1,412 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Best Matching Unit search kernels. The search only needs the argmin of the distances, so the kernels
+             compare squared Euclidean distances and never compute a square root. The SoA kernels evaluate a
+             block of CODEBOOK_SOA_PADDING neurons at a time with SSE2, AVX2 or AVX-512, and they abandon the
+             block as soon as the partial distances of all its neurons are already worse than the current best.
+
+Notes: Every kernel accumulates (query[i] - weight[i])^2 in component order without fused multiply-adds, so all
+       of them compute bit-identical distances and return the same neuron (the lowest index wins the ties). This
+       relies on the default -std=c99 floating point contraction mode (off). Every kernel is also compiled with
+       the number of weights fixed for each of SPECIALIZED_WEIGHTS (11 for the wine datasets), and the search
+       picks the one of the map at runtime. The specializations only unroll the loops, their results are the same.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <stdbool.h>
+#include <string.h>
+#include "som.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SOM_X86 1
+#include <immintrin.h>
+#endif
+
+// The early abandon test is done once every this number of components
+#define EARLY_ABANDON_INTERVAL 4
+
+typedef void (*BMUSearchKernel)(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best);
+
+// Every kernel below is instantiated once for any number of weights and once for each number of SPECIALIZED_WEIGHTS,
+// where the number of weights is a constant and the compiler unrolls the component loop
+#define GENERIC_SEARCH_KERNEL(kernel, attributes) \
+  attributes static void kernel##_generic(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best) \
+  { \
+    kernel(map, query, first, last, best, map->total_weights); \
+  }
+#define SPECIALIZED_SEARCH_KERNEL(kernel, attributes, weights) \
+  attributes static void kernel##_##weights(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best) \
+  { \
+    kernel(map, query, first, last, best, weights); \
+  }
+
+static void update_best_from_block(const som_real *block_dist, int block, int first, int last, BMUCandidate *best)
+{
+  for (int j = 0; j < CODEBOOK_SOA_PADDING; j++)
+  {
+    int neuron = block + j;
+    if ((neuron >= first) && (neuron < last) && (block_dist[j] < best->distance))
+    {
+      best->distance = block_dist[j];
+      best->neuron = neuron;
+    }
+  }
+}
+
+static inline __attribute__((always_inline)) void search_bmu_aos_scalar(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best, int total_weights)
+{
+  for (int n = first; n < last; n++)
+  {
+    const som_real *weights = get_neuron_weight(map, n, 0);
+    som_real dist = 0.0;
+    int i = 0, chunk_end;
+
+    // Components are accumulated in chunks so the inner loop stays branch free
+    do
+    {
+      chunk_end = min(i + EARLY_ABANDON_INTERVAL, total_weights);
+      for (; i < chunk_end; i++)
+        dist += pow2(query[i] - weights[i]);
+    } while ((i < total_weights) && (dist < best->distance));
+
+    if ((i == total_weights) && (dist < best->distance))
+    {
+      best->distance = dist;
+      best->neuron = n;
+    }
+  }
+}
+
+static inline __attribute__((always_inline)) void search_bmu_soa_scalar(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best, int total_weights)
+{
+  som_real block_dist[CODEBOOK_SOA_PADDING];
+
+  for (int block = first - (first % CODEBOOK_SOA_PADDING); block < last; block += CODEBOOK_SOA_PADDING)
+  {
+    bool abandoned = false;
+
+    for (int j = 0; j < CODEBOOK_SOA_PADDING; j++)
+      block_dist[j] = 0.0;
+
+    for (int i = 0; i < total_weights && !abandoned; i++)
+    {
+      som_real component = query[i];
+      const som_real *plane = &map->weights[i * map->component_stride + block];
+      for (int j = 0; j < CODEBOOK_SOA_PADDING; j++)
+        block_dist[j] += pow2(component - plane[j]);
+
+      if ((i % EARLY_ABANDON_INTERVAL) == EARLY_ABANDON_INTERVAL - 1)
+      {
+        abandoned = true;
+        for (int j = 0; j < CODEBOOK_SOA_PADDING; j++)
+          if (block_dist[j] < best->distance)
+            abandoned = false;
+      }
+    }
+
+    if (!abandoned)
+      update_best_from_block(block_dist, block, first, last, best);
+  }
+}
+
+GENERIC_SEARCH_KERNEL(search_bmu_aos_scalar, )
+#define AOS_SCALAR_KERNEL(weights) SPECIALIZED_SEARCH_KERNEL(search_bmu_aos_scalar, , weights)
+#define AOS_SCALAR_ENTRY(weights) [weights] = search_bmu_aos_scalar_##weights,
+SPECIALIZED_WEIGHTS(AOS_SCALAR_KERNEL)
+static const BMUSearchKernel aos_scalar_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(AOS_SCALAR_ENTRY)};
+
+GENERIC_SEARCH_KERNEL(search_bmu_soa_scalar, )
+#define SOA_SCALAR_KERNEL(weights) SPECIALIZED_SEARCH_KERNEL(search_bmu_soa_scalar, , weights)
+#define SOA_SCALAR_ENTRY(weights) [weights] = search_bmu_soa_scalar_##weights,
+SPECIALIZED_WEIGHTS(SOA_SCALAR_KERNEL)
+static const BMUSearchKernel soa_scalar_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SOA_SCALAR_ENTRY)};
+
+#ifdef SOM_X86
+
+// Vector operations of the SIMD kernels on som_real values: packed doubles, or twice as many packed floats
+#if SOM_FLOAT32
+#define SSE2_LANES 4
+#define SSE2Vector __m128
+#define SSE2_ZERO() _mm_setzero_ps()
+#define SSE2_SET1(x) _mm_set1_ps(x)
+#define SSE2_LOADU(p) _mm_loadu_ps(p)
+#define SSE2_STORE(p, v) _mm_store_ps(p, v)
+#define SSE2_SUB(a, b) _mm_sub_ps(a, b)
+#define SSE2_MUL(a, b) _mm_mul_ps(a, b)
+#define SSE2_ADD(a, b) _mm_add_ps(a, b)
+#define SSE2_ANY_LESS(acc, a, b) _mm_or_ps(acc, _mm_cmplt_ps(a, b))
+#define SSE2_MOVEMASK(v) _mm_movemask_ps(v)
+#define AVX2_LANES 8
+#define AVX2Vector __m256
+#define AVX2_ZERO() _mm256_setzero_ps()
+#define AVX2_SET1(x) _mm256_set1_ps(x)
+#define AVX2_LOADU(p) _mm256_loadu_ps(p)
+#define AVX2_STORE(p, v) _mm256_store_ps(p, v)
+#define AVX2_SUB(a, b) _mm256_sub_ps(a, b)
+#define AVX2_MUL(a, b) _mm256_mul_ps(a, b)
+#define AVX2_ADD(a, b) _mm256_add_ps(a, b)
+#define AVX2_ANY_LESS(acc, a, b) _mm256_or_ps(acc, _mm256_cmp_ps(a, b, _CMP_LT_OQ))
+#define AVX2_MOVEMASK(v) _mm256_movemask_ps(v)
+#define AVX512_LANES 16
+#define AVX512Vector __m512
+#define AVX512_ZERO() _mm512_setzero_ps()
+#define AVX512_SET1(x) _mm512_set1_ps(x)
+#define AVX512_LOADU(p) _mm512_loadu_ps(p)
+#define AVX512_STORE(p, v) _mm512_store_ps(p, v)
+#define AVX512_SUB(a, b) _mm512_sub_ps(a, b)
+#define AVX512_MUL(a, b) _mm512_mul_ps(a, b)
+#define AVX512_ADD(a, b) _mm512_add_ps(a, b)
+#define AVX512_LESS_MASK(a, b) _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ)
+#else
+#define SSE2_LANES 2
+#define SSE2Vector __m128d
+#define SSE2_ZERO() _mm_setzero_pd()
+#define SSE2_SET1(x) _mm_set1_pd(x)
+#define SSE2_LOADU(p) _mm_loadu_pd(p)
+#define SSE2_STORE(p, v) _mm_store_pd(p, v)
+#define SSE2_SUB(a, b) _mm_sub_pd(a, b)
+#define SSE2_MUL(a, b) _mm_mul_pd(a, b)
+#define SSE2_ADD(a, b) _mm_add_pd(a, b)
+#define SSE2_ANY_LESS(acc, a, b) _mm_or_pd(acc, _mm_cmplt_pd(a, b))
+#define SSE2_MOVEMASK(v) _mm_movemask_pd(v)
+#define AVX2_LANES 4
+#define AVX2Vector __m256d
+#define AVX2_ZERO() _mm256_setzero_pd()
+#define AVX2_SET1(x) _mm256_set1_pd(x)
+#define AVX2_LOADU(p) _mm256_loadu_pd(p)
+#define AVX2_STORE(p, v) _mm256_store_pd(p, v)
+#define AVX2_SUB(a, b) _mm256_sub_pd(a, b)
+#define AVX2_MUL(a, b) _mm256_mul_pd(a, b)
+#define AVX2_ADD(a, b) _mm256_add_pd(a, b)
+#define AVX2_ANY_LESS(acc, a, b) _mm256_or_pd(acc, _mm256_cmp_pd(a, b, _CMP_LT_OQ))
+#define AVX2_MOVEMASK(v) _mm256_movemask_pd(v)
+#define AVX512_LANES 8
+#define AVX512Vector __m512d
+#define AVX512_ZERO() _mm512_setzero_pd()
+#define AVX512_SET1(x) _mm512_set1_pd(x)
+#define AVX512_LOADU(p) _mm512_loadu_pd(p)
+#define AVX512_STORE(p, v) _mm512_store_pd(p, v)
+#define AVX512_SUB(a, b) _mm512_sub_pd(a, b)
+#define AVX512_MUL(a, b) _mm512_mul_pd(a, b)
+#define AVX512_ADD(a, b) _mm512_add_pd(a, b)
+#define AVX512_LESS_MASK(a, b) _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ)
+#endif
+
+__attribute__((target("sse2"))) static inline __attribute__((always_inline)) void search_bmu_soa_sse2(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best, int total_weights)
+{
+  som_real block_dist[CODEBOOK_SOA_PADDING] __attribute__((aligned(64)));
+
+  for (int block = first - (first % CODEBOOK_SOA_PADDING); block < last; block += CODEBOOK_SOA_PADDING)
+  {
+    SSE2Vector acc[CODEBOOK_SOA_PADDING / SSE2_LANES];
+    bool abandoned = false;
+
+    for (int v = 0; v < CODEBOOK_SOA_PADDING / SSE2_LANES; v++)
+      acc[v] = SSE2_ZERO();
+
+    for (int i = 0; i < total_weights && !abandoned; i++)
+    {
+      SSE2Vector component = SSE2_SET1(query[i]);
+      const som_real *plane = &map->weights[i * map->component_stride + block];
+      for (int v = 0; v < CODEBOOK_SOA_PADDING / SSE2_LANES; v++)
+      {
+        SSE2Vector diff = SSE2_SUB(component, SSE2_LOADU(plane + SSE2_LANES * v));
+        acc[v] = SSE2_ADD(acc[v], SSE2_MUL(diff, diff));
+      }
+
+      if ((i % EARLY_ABANDON_INTERVAL) == EARLY_ABANDON_INTERVAL - 1)
+      {
+        SSE2Vector best_dist = SSE2_SET1(best->distance);
+        SSE2Vector improves = SSE2_ZERO();
+        for (int v = 0; v < CODEBOOK_SOA_PADDING / SSE2_LANES; v++)
+          improves = SSE2_ANY_LESS(improves, acc[v], best_dist);
+        abandoned = (SSE2_MOVEMASK(improves) == 0);
+      }
+    }
+
+    if (!abandoned)
+    {
+      for (int v = 0; v < CODEBOOK_SOA_PADDING / SSE2_LANES; v++)
+        SSE2_STORE(block_dist + SSE2_LANES * v, acc[v]);
+      update_best_from_block(block_dist, block, first, last, best);
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) void search_bmu_soa_avx2(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best, int total_weights)
+{
+  som_real block_dist[CODEBOOK_SOA_PADDING] __attribute__((aligned(64)));
+
+  for (int block = first - (first % CODEBOOK_SOA_PADDING); block < last; block += CODEBOOK_SOA_PADDING)
+  {
+    AVX2Vector acc[CODEBOOK_SOA_PADDING / AVX2_LANES];
+    bool abandoned = false;
+
+    for (int v = 0; v < CODEBOOK_SOA_PADDING / AVX2_LANES; v++)
+      acc[v] = AVX2_ZERO();
+
+    for (int i = 0; i < total_weights && !abandoned; i++)
+    {
+      AVX2Vector component = AVX2_SET1(query[i]);
+      const som_real *plane = &map->weights[i * map->component_stride + block];
+      for (int v = 0; v < CODEBOOK_SOA_PADDING / AVX2_LANES; v++)
+      {
+        AVX2Vector diff = AVX2_SUB(component, AVX2_LOADU(plane + AVX2_LANES * v));
+        acc[v] = AVX2_ADD(acc[v], AVX2_MUL(diff, diff));
+      }
+
+      if ((i % EARLY_ABANDON_INTERVAL) == EARLY_ABANDON_INTERVAL - 1)
+      {
+        AVX2Vector best_dist = AVX2_SET1(best->distance);
+        AVX2Vector improves = AVX2_ZERO();
+        for (int v = 0; v < CODEBOOK_SOA_PADDING / AVX2_LANES; v++)
+          improves = AVX2_ANY_LESS(improves, acc[v], best_dist);
+        abandoned = (AVX2_MOVEMASK(improves) == 0);
+      }
+    }
+
+    if (!abandoned)
+    {
+      for (int v = 0; v < CODEBOOK_SOA_PADDING / AVX2_LANES; v++)
+        AVX2_STORE(block_dist + AVX2_LANES * v, acc[v]);
+      update_best_from_block(block_dist, block, first, last, best);
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) static inline __attribute__((always_inline)) void search_bmu_soa_avx512(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best, int total_weights)
+{
+  som_real block_dist[CODEBOOK_SOA_PADDING] __attribute__((aligned(64)));
+
+  for (int block = first - (first % CODEBOOK_SOA_PADDING); block < last; block += CODEBOOK_SOA_PADDING)
+  {
+    AVX512Vector acc[CODEBOOK_SOA_PADDING / AVX512_LANES];
+    bool abandoned = false;
+
+    for (int v = 0; v < CODEBOOK_SOA_PADDING / AVX512_LANES; v++)
+      acc[v] = AVX512_ZERO();
+
+    for (int i = 0; i < total_weights && !abandoned; i++)
+    {
+      AVX512Vector component = AVX512_SET1(query[i]);
+      const som_real *plane = &map->weights[i * map->component_stride + block];
+      for (int v = 0; v < CODEBOOK_SOA_PADDING / AVX512_LANES; v++)
+      {
+        AVX512Vector diff = AVX512_SUB(component, AVX512_LOADU(plane + AVX512_LANES * v));
+        acc[v] = AVX512_ADD(acc[v], AVX512_MUL(diff, diff));
+      }
+
+      if ((i % EARLY_ABANDON_INTERVAL) == EARLY_ABANDON_INTERVAL - 1)
+      {
+        AVX512Vector best_dist = AVX512_SET1(best->distance);
+        unsigned int improves = 0;
+        for (int v = 0; v < CODEBOOK_SOA_PADDING / AVX512_LANES; v++)
+          improves |= AVX512_LESS_MASK(acc[v], best_dist);
+        abandoned = (improves == 0);
+      }
+    }
+
+    if (!abandoned)
+    {
+      for (int v = 0; v < CODEBOOK_SOA_PADDING / AVX512_LANES; v++)
+        AVX512_STORE(block_dist + AVX512_LANES * v, acc[v]);
+      update_best_from_block(block_dist, block, first, last, best);
+    }
+  }
+}
+
+GENERIC_SEARCH_KERNEL(search_bmu_soa_sse2, __attribute__((target("sse2"))))
+#define SOA_SSE2_KERNEL(weights) SPECIALIZED_SEARCH_KERNEL(search_bmu_soa_sse2, __attribute__((target("sse2"))), weights)
+#define SOA_SSE2_ENTRY(weights) [weights] = search_bmu_soa_sse2_##weights,
+SPECIALIZED_WEIGHTS(SOA_SSE2_KERNEL)
+static const BMUSearchKernel soa_sse2_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SOA_SSE2_ENTRY)};
+
+GENERIC_SEARCH_KERNEL(search_bmu_soa_avx2, __attribute__((target("avx2"))))
+#define SOA_AVX2_KERNEL(weights) SPECIALIZED_SEARCH_KERNEL(search_bmu_soa_avx2, __attribute__((target("avx2"))), weights)
+#define SOA_AVX2_ENTRY(weights) [weights] = search_bmu_soa_avx2_##weights,
+SPECIALIZED_WEIGHTS(SOA_AVX2_KERNEL)
+static const BMUSearchKernel soa_avx2_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SOA_AVX2_ENTRY)};
+
+GENERIC_SEARCH_KERNEL(search_bmu_soa_avx512, __attribute__((target("avx512f"))))
+#define SOA_AVX512_KERNEL(weights) SPECIALIZED_SEARCH_KERNEL(search_bmu_soa_avx512, __attribute__((target("avx512f"))), weights)
+#define SOA_AVX512_ENTRY(weights) [weights] = search_bmu_soa_avx512_##weights,
+SPECIALIZED_WEIGHTS(SOA_AVX512_KERNEL)
+static const BMUSearchKernel soa_avx512_kernels[MAX_SPECIALIZED_WEIGHTS + 1] = {SPECIALIZED_WEIGHTS(SOA_AVX512_ENTRY)};
+
+#endif
+
+// The kernel specialized for the number of weights of the map if there is one, the generic one otherwise
+static BMUSearchKernel select_search_kernel(const BMUSearchKernel *specialized, BMUSearchKernel generic, int total_weights)
+{
+  if (SOM_SPECIALIZED_KERNELS && (total_weights <= MAX_SPECIALIZED_WEIGHTS) && (specialized[total_weights] != NULL))
+    return specialized[total_weights];
+  return generic;
+}
+
+SIMDLevel detect_simd_level(void)
+{
+#ifdef SOM_X86
+  if (__builtin_cpu_supports("avx512f"))
+    return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return SIMD_SSE2;
+#endif
+  return SIMD_SCALAR;
+}
+
+const char *simd_level_name(SIMDLevel level)
+{
+  static const char *names[] = {"scalar", "sse2", "avx2", "avx512"};
+  return names[level];
+}
+
+bool parse_simd_level(const char *name, SIMDLevel *level)
+{
+  for (int l = SIMD_SCALAR; l <= SIMD_AVX512; l++)
+    if (strcmp(name, simd_level_name(l)) == 0)
+    {
+      *level = l;
+      return true;
+    }
+  return false;
+}
+
+// Scans the neurons [first, last) and updates 'best' whenever a strictly closer neuron is found
+void search_bmu_range(SOMMap *map, const som_real *query, int first, int last, BMUCandidate *best)
+{
+  BMUSearchKernel kernel;
+
+  if (map->layout == CODEBOOK_AOS)
+  {
+    kernel = select_search_kernel(aos_scalar_kernels, search_bmu_aos_scalar_generic, map->total_weights);
+    kernel(map, query, first, last, best);
+    return;
+  }
+
+  switch (map->simd_level)
+  {
+#ifdef SOM_X86
+  case SIMD_AVX512:
+    kernel = select_search_kernel(soa_avx512_kernels, search_bmu_soa_avx512_generic, map->total_weights);
+    break;
+  case SIMD_AVX2:
+    kernel = select_search_kernel(soa_avx2_kernels, search_bmu_soa_avx2_generic, map->total_weights);
+    break;
+  case SIMD_SSE2:
+    kernel = select_search_kernel(soa_sse2_kernels, search_bmu_soa_sse2_generic, map->total_weights);
+    break;
+#endif
+  default:
+    kernel = select_search_kernel(soa_scalar_kernels, search_bmu_soa_scalar_generic, map->total_weights);
+    break;
+  }
+  kernel(map, query, first, last, best);
+}
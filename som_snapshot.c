@@ -0,0 +1,78 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Codebook snapshots published by a training thread for a reader on another thread (the viewer). The
+             three snapshots of a triple buffer are exchanged with atomic swaps of their indexes: the trainer never
+             waits for the reader and the reader always gets a whole codebook of a single iteration.
+
+Notes: A snapshot is only taken once the reader got the previous one, so the copies follow the pace of the reader
+       (its frame rate) and not the one of the training.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "som.h"
+
+// Every snapshot starts as a copy of the map
+bool allocate_codebook_snapshots(CodebookSnapshots *snapshots, SOMMap *map)
+{
+  memset(snapshots, 0, sizeof(CodebookSnapshots));
+  for (int i = 0; i < 3; i++)
+  {
+    SOMMap *snapshot_map = &snapshots->snapshots[i].map;
+    if (!allocate_som_map(snapshot_map, map->width, map->height, map->total_weights, map->layout))
+    {
+      free_codebook_snapshots(snapshots);
+      return false;
+    }
+    snapshot_map->simd_level = map->simd_level;
+    memcpy(snapshot_map->weights, map->weights, codebook_size(map));
+  }
+
+  snapshots->front = 0;
+  snapshots->middle = 1;
+  snapshots->back = 2;
+  return true;
+}
+
+void free_codebook_snapshots(CodebookSnapshots *snapshots)
+{
+  for (int i = 0; i < 3; i++)
+    if (snapshots->snapshots[i].map.weights != NULL)
+      free_som_map(&snapshots->snapshots[i].map);
+}
+
+// Copies the map of the trainer to the back snapshot and makes it the middle one. Unless 'force' is set, nothing is
+// done while the reader has not taken the last snapshot. Returns true if a snapshot was published.
+bool publish_codebook_snapshot(CodebookSnapshots *snapshots, Trainer *trainer, bool force)
+{
+  if (!force && (__atomic_load_n(&snapshots->middle, __ATOMIC_ACQUIRE) & SNAPSHOT_FRESH))
+    return false;
+
+  CodebookSnapshot *snapshot = &snapshots->snapshots[snapshots->back];
+  memcpy(snapshot->map.weights, trainer->map->weights, codebook_size(trainer->map));
+  snapshot->epoch = trainer->epoch;
+  snapshot->iteration = trainer->iteration;
+  snapshot->iterations_per_epoch = trainer->iterations_per_epoch;
+  snapshot->radius = trainer->radius;
+  snapshot->learning_rule = trainer->learning_rule;
+
+  snapshots->back = __atomic_exchange_n(&snapshots->middle, snapshots->back | SNAPSHOT_FRESH, __ATOMIC_ACQ_REL) & ~SNAPSHOT_FRESH;
+  snapshots->published++;
+  return true;
+}
+
+// The newest snapshot, valid until the next call. 'fresh' tells if it was published after the previous call.
+CodebookSnapshot *acquire_codebook_snapshot(CodebookSnapshots *snapshots, bool *fresh)
+{
+  *fresh = (__atomic_load_n(&snapshots->middle, __ATOMIC_ACQUIRE) & SNAPSHOT_FRESH) != 0;
+  if (*fresh)
+    snapshots->front = __atomic_exchange_n(&snapshots->middle, snapshots->front, __ATOMIC_ACQ_REL) & ~SNAPSHOT_FRESH;
+
+  return &snapshots->snapshots[snapshots->front];
+}
@@ -0,0 +1,423 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Hyperparameter sweep of the SOM engine. Loads the dataset once and trains a map for every combination
+             of the values given for some configuration keys, many of them at the same time, then prints the
+             quality of every map and the time it took in a summary table, also written to a CSV file.
+
+Usage:
+gcc -std=c99 -Wno-unused-result -O3 som_sweep.c som_engine.c som_simd.c som_threads.c som_batch.c som_warm_search.c som_kdtree.c som_map_file.c som_csv.c som_dataset_cache.c som_stream.c som_telemetry.c som_snapshot.c som_config.c som_quantized.c som_convergence.c -o som-sweep -lm -pthread
+./som-sweep [-c config] [-C] [-D key=value] [-e epochs] [-G key=v1,v2,...] [-j jobs] [-o results.csv] [-r seed] [dataset.csv|dataset.csv.cache]
+
+Notes: Every -G adds a key to the grid, e.g. -G map_width=50,100 -G radius=25,50,100 trains 6 maps. The keys are
+       the ones of som_config.c and the values not in the grid are the ones of -c and -D. Each training runs on a
+       single thread and the trainings are scheduled with a work-stealing pool of -j threads, the most expensive
+       ones first. The sample components are shared by all the trainings, each one only has a copy of the sample
+       list (the BMUs). Every training starts from the same seed, so maps of the same size start from the same
+       weights and see the same samples, and the differences of the results come from the parameters.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "som.h"
+
+#define SWEEP_MAX_KEYS 8
+#define SWEEP_MAX_VALUES 32 // Values of a single key
+#define SWEEP_MAX_RUNS 4096
+#define SWEEP_LABEL_SIZE 256
+
+// A key of the grid and the values it takes
+typedef struct SweepKey
+{
+  char text[CONFIG_LINE_SIZE]; // The key=v1,v2,... assignment, split in place
+  char *key;
+  char *values[SWEEP_MAX_VALUES];
+  int total_values;
+} SweepKey;
+
+typedef struct SweepRun
+{
+  SOMConfig config;
+  char label[SWEEP_LABEL_SIZE]; // The values of the grid keys
+  double estimated_cost;
+  bool trained;
+  int epochs;
+  long iterations;
+  int shortened_epochs; // Only with a convergence threshold
+  double quantization_error;
+  double topographic_error;
+  double training_seconds;
+  double seconds; // Training and evaluation
+} SweepRun;
+
+typedef struct Sweep
+{
+  DatasetInfo *dataset; // Read only, shared by all the runs
+  SweepRun *runs;
+  int total_runs;
+  int finished_runs;
+  unsigned int seed;
+} Sweep;
+
+void print_usage(const char *program)
+{
+  printf("Usage: %s [options] [dataset.csv]\n", program);
+  printf("  -c, --config FILE  read the base configuration from the 'key = value' lines of FILE\n");
+  printf("  -C, --no-cache     always parse the CSV file, without reading or writing its binary cache\n");
+  printf("  -D, --set K=V      set the configuration key K for every training\n");
+  printf("  -e, --epochs N     total training epochs of every training (default %d)\n", TOTAL_EPOCHS);
+  printf("  -G, --grid K=V,..  train with each of the comma separated values of the configuration key K, up to %d keys\n", SWEEP_MAX_KEYS);
+  printf("  -j, --jobs N       trainings run at the same time (default: CPU cores)\n");
+  printf("  -o, --output FILE  summary file (default sweep-results.csv)\n");
+  printf("  -r, --seed N       seed of the map initialization and the sample order (default: the current time)\n");
+  printf("  -h, --help         show this help\n");
+}
+
+double elapsed_seconds(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Splits a key=v1,v2,... assignment and checks every value with a scratch configuration
+bool parse_sweep_key(const char *assignment, SweepKey *sweep_key)
+{
+  SOMConfig scratch;
+  char *equals, *value;
+
+  if ((snprintf(sweep_key->text, sizeof(sweep_key->text), "%s", assignment) >= (int)sizeof(sweep_key->text)) || ((equals = strchr(sweep_key->text, '=')) == NULL))
+  {
+    printf("Invalid grid key '%s', expected key=value1,value2,...\n", assignment);
+    return false;
+  }
+  *equals = '\0';
+  sweep_key->key = sweep_key->text;
+  if (strcmp(sweep_key->key, "dataset") == 0)
+  {
+    printf("The dataset is shared by the whole sweep, it can not be a grid key\n");
+    return false;
+  }
+
+  default_som_config(&scratch);
+  sweep_key->total_values = 0;
+  for (value = strtok(equals + 1, ","); value != NULL; value = strtok(NULL, ","))
+  {
+    if (sweep_key->total_values == SWEEP_MAX_VALUES)
+    {
+      printf("The grid key '%s' has more than %d values\n", sweep_key->key, SWEEP_MAX_VALUES);
+      return false;
+    }
+    if (!set_som_config_value(&scratch, sweep_key->key, value))
+      return false;
+    sweep_key->values[sweep_key->total_values++] = value;
+  }
+
+  if (sweep_key->total_values == 0)
+  {
+    printf("The grid key '%s' has no values\n", sweep_key->key);
+    return false;
+  }
+  return true;
+}
+
+// Neuron visits of a training: a BMU search over the whole map and a neighborhood update per iteration. Only
+// used to start the longest trainings first.
+double estimate_training_cost(SOMConfig *config, int total_samples)
+{
+  TrainingParams *params = &config->params;
+  double neurons = (double)config->map_width * config->map_height;
+  double radius = params->initial_radius;
+  double iterations = params->initial_iterations_per_epoch;
+  double cost = 0.0;
+
+  for (int epoch = 0; epoch < params->total_epochs; epoch++)
+  {
+    if (params->mode == TRAINING_BATCH)
+      cost += BATCH_PASSES_PER_EPOCH * (double)total_samples * 2.0 * neurons;
+    else
+      cost += iterations * (neurons + min(neurons, M_PI * radius * radius));
+    radius = max(1.0, radius - radius / 3.0);
+    iterations *= 2.0;
+  }
+  return cost;
+}
+
+// The configuration of every combination of the grid values, the last key changing first
+bool build_sweep_runs(Sweep *sweep, SOMConfig *base, SweepKey *keys, int total_keys)
+{
+  sweep->total_runs = 1;
+  for (int k = 0; k < total_keys; k++)
+  {
+    sweep->total_runs *= keys[k].total_values;
+    if (sweep->total_runs > SWEEP_MAX_RUNS)
+    {
+      printf("The grid has more than %d combinations\n", SWEEP_MAX_RUNS);
+      return false;
+    }
+  }
+
+  sweep->runs = (SweepRun *)calloc(sweep->total_runs, sizeof(SweepRun));
+  if (sweep->runs == NULL)
+  {
+    printf("Could not allocate the %d runs of the sweep\n", sweep->total_runs);
+    return false;
+  }
+
+  for (int r = 0; r < sweep->total_runs; r++)
+  {
+    SweepRun *run = &sweep->runs[r];
+    int value_index[SWEEP_MAX_KEYS];
+    int length = 0;
+
+    for (int k = total_keys - 1, index = r; k >= 0; index /= keys[k].total_values, k--)
+      value_index[k] = index % keys[k].total_values;
+
+    run->config = *base;
+    snprintf(run->label, sizeof(run->label), "base");
+    for (int k = 0; k < total_keys; k++)
+    {
+      set_som_config_value(&run->config, keys[k].key, keys[k].values[value_index[k]]);
+      if (length < (int)sizeof(run->label))
+        length += snprintf(run->label + length, sizeof(run->label) - length, "%s%s=%s", k > 0 ? " " : "", keys[k].key, keys[k].values[value_index[k]]);
+    }
+    run->estimated_cost = estimate_training_cost(&run->config, sweep->dataset->total_dataset_samples);
+  }
+  return true;
+}
+
+// Trains and evaluates the map of a run on the calling thread. The samples are a copy of the dataset ones, so the
+// BMUs written by the training and the inference stay private to the run.
+void run_sweep_task(void *context, int task, int total_tasks)
+{
+  Sweep *sweep = (Sweep *)context;
+  SweepRun *run = &sweep->runs[task];
+  DatasetInfo info = *sweep->dataset;
+  unsigned int random_state = sweep->seed;
+  SOMMap map;
+  Trainer trainer;
+  ConvergenceMonitor monitor;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  info.samples = (Sample *)malloc(sizeof(Sample) * info.total_dataset_samples);
+  if ((info.samples == NULL) || !allocate_som_map(&map, run->config.map_width, run->config.map_height, info.total_components - 1, DEFAULT_CODEBOOK_LAYOUT))
+  {
+    printf("Could not allocate the map of the run '%s'\n", run->label);
+    free(info.samples);
+    return;
+  }
+  memcpy(info.samples, sweep->dataset->samples, sizeof(Sample) * info.total_dataset_samples);
+  randomize_som_weights(&map, &random_state);
+
+  initialize_trainer(&trainer, &map, &info, &run->config.params);
+  trainer.random_state = &random_state;
+  run->trained = (run->config.params.convergence_threshold <= 0.0) || start_convergence_monitor(&monitor, &trainer);
+  while (run->trained && begin_next_epoch(&trainer))
+  {
+    while (train_next_iteration(&trainer))
+      ;
+    run->iterations += trainer.iteration;
+  }
+  run->epochs = trainer.epoch;
+  if (trainer.monitor != NULL)
+  {
+    stop_convergence_monitor(&monitor);
+    run->shortened_epochs = monitor.shortened_epochs;
+  }
+  run->training_seconds = elapsed_seconds(&start);
+
+  if (run->trained)
+  {
+    infer_samples(&map, &info, NULL);
+    run->quantization_error = quantization_error(&map, &info);
+    run->topographic_error = topographic_error(&map, &info);
+  }
+  run->seconds = elapsed_seconds(&start);
+
+  free_trainer(&trainer);
+  free_som_map(&map);
+  free(info.samples);
+
+  int finished = __atomic_add_fetch(&sweep->finished_runs, 1, __ATOMIC_RELAXED);
+  printf("[%d/%d] %s | quantization error: %f | topographic error: %.2f%% | %.2fs\n", finished, total_tasks, run->label,
+         run->quantization_error, 100.0 * run->topographic_error, run->seconds);
+  fflush(stdout);
+}
+
+void print_sweep_summary(Sweep *sweep)
+{
+  int best = -1;
+
+  for (int r = 0; r < sweep->total_runs; r++)
+    if (sweep->runs[r].trained && ((best < 0) || (sweep->runs[r].quantization_error < sweep->runs[best].quantization_error)))
+      best = r;
+
+  printf("%4s %-40s %9s %7s %11s %10s %10s %9s %9s\n", "RUN", "CONFIGURATION", "MAP", "EPOCHS", "ITERATIONS", "QE", "TE", "TRAIN S", "TOTAL S");
+  for (int r = 0; r < sweep->total_runs; r++)
+  {
+    SweepRun *run = &sweep->runs[r];
+    char map_size[32];
+
+    snprintf(map_size, sizeof(map_size), "%dx%d", run->config.map_width, run->config.map_height);
+    if (!run->trained)
+      printf("%4d %-40s %9s %7s\n", r + 1, run->label, map_size, "failed");
+    else
+      printf("%4d %-40s %9s %7d %11ld %10.6f %9.2f%% %9.2f %9.2f%s\n", r + 1, run->label, map_size, run->epochs, run->iterations, run->quantization_error,
+             100.0 * run->topographic_error, run->training_seconds, run->seconds, r == best ? " *" : "");
+  }
+  if (best >= 0)
+    printf("* lowest quantization error\n");
+}
+
+bool write_sweep_results(Sweep *sweep, const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+
+  if (fp == NULL)
+  {
+    printf("Could not open file %s\n", filename);
+    return false;
+  }
+
+  fprintf(fp, "run;configuration;map_width;map_height;epochs;iterations;shortened_epochs;trained;quantization_error;topographic_error;training_seconds;seconds\n");
+  for (int r = 0; r < sweep->total_runs; r++)
+  {
+    SweepRun *run = &sweep->runs[r];
+    fprintf(fp, "%d;%s;%d;%d;%d;%ld;%d;%d;%.6f;%.6f;%.4f;%.4f\n", r + 1, run->label, run->config.map_width, run->config.map_height, run->epochs,
+            run->iterations, run->shortened_epochs, run->trained, run->quantization_error, run->topographic_error, run->training_seconds, run->seconds);
+  }
+
+  if (fclose(fp) != 0)
+  {
+    printf("Could not write file %s\n", filename);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+      {"config", required_argument, NULL, 'c'},
+      {"no-cache", no_argument, NULL, 'C'},
+      {"set", required_argument, NULL, 'D'},
+      {"epochs", required_argument, NULL, 'e'},
+      {"grid", required_argument, NULL, 'G'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"output", required_argument, NULL, 'o'},
+      {"seed", required_argument, NULL, 'r'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0}};
+
+  const char *output_file = "sweep-results.csv";
+  SweepKey keys[SWEEP_MAX_KEYS];
+  int total_keys = 0;
+  int total_jobs = get_total_cpu_cores();
+  bool use_dataset_cache = true;
+  unsigned int seed = (unsigned int)time(NULL);
+  SOMConfig config;
+  default_som_config(&config);
+
+  int option;
+  while ((option = getopt_long(argc, argv, "c:CD:e:G:j:o:r:h", long_options, NULL)) != -1)
+  {
+    switch (option)
+    {
+    case 'c':
+      if (!load_som_config(&config, optarg))
+        return 1;
+      break;
+    case 'C':
+      use_dataset_cache = false;
+      break;
+    case 'D':
+      if (!set_som_config_assignment(&config, optarg))
+        return 1;
+      break;
+    case 'e':
+      if (!set_som_config_value(&config, "epochs", optarg))
+        return 1;
+      break;
+    case 'G':
+      if (total_keys == SWEEP_MAX_KEYS)
+      {
+        printf("The grid has more than %d keys\n", SWEEP_MAX_KEYS);
+        return 1;
+      }
+      if (!parse_sweep_key(optarg, &keys[total_keys]))
+        return 1;
+      total_keys++;
+      break;
+    case 'j':
+      total_jobs = atoi(optarg);
+      break;
+    case 'o':
+      output_file = optarg;
+      break;
+    case 'r':
+      seed = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if ((optind < argc) && !set_som_config_value(&config, "dataset", argv[optind]))
+    return 1;
+
+  DatasetInfo info = {0};
+  Sweep sweep = {.dataset = &info, .runs = NULL, .total_runs = 0, .finished_runs = 0, .seed = seed};
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (!load_dataset(&info, config.dataset_file, use_dataset_cache))
+    return 1;
+  printf("Dataset %s: %d samples of %d fields loaded in %.2fs\n", config.dataset_file, info.total_dataset_samples, info.total_components, elapsed_seconds(&start));
+  if (!build_sweep_runs(&sweep, &config, keys, total_keys))
+  {
+    free_dataset(&info);
+    return 1;
+  }
+
+  print_som_config(&config);
+  printf("Sweep of %d trainings | jobs: %d | BMU search kernel: %s | weights: %s | seed: %u\n", sweep.total_runs, max(1, min(total_jobs, sweep.total_runs)),
+         simd_level_name(detect_simd_level()), SOM_REAL_NAME, seed);
+
+  double costs[sweep.total_runs];
+  for (int r = 0; r < sweep.total_runs; r++)
+    costs[r] = sweep.runs[r].estimated_cost;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long steals = run_work_stealing(total_jobs, run_sweep_task, &sweep, costs, sweep.total_runs);
+  double seconds = elapsed_seconds(&start);
+
+  double run_seconds = 0.0;
+  bool trained = true;
+  for (int r = 0; r < sweep.total_runs; r++)
+  {
+    run_seconds += sweep.runs[r].seconds;
+    trained = trained && sweep.runs[r].trained;
+  }
+
+  print_sweep_summary(&sweep);
+  printf("%d trainings in %.2fs | the times of the runs add up to %.2fs | %ld stolen\n", sweep.total_runs, seconds, run_seconds, steals);
+  bool written = write_sweep_results(&sweep, output_file);
+  if (written)
+    printf("Sweep results written to %s\n", output_file);
+
+  free(sweep.runs);
+  free_dataset(&info);
+  return (trained && written) ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Training telemetry. The trainer and the viewer time their phases (BMU search, neighborhood update,
+             rendering and event handling) with two clock reads each, and the telemetry writes the sums of every
+             epoch, and optionally of every iteration, to a JSON lines or CSV log together with the neurons updated,
+             the radius and the learning rule.
+
+Notes: Nothing is measured when the trainer has no telemetry. Building with -DSOM_TELEMETRY=0 removes the phase
+       timers from the trainer and open_telemetry fails.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "som.h"
+
+static const char *phase_names[TOTAL_TELEMETRY_PHASES] = {"bmu_search", "neighborhood_update", "render", "events"};
+
+static double seconds_between(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Files named *.csv are written as CSV, any other as JSON lines
+bool open_telemetry(Telemetry *telemetry, const char *filename, bool log_iterations)
+{
+  size_t length = strlen(filename);
+
+  memset(telemetry, 0, sizeof(Telemetry));
+  if (!SOM_TELEMETRY)
+  {
+    printf("Telemetry was compiled out (SOM_TELEMETRY=0), %s not written\n", filename);
+    return false;
+  }
+
+  telemetry->log = fopen(filename, "w");
+  if (telemetry->log == NULL)
+  {
+    printf("Could not open file %s\n", filename);
+    return false;
+  }
+
+  telemetry->format = ((length >= 4) && (strcmp(filename + length - 4, ".csv") == 0)) ? TELEMETRY_CSV : TELEMETRY_JSONL;
+  telemetry->log_iterations = log_iterations;
+  telemetry->iteration_record = "iteration";
+  if (telemetry->format == TELEMETRY_CSV)
+  {
+    fprintf(telemetry->log, "type;epoch;iteration;iterations;radius;learning_rule;wall_seconds");
+    for (int p = 0; p < TOTAL_TELEMETRY_PHASES; p++)
+      fprintf(telemetry->log, ";%s_seconds", phase_names[p]);
+    fprintf(telemetry->log, ";other_seconds;neurons_touched\n");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &telemetry->total.start);
+  telemetry->iteration.start = telemetry->epoch.start = telemetry->total.start;
+  return true;
+}
+
+// The time not spent in any phase is reported as 'other' (sampling, stream waits, the loops themselves)
+static void write_telemetry_record(Telemetry *telemetry, const char *type, const TelemetryCounters *counters, double wall_seconds)
+{
+  double other_seconds = wall_seconds;
+  for (int p = 0; p < TOTAL_TELEMETRY_PHASES; p++)
+    other_seconds -= counters->seconds[p];
+
+  if (telemetry->format == TELEMETRY_CSV)
+  {
+    fprintf(telemetry->log, "%s;%d;%d;%ld;%f;%f;%.9f", type, counters->epoch, counters->iteration, counters->iterations, counters->radius,
+            counters->learning_rule, wall_seconds);
+    for (int p = 0; p < TOTAL_TELEMETRY_PHASES; p++)
+      fprintf(telemetry->log, ";%.9f", counters->seconds[p]);
+    fprintf(telemetry->log, ";%.9f;%ld\n", other_seconds, counters->neurons_touched);
+  }
+  else
+  {
+    fprintf(telemetry->log, "{\"type\":\"%s\",\"epoch\":%d,\"iteration\":%d,\"iterations\":%ld,\"radius\":%f,\"learning_rule\":%f,\"wall_seconds\":%.9f",
+            type, counters->epoch, counters->iteration, counters->iterations, counters->radius, counters->learning_rule, wall_seconds);
+    for (int p = 0; p < TOTAL_TELEMETRY_PHASES; p++)
+      fprintf(telemetry->log, ",\"%s_seconds\":%.9f", phase_names[p], counters->seconds[p]);
+    fprintf(telemetry->log, ",\"other_seconds\":%.9f,\"neurons_touched\":%ld}\n", other_seconds, counters->neurons_touched);
+  }
+}
+
+static void add_telemetry_counters(TelemetryCounters *total, const TelemetryCounters *counters)
+{
+  for (int p = 0; p < TOTAL_TELEMETRY_PHASES; p++)
+    total->seconds[p] += counters->seconds[p];
+  total->iterations += counters->iterations;
+  total->neurons_touched += counters->neurons_touched;
+  total->iteration = counters->iteration;
+}
+
+// Closes the pending iteration into its epoch. Phases measured before the first iteration of an epoch are added
+// to the epoch without a record of their own.
+static void flush_telemetry_iteration(Telemetry *telemetry, const struct timespec *now)
+{
+  TelemetryCounters *iteration = &telemetry->iteration;
+
+  if (telemetry->log_iterations && (iteration->iterations > 0))
+    write_telemetry_record(telemetry, telemetry->iteration_record, iteration, seconds_between(&iteration->start, now));
+  add_telemetry_counters(&telemetry->epoch, iteration);
+
+  memset(iteration->seconds, 0, sizeof(iteration->seconds));
+  iteration->iterations = 0;
+  iteration->neurons_touched = 0;
+  iteration->start = *now;
+}
+
+static void flush_telemetry_epoch(Telemetry *telemetry, const struct timespec *now)
+{
+  TelemetryCounters *epoch = &telemetry->epoch;
+
+  flush_telemetry_iteration(telemetry, now);
+  if (epoch->iterations > 0)
+    write_telemetry_record(telemetry, "epoch", epoch, seconds_between(&epoch->start, now));
+  add_telemetry_counters(&telemetry->total, epoch);
+
+  memset(epoch->seconds, 0, sizeof(epoch->seconds));
+  epoch->iterations = 0;
+  epoch->neurons_touched = 0;
+  epoch->start = *now;
+}
+
+#if SOM_TELEMETRY
+void begin_telemetry_epoch(Telemetry *telemetry, int epoch, double radius, double learning_rule)
+{
+  struct timespec now;
+
+  if (telemetry == NULL)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  flush_telemetry_epoch(telemetry, &now);
+  telemetry->epoch.epoch = telemetry->iteration.epoch = epoch;
+  telemetry->epoch.radius = telemetry->iteration.radius = radius;
+  telemetry->epoch.learning_rule = telemetry->iteration.learning_rule = learning_rule;
+}
+
+void begin_telemetry_iteration(Telemetry *telemetry, int iteration)
+{
+  struct timespec now;
+
+  if (telemetry == NULL)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  flush_telemetry_iteration(telemetry, &now);
+  telemetry->iteration.iteration = iteration;
+  telemetry->iteration.iterations = 1;
+}
+#endif
+
+// Writes the records still pending. The totals stay available to print_telemetry_summary.
+void close_telemetry(Telemetry *telemetry)
+{
+  struct timespec now;
+
+  if (telemetry->log == NULL)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  flush_telemetry_epoch(telemetry, &now);
+  telemetry->total_wall_seconds = seconds_between(&telemetry->total.start, &now);
+  if (fclose(telemetry->log) != 0)
+    printf("Could not write the telemetry log\n");
+  telemetry->log = NULL;
+}
+
+void print_telemetry_summary(Telemetry *telemetry)
+{
+  double wall_seconds = telemetry->total_wall_seconds;
+  double other_seconds = wall_seconds;
+
+  if (wall_seconds <= 0.0)
+    return;
+
+  printf("Telemetry: %ld %ss in %.2fs |", telemetry->total.iterations, telemetry->iteration_record, wall_seconds);
+  for (int p = 0; p < TOTAL_TELEMETRY_PHASES; p++)
+  {
+    other_seconds -= telemetry->total.seconds[p];
+    if (telemetry->total.seconds[p] > 0.0)
+      printf(" %s: %.2fs (%.1f%%) |", phase_names[p], telemetry->total.seconds[p], 100.0 * telemetry->total.seconds[p] / wall_seconds);
+  }
+  printf(" other: %.2fs (%.1f%%) | %ld neuron updates\n", other_seconds, 100.0 * other_seconds / wall_seconds, telemetry->total.neurons_touched);
+}
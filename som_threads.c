@@ -0,0 +1,334 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Persistent thread pool used by the engine to split the BMU search, the inference pass and the
+             neighborhood updates across cores. Workers are created once and then sleep between parallel runs,
+             so dispatching a training iteration does not spawn any thread. Long tasks of uneven length (the
+             trainings of a parameter sweep) are run by a work-stealing scheduler instead.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "som.h"
+
+int get_total_cpu_cores(void)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (int)cores : 1;
+}
+
+// Claims task indexes until none is left. Run by the workers and by the calling thread.
+static void run_pending_tasks(ThreadPool *pool)
+{
+  int task;
+  while ((task = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED)) < pool->total_tasks)
+    pool->task(pool->context, task, pool->total_tasks);
+}
+
+static void *thread_pool_worker(void *arg)
+{
+  ThreadPool *pool = (ThreadPool *)arg;
+  unsigned long seen_generation = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (true)
+  {
+    while ((pool->generation == seen_generation) && !pool->shutdown)
+      pthread_cond_wait(&pool->work_ready, &pool->mutex);
+
+    if (pool->shutdown)
+      break;
+
+    seen_generation = pool->generation;
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_pending_tasks(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->busy_workers == 0)
+      pthread_cond_signal(&pool->work_done);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+// 'total_threads' includes the calling thread, so a pool of 1 thread runs everything inline. A pool that can not
+// be created is left with a single thread.
+bool create_thread_pool(ThreadPool *pool, int total_threads)
+{
+  pool->total_threads = max(1, total_threads);
+  pool->generation = 0;
+  pool->busy_workers = 0;
+  pool->shutdown = false;
+  pool->threads = NULL;
+
+  if (pool->total_threads == 1)
+    return true;
+
+  pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * (pool->total_threads - 1));
+  if (pool->threads == NULL)
+  {
+    printf("Could not allocate the threads of the pool\n");
+    pool->total_threads = 1;
+    return false;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+
+  for (int i = 0; i < pool->total_threads - 1; i++)
+    if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0)
+    {
+      printf("Could not create thread %d of the pool\n", i);
+      pool->total_threads = i + 1;
+      destroy_thread_pool(pool);
+      return false;
+    }
+
+  return true;
+}
+
+void destroy_thread_pool(ThreadPool *pool)
+{
+  if (pool->threads == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 0; i < pool->total_threads - 1; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_cond_destroy(&pool->work_done);
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->total_threads = 1;
+}
+
+// Runs task(context, 0..total_tasks-1) across the pool and returns when every task has finished. Tasks are
+// claimed dynamically, so callers that need deterministic results must combine them by task index.
+void run_parallel(ThreadPool *pool, ParallelTask task, void *context, int total_tasks)
+{
+  if ((pool == NULL) || (pool->total_threads == 1) || (total_tasks == 1))
+  {
+    for (int i = 0; i < total_tasks; i++)
+      task(context, i, total_tasks);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->task = task;
+  pool->context = context;
+  pool->total_tasks = total_tasks;
+  pool->next_task = 0;
+  pool->busy_workers = pool->total_threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->mutex);
+
+  run_pending_tasks(pool);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->busy_workers > 0)
+    pthread_cond_wait(&pool->work_done, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+int get_pool_threads(ThreadPool *pool)
+{
+  return pool == NULL ? 1 : pool->total_threads;
+}
+
+typedef struct TaskCost
+{
+  double cost;
+  int task;
+} TaskCost;
+
+// Tasks dealt to a worker of run_work_stealing, from the most to the least expensive. The worker and the thieves
+// both take them from the front, the most expensive task left.
+typedef struct WorkDeque
+{
+  TaskCost *tasks;
+  int front;
+  int back;
+  pthread_mutex_t mutex;
+} WorkDeque;
+
+typedef struct WorkStealing
+{
+  WorkDeque *deques;
+  int total_threads;
+  ParallelTask task;
+  void *context;
+  int total_tasks;
+  long steals;
+} WorkStealing;
+
+typedef struct WorkStealingWorker
+{
+  WorkStealing *work;
+  int index;
+  pthread_t thread;
+} WorkStealingWorker;
+
+static int compare_task_costs(const void *a, const void *b)
+{
+  const TaskCost *first = (const TaskCost *)a, *second = (const TaskCost *)b;
+
+  if (first->cost != second->cost)
+    return first->cost > second->cost ? -1 : 1;
+  return first->task - second->task;
+}
+
+static bool take_task(WorkDeque *deque, int *task)
+{
+  bool taken;
+
+  pthread_mutex_lock(&deque->mutex);
+  taken = (deque->front < deque->back);
+  if (taken)
+    *task = deque->tasks[deque->front++].task;
+  pthread_mutex_unlock(&deque->mutex);
+  return taken;
+}
+
+// Cost of the next task of the deque, or -1 if it is empty
+static double next_task_cost(WorkDeque *deque)
+{
+  double cost;
+
+  pthread_mutex_lock(&deque->mutex);
+  cost = (deque->front < deque->back) ? deque->tasks[deque->front].cost : -1.0;
+  pthread_mutex_unlock(&deque->mutex);
+  return cost;
+}
+
+// Takes the most expensive task waiting in the deques of the other workers. Returns false once they are all empty.
+static bool steal_task(WorkStealing *work, int thief, int *task)
+{
+  while (true)
+  {
+    int victim = -1;
+    double victim_cost = -1.0;
+
+    for (int i = 1; i < work->total_threads; i++)
+    {
+      int w = (thief + i) % work->total_threads;
+      double cost = next_task_cost(&work->deques[w]);
+      if (cost > victim_cost)
+      {
+        victim = w;
+        victim_cost = cost;
+      }
+    }
+    if (victim < 0)
+      return false;
+
+    // Another thief may have emptied the deque in the meantime, then look again
+    if (take_task(&work->deques[victim], task))
+    {
+      __atomic_fetch_add(&work->steals, 1, __ATOMIC_RELAXED);
+      return true;
+    }
+  }
+}
+
+// Runs the own tasks, then steals from the other workers until every deque is empty. Tasks do not add tasks, so
+// empty deques stay empty.
+static void *work_stealing_worker(void *arg)
+{
+  WorkStealingWorker *worker = (WorkStealingWorker *)arg;
+  WorkStealing *work = worker->work;
+  int task;
+
+  while (true)
+  {
+    if (!take_task(&work->deques[worker->index], &task) && !steal_task(work, worker->index, &task))
+      break;
+
+    work->task(work->context, task, work->total_tasks);
+  }
+
+  return NULL;
+}
+
+// Runs task(context, 0..total_tasks-1) on 'total_threads' threads (including the calling one) for tasks of very
+// different lengths, such as whole trainings. The tasks are dealt round-robin from the most expensive 'costs'
+// (NULL if unknown) to the cheapest, so every worker starts with its longest ones, and a worker that runs out of
+// tasks steals the most expensive one still waiting in another deque, so that a long task does not start last on
+// a loaded worker. Returns the number of tasks stolen.
+long run_work_stealing(int total_threads, ParallelTask task, void *context, const double *costs, int total_tasks)
+{
+  WorkStealing work = {.total_threads = max(1, min(total_threads, total_tasks)), .task = task, .context = context, .total_tasks = total_tasks, .steals = 0};
+  TaskCost *order = (TaskCost *)malloc(sizeof(TaskCost) * max(total_tasks, 1));
+  TaskCost *tasks = (TaskCost *)malloc(sizeof(TaskCost) * max(total_tasks, 1));
+  WorkStealingWorker *workers = (WorkStealingWorker *)malloc(sizeof(WorkStealingWorker) * work.total_threads);
+
+  work.deques = (WorkDeque *)malloc(sizeof(WorkDeque) * work.total_threads);
+  if ((order == NULL) || (tasks == NULL) || (workers == NULL) || (work.deques == NULL))
+  {
+    // Not enough memory to schedule, run in order on the calling thread
+    for (int i = 0; i < total_tasks; i++)
+      task(context, i, total_tasks);
+    free(order);
+    free(tasks);
+    free(workers);
+    free(work.deques);
+    return 0;
+  }
+
+  for (int i = 0; i < total_tasks; i++)
+    order[i] = (TaskCost){.cost = (costs != NULL) ? costs[i] : 0.0, .task = i};
+  qsort(order, total_tasks, sizeof(TaskCost), compare_task_costs);
+
+  // The deque of worker w is the slice of 'tasks' starting at w * tasks_per_worker
+  int tasks_per_worker = (total_tasks + work.total_threads - 1) / work.total_threads;
+  for (int w = 0; w < work.total_threads; w++)
+  {
+    work.deques[w].tasks = &tasks[w * tasks_per_worker];
+    work.deques[w].front = 0;
+    work.deques[w].back = 0;
+    pthread_mutex_init(&work.deques[w].mutex, NULL);
+  }
+  for (int i = 0; i < total_tasks; i++)
+  {
+    WorkDeque *deque = &work.deques[i % work.total_threads];
+    deque->tasks[deque->back++] = order[i];
+  }
+
+  int started = 1;
+  for (int w = 1; w < work.total_threads; w++, started++)
+  {
+    workers[w] = (WorkStealingWorker){.work = &work, .index = w};
+    if (pthread_create(&workers[w].thread, NULL, work_stealing_worker, &workers[w]) != 0)
+    {
+      // The tasks of the missing workers are stolen by the running ones
+      printf("Could not create thread %d of the work-stealing pool\n", w);
+      break;
+    }
+  }
+  workers[0] = (WorkStealingWorker){.work = &work, .index = 0};
+  work_stealing_worker(&workers[0]);
+
+  for (int w = 1; w < started; w++)
+    pthread_join(workers[w].thread, NULL);
+  for (int w = 0; w < work.total_threads; w++)
+    pthread_mutex_destroy(&work.deques[w].mutex);
+  free(order);
+  free(tasks);
+  free(workers);
+  free(work.deques);
+  return work.steals;
+}
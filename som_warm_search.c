@@ -0,0 +1,252 @@
+/*****************************************************************
+
+Author: Albert Nadal Garriga
+Date: 23/01/2022
+Description: Warm-started BMU search. The map is split in square tiles of neurons and every tile keeps the bounding
+             box of its weights. The search scans first the tile of the BMU cached in the sample, and then only
+             the tiles whose box is not farther than the best neuron found so far. When the boxes cannot discard
+             most of the map, it falls back to the full scan of search_bmu.
+
+Notes: The distance from a query to the box of a tile is computed exactly in double and shrunk by
+       DISTANCE_ROUNDING_SLACK, so it is never greater than the distance to any of its neurons as the kernels
+       accumulate it in som_real, which in the float build (SOM_FLOAT32) can round below the exact distance. The
+       result is exactly the neuron returned by search_bmu, ties included. The online training widens the boxes
+       after every update instead of rebuilding them: an updated weight lies between its old value and the
+       sample, up to a few rounding errors of som_real covered by TILE_BOUNDS_MARGIN.
+
+*****************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <stdbool.h>
+#include <string.h>
+#include "som.h"
+
+// Relative widening of the boxes after an online update, above the rounding error of scale_neurons_run in som_real
+#define TILE_BOUNDS_MARGIN (16 * SOM_REAL_EPSILON)
+
+void free_tile_bounds(TileBounds *bounds)
+{
+  free(bounds->lower);
+  free(bounds->candidates);
+  bounds->lower = bounds->upper = NULL;
+  bounds->candidates = NULL;
+}
+
+// 'total_searchers' is the number of searches that can run at the same time, each one with a candidates buffer
+bool allocate_tile_bounds(TileBounds *bounds, SOMMap *map, int tile_size, int total_searchers)
+{
+  bounds->tile_size = tile_size;
+  bounds->tiles_x = (map->width + tile_size - 1) / tile_size;
+  bounds->tiles_y = (map->height + tile_size - 1) / tile_size;
+  bounds->total_tiles = bounds->tiles_x * bounds->tiles_y;
+  bounds->total_weights = map->total_weights;
+  bounds->total_searchers = max(1, total_searchers);
+
+  // A single block holds both bounds
+  bounds->lower = (double *)malloc(sizeof(double) * 2 * bounds->total_tiles * map->total_weights);
+  bounds->candidates = (TileCandidate *)malloc(sizeof(TileCandidate) * bounds->total_tiles * bounds->total_searchers);
+  if ((bounds->lower == NULL) || (bounds->candidates == NULL))
+  {
+    printf("Could not allocate the tile bounds of the map\n");
+    free_tile_bounds(bounds);
+    return false;
+  }
+
+  bounds->upper = bounds->lower + (size_t)bounds->total_tiles * map->total_weights;
+  return true;
+}
+
+static inline int tile_of_neuron(TileBounds *bounds, SOMMap *map, int neuron)
+{
+  return ((neuron / map->width) / bounds->tile_size) * bounds->tiles_x + (neuron % map->width) / bounds->tile_size;
+}
+
+// Exact bounding boxes of the current weights
+void refresh_tile_bounds(TileBounds *bounds, SOMMap *map)
+{
+  size_t total_bounds = (size_t)bounds->total_tiles * bounds->total_weights;
+
+  for (size_t b = 0; b < total_bounds; b++)
+  {
+    bounds->lower[b] = DBL_MAX;
+    bounds->upper[b] = -DBL_MAX;
+  }
+
+  for (int i = 0; i < map->total_weights; i++)
+    for (int n = 0; n < map->total_neurons; n++)
+    {
+      size_t b = (size_t)tile_of_neuron(bounds, map, n) * bounds->total_weights + i;
+      double weight = *get_neuron_weight(map, n, i);
+      bounds->lower[b] = fmin(bounds->lower[b], weight);
+      bounds->upper[b] = fmax(bounds->upper[b], weight);
+    }
+}
+
+// Distance along one axis of the torus from 'center' to the closest coordinate of [first, last)
+static int torus_distance_to_span(int center, int first, int last, int size)
+{
+  if ((center >= first) && (center < last))
+    return 0;
+  return min(wrap_coordinate(first - center, size), wrap_coordinate(center - (last - 1), size));
+}
+
+// Widens the boxes after an online update of the neighborhood of 'bmu' towards 'sample'. A weight moved by a
+// scale s becomes w + s * (sample - w), so a box only grows towards the sample by the largest scale of its tile,
+// the one of its closest neuron. When the neighborhood wraps over itself a neuron can be moved several times,
+// and the box is grown to the sample instead.
+void extend_tile_bounds(TileBounds *bounds, SOMMap *map, NeighborhoodKernel *kernel, BMU *bmu, Sample *sample)
+{
+  int first_x = 0, last_x = 0;
+
+  if (kernel->first_y >= kernel->last_y)
+    return;
+
+  for (int y = kernel->first_y; y < kernel->last_y; y++)
+  {
+    int row = y + kernel->int_radius;
+    if (y == kernel->first_y || kernel->first_x[row] < first_x)
+      first_x = kernel->first_x[row];
+    if (y == kernel->first_y || kernel->last_x[row] > last_x)
+      last_x = kernel->last_x[row];
+  }
+
+  bool wraps = (kernel->last_y - kernel->first_y > map->height) || (last_x - first_x > map->width);
+
+  for (int tile = 0; tile < bounds->total_tiles; tile++)
+  {
+    int tile_x = (tile % bounds->tiles_x) * bounds->tile_size;
+    int tile_y = (tile / bounds->tiles_x) * bounds->tile_size;
+    int dx = torus_distance_to_span(bmu->x_coord, tile_x, min(tile_x + bounds->tile_size, map->width), map->width);
+    int dy = torus_distance_to_span(bmu->y_coord, tile_y, min(tile_y + bounds->tile_size, map->height), map->height);
+    double distance2 = (double)(dx * dx + dy * dy);
+
+    if (distance2 >= pow2(kernel->radius))
+      continue;
+
+    double scale = wraps ? 1.0 : min(1.0, kernel->learning_rule * exp(-10.0 * distance2 / pow2(kernel->radius)));
+    size_t b = (size_t)tile * bounds->total_weights;
+    for (int i = 0; i < bounds->total_weights; i++, b++)
+    {
+      double component = sample->components[i];
+      double lower = fmin(bounds->lower[b], bounds->lower[b] + scale * (component - bounds->lower[b]));
+      double upper = fmax(bounds->upper[b], bounds->upper[b] + scale * (component - bounds->upper[b]));
+      double margin = TILE_BOUNDS_MARGIN * (fabs(lower) + fabs(upper));
+      bounds->lower[b] = lower - margin;
+      bounds->upper[b] = upper + margin;
+    }
+  }
+}
+
+// Squared distance from 'query' to the box of the tile, less the rounding of the distances of its neurons
+static double tile_lower_bound(TileBounds *bounds, int tile, const som_real *query)
+{
+  const double *lower = &bounds->lower[(size_t)tile * bounds->total_weights];
+  const double *upper = &bounds->upper[(size_t)tile * bounds->total_weights];
+  double distance = 0.0;
+
+  for (int i = 0; i < bounds->total_weights; i++)
+  {
+    if (query[i] < lower[i])
+      distance += pow2(query[i] - lower[i]);
+    else if (query[i] > upper[i])
+      distance += pow2(query[i] - upper[i]);
+  }
+
+  return distance * (1.0 - DISTANCE_ROUNDING_SLACK(bounds->total_weights));
+}
+
+// Scans the neurons of a tile and keeps the closest one, the lowest index on ties. Returns the neurons scanned.
+static int search_bmu_tile(TileBounds *bounds, SOMMap *map, const som_real *query, int tile, BMUCandidate *best)
+{
+  int first_x = (tile % bounds->tiles_x) * bounds->tile_size;
+  int first_y = (tile / bounds->tiles_x) * bounds->tile_size;
+  int last_x = min(first_x + bounds->tile_size, map->width);
+  int last_y = min(first_y + bounds->tile_size, map->height);
+
+  for (int y = first_y; y < last_y; y++)
+  {
+    // Neurons as close as the best one are also reported, so their index can break the tie
+    BMUCandidate candidate = {.distance = nextafter(best->distance, DBL_MAX), .neuron = -1};
+    search_bmu_range(map, query, y * map->width + first_x, y * map->width + last_x, &candidate);
+
+    if ((candidate.neuron >= 0) && ((candidate.distance < best->distance) || (candidate.neuron < best->neuron)))
+      *best = candidate;
+  }
+
+  return (last_x - first_x) * (last_y - first_y);
+}
+
+static int compare_tile_candidates(const void *a, const void *b)
+{
+  const TileCandidate *c1 = (const TileCandidate *)a;
+  const TileCandidate *c2 = (const TileCandidate *)b;
+
+  if (c1->lower_bound != c2->lower_bound)
+    return c1->lower_bound < c2->lower_bound ? -1 : 1;
+  return c1->tile - c2->tile;
+}
+
+// Same result as search_bmu, starting from the BMU cached in the sample. The new BMU is cached in the sample.
+// 'searcher' picks the candidates buffer, searches running at the same time must use different ones.
+void warm_search_bmu(TileBounds *bounds, int searcher, SOMMap *map, Sample *sample, BMUSearchStats *stats)
+{
+  const som_real *query = sample->components;
+  int start_tile = tile_of_neuron(bounds, map, sample->bmu.y_coord * map->width + sample->bmu.x_coord);
+  BMUCandidate best = {.distance = DBL_MAX, .neuron = map->total_neurons};
+  TileCandidate *candidates = &bounds->candidates[(size_t)searcher * bounds->total_tiles];
+  int total_candidates = 0;
+
+  stats->searches++;
+  stats->neurons_evaluated += search_bmu_tile(bounds, map, query, start_tile, &best);
+
+  for (int t = 0; t < bounds->total_tiles; t++)
+  {
+    double lower_bound;
+    if ((t != start_tile) && ((lower_bound = tile_lower_bound(bounds, t, query)) <= best.distance))
+      candidates[total_candidates++] = (TileCandidate){.lower_bound = lower_bound, .tile = t};
+  }
+
+  if (total_candidates > bounds->total_tiles * WARM_SEARCH_MAX_TILES_FRACTION)
+  {
+    // The boxes are too loose to discard most of the map
+    stats->full_scans++;
+    stats->neurons_evaluated += map->total_neurons;
+    best.distance = DBL_MAX;
+    search_bmu_range(map, query, 0, map->total_neurons, &best);
+  }
+  else if (total_candidates > 0)
+  {
+    // Closest boxes first, so the best distance shrinks as soon as possible
+    qsort(candidates, total_candidates, sizeof(TileCandidate), compare_tile_candidates);
+    for (int c = 0; (c < total_candidates) && (candidates[c].lower_bound <= best.distance); c++)
+      stats->neurons_evaluated += search_bmu_tile(bounds, map, query, candidates[c].tile, &best);
+  }
+
+  if (tile_of_neuron(bounds, map, best.neuron) == start_tile)
+    stats->warm_hits++;
+
+  sample->bmu.x_coord = best.neuron % map->width;
+  sample->bmu.y_coord = best.neuron / map->width;
+}
+
+void add_bmu_search_stats(BMUSearchStats *total, const BMUSearchStats *stats)
+{
+  total->searches += stats->searches;
+  total->warm_hits += stats->warm_hits;
+  total->full_scans += stats->full_scans;
+  total->neurons_evaluated += stats->neurons_evaluated;
+}
+
+void print_bmu_search_stats(const BMUSearchStats *stats, SOMMap *map)
+{
+  if (stats->searches == 0)
+    return;
+
+  printf("Warm BMU search: %ld searches | hit rate: %.1f%% | full scans: %.1f%% | neurons evaluated: %.1f%% of exhaustive\n",
+         stats->searches, 100.0 * stats->warm_hits / stats->searches, 100.0 * stats->full_scans / stats->searches,
+         100.0 * stats->neurons_evaluated / ((double)stats->searches * map->total_neurons));
+}